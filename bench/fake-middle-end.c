@@ -0,0 +1,221 @@
+/*
+    This file is part of MTProto-proxy
+
+    MTProto-proxy is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    MTProto-Server is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with MTProto-Server.  If not, see <http://www.gnu.org/licenses/>.
+
+    This program is released under the GPL with the additional exemption
+    that compiling, linking, and/or using OpenSSL is allowed.
+    You are free to remove this exemption from derived works.
+
+    Copyright 2014-2018 Telegram Messenger Inc
+*/
+
+/*
+  Loopback stand-in for a Telegram middle-end, used by the benchmark harness.
+
+  Accepts the proxy's RPC connections (nonce/DH/handshake and AES exactly as
+  the real middle-ends do, using the same --aes-pwd secret as the proxy),
+  and answers every RPC_PROXY_REQ with an RPC_PROXY_ANS carrying the client
+  payload back, optionally resized with --answer-size. The first bytes of the
+  payload are kept intact, so the load generator can match answers to queries.
+*/
+
+#define	_FILE_OFFSET_BITS	64
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "kprintf.h"
+#include "precise-time.h"
+#include "server-functions.h"
+#include "net/net-crypto-aes.h"
+#include "net/net-msg.h"
+#include "net/net-tcp-rpc-server.h"
+#include "mtproto/mtproto-common.h"
+#include "engine/engine.h"
+#include "engine/engine-net.h"
+
+#ifndef COMMIT
+#define COMMIT "unknown"
+#endif
+
+#define VERSION_STR	"fake-middle-end-0.01"
+const char FullVersionStr[] = VERSION_STR " compiled at " __DATE__ " " __TIME__ " by gcc " __VERSION__ " "
+#ifdef __LP64__
+  "64-bit"
+#else
+  "32-bit"
+#endif
+  " after commit " COMMIT;
+
+// RPC_PROXY_REQ header up to the optional extra block: type, flags, ext_conn_id, remote and our ip:port
+#define PROXY_REQ_HEADER_SIZE	offsetof (struct rpc_proxy_req, data)
+// bytes of the client payload always returned unchanged (auth_key_id and load generator tag)
+#define MIN_ANSWER_SIZE	24
+#define MAX_ANSWER_SIZE	(1 << 24)
+
+static int answer_size = -1;
+
+static long long queries_received, query_bytes_received, answers_sent, answer_bytes_sent, bad_queries, close_notifications;
+
+int fake_me_execute (connection_job_t C, int op, struct raw_message *raw) {
+  vkprintf (3, "fake_me_execute: fd=%d, op=%08x, len=%d\n", CONN_INFO(C)->fd, op, raw->total_bytes);
+
+  switch (op) {
+  case RPC_PROXY_REQ: {
+    struct rpc_proxy_req R;
+    if (rwm_fetch_data (raw, &R, PROXY_REQ_HEADER_SIZE) != PROXY_REQ_HEADER_SIZE) {
+      __sync_fetch_and_add (&bad_queries, 1);
+      return 0;
+    }
+    if (R.flags & 12) {
+      int extra_bytes;
+      if (rwm_fetch_data (raw, &extra_bytes, 4) != 4 || extra_bytes < 0 || extra_bytes > raw->total_bytes || rwm_skip_data (raw, extra_bytes) != extra_bytes) {
+        __sync_fetch_and_add (&bad_queries, 1);
+        return 0;
+      }
+    }
+    __sync_fetch_and_add (&queries_received, 1);
+    __sync_fetch_and_add (&query_bytes_received, raw->total_bytes);
+
+    if (answer_size >= 0) {
+      if (raw->total_bytes > answer_size) {
+        rwm_trunc (raw, answer_size);
+      }
+      static const int zero[256];
+      while (raw->total_bytes < answer_size) {
+        int l = answer_size - raw->total_bytes;
+        if (l > sizeof (zero)) {
+          l = sizeof (zero);
+        }
+        assert (rwm_push_data (raw, zero, l) == l);
+      }
+    }
+
+    struct {
+      int type;
+      int flags;
+      long long ext_conn_id;
+    } __attribute__ ((packed)) A = { .type = RPC_PROXY_ANS, .flags = 0, .ext_conn_id = R.ext_conn_id };
+    assert (rwm_push_data_front (raw, &A, sizeof (A)) == sizeof (A));
+
+    __sync_fetch_and_add (&answers_sent, 1);
+    __sync_fetch_and_add (&answer_bytes_sent, raw->total_bytes);
+    tcp_rpc_conn_send (JOB_REF_CREATE_PASS (C), raw, 0);
+    return 1;
+  }
+  case RPC_CLOSE_CONN:
+  case RPC_CLOSE_EXT:
+    __sync_fetch_and_add (&close_notifications, 1);
+    return 0;
+  default:
+    vkprintf (1, "unknown RPC operation %08x, ignoring\n", op);
+    return 0;
+  }
+}
+
+// the proxy negotiates plain AES unless told otherwise, DH is done only when the proxy offers it
+int fake_me_check_perm (connection_job_t C) {
+  return RPCF_ALLOW_ENC | RPCF_REQ_DH | RPCF_ALLOW_SKIP_DH | tcp_get_default_rpc_flags ();
+}
+
+struct tcp_rpc_server_functions fake_me_rpc_server = {
+  .execute = fake_me_execute,
+  .check_ready = server_check_ready,
+  .flush_packet = tcp_rpc_flush_packet,
+  .rpc_check_perm = fake_me_check_perm,
+  .rpc_init_crypto = tcp_rpcs_init_crypto,
+  .max_packet_len = MAX_ANSWER_SIZE + (1 << 16),
+  .mode_flags = TCP_RPC_IGNORE_PID,
+};
+
+void fake_me_prepare_stats (stats_buffer_t *sb) {
+  sb_printf (sb,
+    "queries_received\t%lld\n"
+    "query_bytes_received\t%lld\n"
+    "answers_sent\t%lld\n"
+    "answer_bytes_sent\t%lld\n"
+    "bad_queries\t%lld\n"
+    "close_notifications\t%lld\n"
+    "answer_size\t%d\n",
+    queries_received,
+    query_bytes_received,
+    answers_sent,
+    answer_bytes_sent,
+    bad_queries,
+    close_notifications,
+    answer_size
+  );
+}
+
+void fake_me_on_exit (void) {
+  kprintf ("fake middle-end: %lld queries (%lld bytes) received, %lld answers (%lld bytes) sent, %lld bad queries\n", queries_received, query_bytes_received, answers_sent, answer_bytes_sent, bad_queries);
+}
+
+int fake_me_parse_option (int val) {
+  switch (val) {
+  case 2000:
+    answer_size = atoi (optarg);
+    if (answer_size < MIN_ANSWER_SIZE || answer_size > MAX_ANSWER_SIZE || (answer_size & 3)) {
+      kprintf ("fatal: answer size must be a multiple of 4 in range %d..%d\n", MIN_ANSWER_SIZE, MAX_ANSWER_SIZE);
+      exit (2);
+    }
+    break;
+  default:
+    return -1;
+  }
+  return 0;
+}
+
+void fake_me_prepare_parse_options (void) {
+  parse_option ("answer-size", required_argument, 0, 2000, "size of answer payloads in bytes; by default every query payload is echoed back unchanged");
+}
+
+void fake_me_parse_extra_args (int argc, char *argv[]) {
+  if (argc) {
+    printf ("usage: %s [-v] -p<port> --aes-pwd <secret-file> [--answer-size <bytes>]\n", progname);
+    printf ("%s\n", FullVersionStr);
+    printf ("\tFake middle-end for proxy benchmarks\n");
+    parse_usage ();
+    exit (2);
+  }
+}
+
+void fake_me_pre_start (void) {
+  if (!aes_initialized) {
+    kprintf ("fatal: no secret loaded, pass the proxy's secret file with --aes-pwd\n");
+    exit (1);
+  }
+}
+
+server_functions_t fake_me_functions = {
+  .prepare_stats = fake_me_prepare_stats,
+  .on_exit = fake_me_on_exit,
+  .parse_option = fake_me_parse_option,
+  .prepare_parse_options = fake_me_prepare_parse_options,
+  .parse_extra_args = fake_me_parse_extra_args,
+  .pre_start = fake_me_pre_start,
+  .epoll_timeout = 1,
+  .FullVersionStr = FullVersionStr,
+  .ShortVersionStr = "fake-middle-end",
+  .tcp_methods = &fake_me_rpc_server,
+};
+
+int main (int argc, char *argv[]) {
+  return default_main (&fake_me_functions, argc, argv);
+}
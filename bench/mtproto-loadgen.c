@@ -0,0 +1,850 @@
+/*
+    This file is part of MTProto-proxy
+
+    MTProto-proxy is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    MTProto-Server is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with MTProto-Server.  If not, see <http://www.gnu.org/licenses/>.
+
+    This program is released under the GPL with the additional exemption
+    that compiling, linking, and/or using OpenSSL is allowed.
+    You are free to remove this exemption from derived works.
+
+    Copyright 2014-2018 Telegram Messenger Inc
+*/
+
+/*
+  Client load generator for proxy benchmarks.
+
+  Opens many connections to a proxy using one of the client transports
+  (obfuscated abridged, intermediate, padded intermediate, or fake-TLS),
+  keeps a configurable number of encrypted-looking MTProto packets in flight
+  on each of them, and matches the answers echoed by bench/fake-middle-end
+  to compute round-trip latency. Every thread runs its own epoll loop over
+  its share of the connections.
+*/
+
+#define	_FILE_OFFSET_BITS	64
+
+#include <assert.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <openssl/rand.h>
+
+#include "sha256.h"
+#include "crypto/aesni256.h"
+
+#define MAX_THREADS	256
+#define MAX_QUERY_SIZE	(1 << 20)
+// auth_key_id, msg_key and the encrypted header: smallest packet the proxy forwards
+#define MIN_QUERY_SIZE	56
+#define MAX_TLS_RECORD_SIZE	16384
+#define READ_BUFFER_SIZE	(1 << 18)
+#define DRAIN_TIME	1.0
+
+enum transport {
+  TR_ABRIDGED,
+  TR_INTERMEDIATE,
+  TR_PADDED,
+  TR_TLS
+};
+
+static const char *transport_names[] = { "abridged", "intermediate", "padded", "tls" };
+static const unsigned transport_tags[] = { 0xefefefef, 0xeeeeeeee, 0xdddddddd, 0xdddddddd };
+
+enum conn_state {
+  CS_FREE,
+  CS_CONNECTING,
+  CS_TLS_HELLO,	// ClientHello sent, waiting for the fake ServerHello
+  CS_RUNNING
+};
+
+/* tag at the start of each query payload, echoed back by the fake middle-end */
+struct query_tag {
+  long long auth_key_id;
+  long long send_time;
+  long long seq;
+};
+
+struct lg_conn {
+  int fd;
+  int state;
+  int in_flight;
+  int answered;
+  long long seq;
+  struct aes256_ctx *enc, *dec;
+  // bytes waiting for the socket to become writable
+  unsigned char *wbuf;
+  int wlen, wpos, wcap;
+  // raw bytes read from the socket, not yet parsed
+  unsigned char *rbuf;
+  int rlen;
+  // decrypted transport stream
+  unsigned char *sbuf;
+  int slen;
+  int epoll_out;
+};
+
+struct lg_thread {
+  pthread_t thread;
+  int id;
+  int epoll_fd;
+  int conn_num;
+  struct lg_conn *conns;
+  // results
+  long long connections_opened, connections_completed, connect_errors, connection_failures;
+  long long queries_sent, answers_received, bad_answers;
+  long long bytes_sent, bytes_received;
+  float *latencies;
+  long long latencies_num, latencies_cap;
+} __attribute__ ((aligned (64)));
+
+static struct sockaddr_in proxy_addr;
+static unsigned char secret[16];
+static char *tls_domain;
+static int transport = TR_INTERMEDIATE;
+static int target_dc = 2;
+static int connections = 100;
+static int threads = 1;
+static int queries_per_connection;
+static int window = 1;
+static int query_size = 256;
+static double duration = 10;
+
+static double start_time, finish_time;
+static volatile int stop_sending;
+
+static struct lg_thread T[MAX_THREADS];
+
+static inline double get_time (void) {
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static inline long long get_time_ns (void) {
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void random_bytes (void *buf, int len) {
+  assert (RAND_bytes (buf, len) == 1);
+}
+
+/*
+ *
+ *	OUTPUT
+ *
+ */
+
+static void wbuf_reserve (struct lg_conn *C, int len) {
+  if (C->wpos == C->wlen) {
+    C->wpos = C->wlen = 0;
+  }
+  if (C->wlen + len > C->wcap) {
+    if (C->wpos) {
+      memmove (C->wbuf, C->wbuf + C->wpos, C->wlen - C->wpos);
+      C->wlen -= C->wpos;
+      C->wpos = 0;
+    }
+    if (C->wlen + len > C->wcap) {
+      C->wcap = 2 * (C->wlen + len);
+      C->wbuf = realloc (C->wbuf, C->wcap);
+      assert (C->wbuf);
+    }
+  }
+}
+
+static void wbuf_append (struct lg_conn *C, const void *data, int len) {
+  wbuf_reserve (C, len);
+  memcpy (C->wbuf + C->wlen, data, len);
+  C->wlen += len;
+}
+
+// appends transport stream bytes: encrypted, and cut into application data records in TLS mode
+static void send_stream (struct lg_conn *C, const unsigned char *data, int len) {
+  while (len > 0) {
+    int l = len;
+    if (transport == TR_TLS) {
+      if (l > MAX_TLS_RECORD_SIZE) {
+        l = MAX_TLS_RECORD_SIZE;
+      }
+      unsigned char hdr[5] = { 0x17, 0x03, 0x03, l >> 8, l & 255 };
+      wbuf_append (C, hdr, 5);
+    }
+    wbuf_reserve (C, l);
+    aes256_crypt (C->enc, data, C->wbuf + C->wlen, l);
+    C->wlen += l;
+    data += l;
+    len -= l;
+  }
+}
+
+static void set_epoll_out (struct lg_thread *TH, struct lg_conn *C, int on) {
+  if (C->epoll_out != on) {
+    struct epoll_event ev = { .events = EPOLLIN | (on ? EPOLLOUT : 0), .data.ptr = C };
+    epoll_ctl (TH->epoll_fd, EPOLL_CTL_MOD, C->fd, &ev);
+    C->epoll_out = on;
+  }
+}
+
+static int flush_conn (struct lg_thread *TH, struct lg_conn *C) {
+  while (C->wpos < C->wlen) {
+    int r = send (C->fd, C->wbuf + C->wpos, C->wlen - C->wpos, MSG_NOSIGNAL);
+    if (r < 0) {
+      if (errno == EAGAIN || errno == EINTR) {
+        set_epoll_out (TH, C, 1);
+        return 0;
+      }
+      return -1;
+    }
+    TH->bytes_sent += r;
+    C->wpos += r;
+  }
+  set_epoll_out (TH, C, 0);
+  return 0;
+}
+
+static void send_query (struct lg_thread *TH, struct lg_conn *C) {
+  static __thread unsigned char packet[MAX_QUERY_SIZE + 16];
+  int pos = 4, pad = 0;
+
+  if (transport == TR_ABRIDGED) {
+    if (query_size <= 0x7e * 4) {
+      packet[0] = query_size >> 2;
+      pos = 1;
+    } else {
+      int l = ((query_size >> 2) << 8) | 0x7f;
+      memcpy (packet, &l, 4);
+    }
+  } else {
+    // padded transports: random tail shorter than 4 bytes, cut off by the proxy
+    pad = transport >= TR_PADDED ? lrand48 () & 3 : 0;
+    int l = query_size + pad;
+    memcpy (packet, &l, 4);
+  }
+
+  struct query_tag *Q = (struct query_tag *) (packet + pos);
+  Q->auth_key_id = 0x5eed000000000000LL | ((long long) TH->id << 32) | (C - TH->conns);
+  Q->send_time = get_time_ns ();
+  Q->seq = C->seq++;
+  memset (packet + pos + sizeof (*Q), 0, query_size - sizeof (*Q));
+  if (pad) {
+    random_bytes (packet + pos + query_size, pad);
+  }
+
+  send_stream (C, packet, pos + query_size + pad);
+  C->in_flight++;
+  TH->queries_sent++;
+}
+
+/*
+ *
+ *	CONNECTION SETUP
+ *
+ */
+
+// 64-byte obfuscated header; sets up both stream ciphers and queues the header for sending
+static void start_obfuscated_stream (struct lg_conn *C) {
+  unsigned char h[64], k[48], key[32], iv[16];
+  unsigned tag = transport_tags[transport];
+  while (1) {
+    random_bytes (h, 64);
+    unsigned first = *(unsigned *) h;
+    if (h[0] == 0xef || !*(unsigned *) (h + 4)) {
+      continue;
+    }
+    if (first == *(unsigned *) "HEAD" || first == *(unsigned *) "POST" || first == *(unsigned *) "GET " || first == *(unsigned *) "OPTI" || first == 0x02010316 || first == 0xdddddddd || first == 0xeeeeeeee) {
+      continue;
+    }
+    break;
+  }
+  memcpy (h + 56, &tag, 4);
+  short dc = target_dc;
+  memcpy (h + 60, &dc, 2);
+
+  memcpy (k, h + 8, 32);
+  memcpy (k + 32, secret, 16);
+  sha256 (k, 48, key);
+  C->enc = aes256_ctx_init (AES256_CTR, key, h + 40);
+
+  int i;
+  for (i = 0; i < 32; i++) {
+    k[i] = h[55 - i];
+  }
+  for (i = 0; i < 16; i++) {
+    iv[i] = h[23 - i];
+  }
+  memcpy (k + 32, secret, 16);
+  sha256 (k, 48, key);
+  C->dec = aes256_ctx_init (AES256_CTR, key, iv);
+
+  unsigned char e[64];
+  aes256_crypt (C->enc, h, e, 64);
+  memcpy (e, h, 56);
+
+  if (transport == TR_TLS) {
+    // dummy ChangeCipherSpec, then the header opens the first application data record
+    wbuf_append (C, "\x14\x03\x03\x00\x01\x01", 6);
+    unsigned char hdr[5] = { 0x17, 0x03, 0x03, 0, 64 };
+    wbuf_append (C, hdr, 5);
+  }
+  wbuf_append (C, e, 64);
+}
+
+static void send_tls_client_hello (struct lg_conn *C) {
+  unsigned char h[517];
+  memset (h, 0, sizeof (h));
+  memcpy (h, "\x16\x03\x01\x02\x00\x01\x00\x01\xfc\x03\x03", 11);
+  h[43] = 0x20;
+  random_bytes (h + 44, 32);
+  int p = 76;
+  memcpy (h + p, "\x00\x02\x13\x01\x01\x00", 6);
+  p += 6;
+  int ext_len = sizeof (h) - p - 2;
+  h[p++] = ext_len >> 8;
+  h[p++] = ext_len & 255;
+  int dl = strlen (tls_domain);
+  // server_name extension
+  h[p++] = 0; h[p++] = 0; h[p++] = 0; h[p++] = dl + 5;
+  h[p++] = 0; h[p++] = dl + 3; h[p++] = 0; h[p++] = 0; h[p++] = dl;
+  memcpy (h + p, tls_domain, dl);
+  p += dl;
+  // padding extension up to the fixed hello size
+  int pad = sizeof (h) - p - 4;
+  h[p++] = 0; h[p++] = 0x15; h[p++] = pad >> 8; h[p++] = pad & 255;
+
+  unsigned char mac[32];
+  sha256_hmac (secret, 16, h, sizeof (h), mac);
+  int ts = time (0);
+  *(int *) (mac + 28) ^= ts;
+  memcpy (h + 11, mac, 32);
+
+  wbuf_append (C, h, sizeof (h));
+}
+
+static void open_conn (struct lg_thread *TH, struct lg_conn *C) {
+  C->fd = socket (AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  assert (C->fd >= 0);
+  int one = 1;
+  setsockopt (C->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+  int r = connect (C->fd, (struct sockaddr *) &proxy_addr, sizeof (proxy_addr));
+  if (r < 0 && errno != EINPROGRESS) {
+    TH->connect_errors++;
+    close (C->fd);
+    C->fd = -1;
+    C->state = CS_FREE;
+    return;
+  }
+  C->state = CS_CONNECTING;
+  C->in_flight = C->answered = 0;
+  C->wlen = C->wpos = C->rlen = C->slen = 0;
+  C->epoll_out = 1;
+  TH->connections_opened++;
+  struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT, .data.ptr = C };
+  assert (epoll_ctl (TH->epoll_fd, EPOLL_CTL_ADD, C->fd, &ev) >= 0);
+}
+
+static void close_conn (struct lg_thread *TH, struct lg_conn *C) {
+  if (C->fd >= 0) {
+    epoll_ctl (TH->epoll_fd, EPOLL_CTL_DEL, C->fd, 0);
+    close (C->fd);
+    C->fd = -1;
+  }
+  if (C->enc) {
+    aes256_ctx_free (C->enc);
+    aes256_ctx_free (C->dec);
+    C->enc = C->dec = 0;
+  }
+  C->state = CS_FREE;
+}
+
+static void fill_window (struct lg_thread *TH, struct lg_conn *C) {
+  while (!stop_sending && C->in_flight < window && (!queries_per_connection || C->answered + C->in_flight < queries_per_connection)) {
+    send_query (TH, C);
+  }
+}
+
+static void start_running (struct lg_thread *TH, struct lg_conn *C) {
+  C->state = CS_RUNNING;
+  start_obfuscated_stream (C);
+  fill_window (TH, C);
+}
+
+/*
+ *
+ *	INPUT
+ *
+ */
+
+static void add_latency (struct lg_thread *TH, double us) {
+  if (TH->latencies_num == TH->latencies_cap) {
+    TH->latencies_cap = TH->latencies_cap ? 2 * TH->latencies_cap : (1 << 16);
+    TH->latencies = realloc (TH->latencies, TH->latencies_cap * sizeof (float));
+    assert (TH->latencies);
+  }
+  TH->latencies[TH->latencies_num++] = us;
+}
+
+static void stream_append (struct lg_conn *C, const unsigned char *data, int len) {
+  assert (C->slen + len <= READ_BUFFER_SIZE + MAX_QUERY_SIZE);
+  aes256_crypt (C->dec, data, C->sbuf + C->slen, len);
+  C->slen += len;
+}
+
+// returns -1 on protocol error
+static int parse_answers (struct lg_thread *TH, struct lg_conn *C) {
+  int pos = 0;
+  while (1) {
+    int hdr_len, len;
+    if (transport == TR_ABRIDGED) {
+      if (C->slen - pos < 1) {
+        break;
+      }
+      if (C->sbuf[pos] == 0x7f) {
+        if (C->slen - pos < 4) {
+          break;
+        }
+        len = (*(unsigned *) (C->sbuf + pos) >> 8) << 2;
+        hdr_len = 4;
+      } else {
+        len = (C->sbuf[pos] & 0x7f) << 2;
+        hdr_len = 1;
+      }
+    } else {
+      if (C->slen - pos < 4) {
+        break;
+      }
+      len = *(unsigned *) (C->sbuf + pos);
+      hdr_len = 4;
+      if (len & 0x80000000) {
+        // quick ack token
+        pos += 4;
+        continue;
+      }
+    }
+    if (len <= 0 || len > MAX_QUERY_SIZE) {
+      return -1;
+    }
+    if (C->slen - pos < hdr_len + len) {
+      break;
+    }
+    struct query_tag *Q = (struct query_tag *) (C->sbuf + pos + hdr_len);
+    if (len < sizeof (*Q) || (Q->auth_key_id >> 48) != 0x5eed) {
+      TH->bad_answers++;
+    } else {
+      add_latency (TH, (get_time_ns () - Q->send_time) * 1e-3);
+    }
+    pos += hdr_len + len;
+    TH->answers_received++;
+    C->answered++;
+    C->in_flight--;
+  }
+  if (pos) {
+    memmove (C->sbuf, C->sbuf + pos, C->slen - pos);
+    C->slen -= pos;
+  }
+  return 0;
+}
+
+// strips TLS record headers; returns -1 on error
+static int process_tls_records (struct lg_thread *TH, struct lg_conn *C) {
+  int pos = 0;
+  while (C->rlen - pos >= 5) {
+    unsigned char *R = C->rbuf + pos;
+    int len = (R[3] << 8) + R[4];
+    if (R[1] != 3 || R[2] != 3 || C->rlen - pos < 5 + len) {
+      if (R[1] != 3 || R[2] != 3) {
+        return -1;
+      }
+      break;
+    }
+    if (C->state == CS_TLS_HELLO) {
+      // ServerHello, ChangeCipherSpec and one application data record with random bytes
+      if (R[0] == 0x17) {
+        start_running (TH, C);
+      }
+    } else if (R[0] == 0x17) {
+      stream_append (C, R + 5, len);
+    } else {
+      return -1;
+    }
+    pos += 5 + len;
+  }
+  if (pos) {
+    memmove (C->rbuf, C->rbuf + pos, C->rlen - pos);
+    C->rlen -= pos;
+  }
+  return 0;
+}
+
+static int read_conn (struct lg_thread *TH, struct lg_conn *C) {
+  while (1) {
+    int r = recv (C->fd, C->rbuf + C->rlen, READ_BUFFER_SIZE - C->rlen, 0);
+    if (r < 0) {
+      if (errno == EAGAIN || errno == EINTR) {
+        return 0;
+      }
+      return -1;
+    }
+    if (!r) {
+      return -1;
+    }
+    TH->bytes_received += r;
+    if (transport == TR_TLS) {
+      C->rlen += r;
+      if (process_tls_records (TH, C) < 0) {
+        return -1;
+      }
+    } else {
+      stream_append (C, C->rbuf, r);
+    }
+    if (parse_answers (TH, C) < 0) {
+      return -1;
+    }
+  }
+}
+
+static void conn_event (struct lg_thread *TH, struct lg_conn *C, unsigned events) {
+  if (C->state == CS_CONNECTING) {
+    int err = 0;
+    socklen_t l = sizeof (err);
+    getsockopt (C->fd, SOL_SOCKET, SO_ERROR, &err, &l);
+    if (err || (events & (EPOLLERR | EPOLLHUP))) {
+      TH->connect_errors++;
+      TH->connections_opened--;
+      close_conn (TH, C);
+      return;
+    }
+    if (transport == TR_TLS) {
+      C->state = CS_TLS_HELLO;
+      send_tls_client_hello (C);
+    } else {
+      start_running (TH, C);
+    }
+  } else if (events & EPOLLIN) {
+    if (read_conn (TH, C) < 0) {
+      if (!stop_sending) {
+        TH->connection_failures++;
+      }
+      close_conn (TH, C);
+      return;
+    }
+    if (C->state == CS_RUNNING) {
+      if (queries_per_connection && C->answered >= queries_per_connection) {
+        TH->connections_completed++;
+        close_conn (TH, C);
+        return;
+      }
+      fill_window (TH, C);
+    }
+  }
+  if (flush_conn (TH, C) < 0) {
+    TH->connection_failures++;
+    close_conn (TH, C);
+  }
+}
+
+static void *thread_run (void *arg) {
+  struct lg_thread *TH = arg;
+  TH->epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
+  assert (TH->epoll_fd >= 0);
+
+  int i;
+  for (i = 0; i < TH->conn_num; i++) {
+    struct lg_conn *C = &TH->conns[i];
+    C->fd = -1;
+    C->rbuf = malloc (READ_BUFFER_SIZE);
+    C->sbuf = malloc (READ_BUFFER_SIZE + MAX_QUERY_SIZE);
+    assert (C->rbuf && C->sbuf);
+    open_conn (TH, C);
+  }
+
+  struct epoll_event ev[256];
+  while (1) {
+    double t = get_time ();
+    if (t > finish_time + DRAIN_TIME) {
+      break;
+    }
+    int n = epoll_wait (TH->epoll_fd, ev, 256, 10);
+    for (i = 0; i < n; i++) {
+      struct lg_conn *C = ev[i].data.ptr;
+      if (C->state != CS_FREE) {
+        conn_event (TH, C, ev[i].events);
+      }
+    }
+    if (stop_sending) {
+      int busy = 0;
+      for (i = 0; i < TH->conn_num && !busy; i++) {
+        busy = TH->conns[i].state != CS_FREE && TH->conns[i].in_flight > 0;
+      }
+      if (!busy) {
+        break;
+      }
+      continue;
+    }
+    for (i = 0; i < TH->conn_num; i++) {
+      if (TH->conns[i].state == CS_FREE) {
+        open_conn (TH, &TH->conns[i]);
+      }
+    }
+  }
+
+  for (i = 0; i < TH->conn_num; i++) {
+    close_conn (TH, &TH->conns[i]);
+  }
+  close (TH->epoll_fd);
+  return 0;
+}
+
+/*
+ *
+ *	MAIN
+ *
+ */
+
+static int cmp_float (const void *a, const void *b) {
+  float x = *(const float *) a, y = *(const float *) b;
+  return x < y ? -1 : x > y;
+}
+
+static void print_results (void) {
+  struct lg_thread S;
+  memset (&S, 0, sizeof (S));
+  int i;
+  for (i = 0; i < threads; i++) {
+    S.connections_opened += T[i].connections_opened;
+    S.connections_completed += T[i].connections_completed;
+    S.connect_errors += T[i].connect_errors;
+    S.connection_failures += T[i].connection_failures;
+    S.queries_sent += T[i].queries_sent;
+    S.answers_received += T[i].answers_received;
+    S.bad_answers += T[i].bad_answers;
+    S.bytes_sent += T[i].bytes_sent;
+    S.bytes_received += T[i].bytes_received;
+    S.latencies_num += T[i].latencies_num;
+  }
+  float *L = malloc ((S.latencies_num + 1) * sizeof (float));
+  assert (L);
+  long long k = 0;
+  for (i = 0; i < threads; i++) {
+    memcpy (L + k, T[i].latencies, T[i].latencies_num * sizeof (float));
+    k += T[i].latencies_num;
+  }
+  qsort (L, S.latencies_num, sizeof (float), cmp_float);
+
+  double elapsed = duration;
+  printf (
+    "transport\t%s\n"
+    "connections\t%d\n"
+    "threads\t%d\n"
+    "window\t%d\n"
+    "query_size\t%d\n"
+    "queries_per_connection\t%d\n"
+    "duration\t%.3f\n"
+    "connections_opened\t%lld\n"
+    "connections_completed\t%lld\n"
+    "connections_per_second\t%.1f\n"
+    "connect_errors\t%lld\n"
+    "connection_failures\t%lld\n"
+    "queries_sent\t%lld\n"
+    "answers_received\t%lld\n"
+    "bad_answers\t%lld\n"
+    "packets_per_second\t%.1f\n"
+    "bytes_sent\t%lld\n"
+    "bytes_received\t%lld\n"
+    "send_bytes_per_second\t%.0f\n"
+    "recv_bytes_per_second\t%.0f\n",
+    transport_names[transport],
+    connections,
+    threads,
+    window,
+    query_size,
+    queries_per_connection,
+    elapsed,
+    S.connections_opened,
+    S.connections_completed,
+    (queries_per_connection ? S.connections_completed : S.connections_opened) / elapsed,
+    S.connect_errors,
+    S.connection_failures,
+    S.queries_sent,
+    S.answers_received,
+    S.bad_answers,
+    S.answers_received / elapsed,
+    S.bytes_sent,
+    S.bytes_received,
+    S.bytes_sent / elapsed,
+    S.bytes_received / elapsed
+  );
+
+  static const double percentiles[] = { 50, 90, 99, 99.9 };
+  static const char *percentile_names[] = { "p50", "p90", "p99", "p999" };
+  for (i = 0; i < 4; i++) {
+    long long j = S.latencies_num ? (long long) (percentiles[i] / 100 * (S.latencies_num - 1) + 0.5) : 0;
+    printf ("latency_%s_us\t%.1f\n", percentile_names[i], S.latencies_num ? L[j] : 0.0);
+  }
+  printf ("latency_max_us\t%.1f\n", S.latencies_num ? L[S.latencies_num - 1] : 0.0);
+  free (L);
+}
+
+static int hex_to_bytes (const char *s, unsigned char *out, int max_len) {
+  int n = 0;
+  while (s[0] && s[1] && n < max_len) {
+    unsigned v;
+    if (sscanf (s, "%2x", &v) != 1) {
+      return -1;
+    }
+    out[n++] = v;
+    s += 2;
+  }
+  return *s ? -1 : n;
+}
+
+// accepts plain 16-byte hex secrets as well as `dd` (padded) and `ee` (fake-TLS with domain) client secrets
+static void parse_secret (const char *s) {
+  static unsigned char buf[256 + 17];
+  int n = hex_to_bytes (s, buf, sizeof (buf) - 1);
+  if (n == 16) {
+    memcpy (secret, buf, 16);
+  } else if (n == 17 && buf[0] == 0xdd) {
+    memcpy (secret, buf + 1, 16);
+    transport = TR_PADDED;
+  } else if (n > 17 && buf[0] == 0xee) {
+    memcpy (secret, buf + 1, 16);
+    buf[n] = 0;
+    tls_domain = (char *) buf + 17;
+    transport = TR_TLS;
+  } else {
+    fprintf (stderr, "bad secret `%s'\n", s);
+    exit (2);
+  }
+}
+
+static void usage (const char *progname) {
+  printf ("usage: %s [-t <transport>] [-D <domain>] [-c <connections>] [-T <threads>] [-w <window>] [-s <query-size>] [-n <queries-per-connection>] [-d <seconds>] [-x <dc>] <host>:<port> <secret>\n"
+    "\tLoad generator for MTProto proxy benchmarks against bench/fake-middle-end\n"
+    "\t-t\ttransport: abridged, intermediate (default), padded or tls\n"
+    "\t-D\tdomain for the tls transport, also taken from ee-secrets\n"
+    "\t-c\tnumber of simultaneously open connections (default %d)\n"
+    "\t-T\tnumber of threads (default %d)\n"
+    "\t-w\tqueries in flight on each connection (default %d)\n"
+    "\t-s\tquery size in bytes, multiple of 4, at least %d (default %d)\n"
+    "\t-n\treconnect after this number of answers, 0 keeps connections for the whole run (default %d)\n"
+    "\t-d\tduration of the run in seconds (default %.0f)\n"
+    "\t-x\ttarget datacenter passed in the transport header (default %d)\n",
+    progname, connections, threads, window, MIN_QUERY_SIZE, query_size, queries_per_connection, duration, target_dc);
+  exit (2);
+}
+
+int main (int argc, char *argv[]) {
+  int i;
+  while ((i = getopt (argc, argv, "t:D:c:T:w:s:n:d:x:h")) != -1) {
+    switch (i) {
+    case 't':
+      for (transport = 0; transport < 4 && strcmp (optarg, transport_names[transport]); transport++) {
+      }
+      if (transport == 4) {
+        usage (argv[0]);
+      }
+      break;
+    case 'D':
+      tls_domain = optarg;
+      break;
+    case 'c':
+      connections = atoi (optarg);
+      break;
+    case 'T':
+      threads = atoi (optarg);
+      break;
+    case 'w':
+      window = atoi (optarg);
+      break;
+    case 's':
+      query_size = atoi (optarg);
+      break;
+    case 'n':
+      queries_per_connection = atoi (optarg);
+      break;
+    case 'd':
+      duration = atof (optarg);
+      break;
+    case 'x':
+      target_dc = atoi (optarg);
+      break;
+    default:
+      usage (argv[0]);
+    }
+  }
+  if (argc != optind + 2) {
+    usage (argv[0]);
+  }
+
+  char *colon = strrchr (argv[optind], ':');
+  if (!colon) {
+    usage (argv[0]);
+  }
+  *colon = 0;
+  proxy_addr.sin_family = AF_INET;
+  proxy_addr.sin_port = htons (atoi (colon + 1));
+  if (inet_pton (AF_INET, argv[optind], &proxy_addr.sin_addr) != 1) {
+    fprintf (stderr, "bad IPv4 address `%s'\n", argv[optind]);
+    exit (2);
+  }
+  parse_secret (argv[optind + 1]);
+
+  if (transport == TR_TLS && !tls_domain) {
+    fprintf (stderr, "tls transport needs a domain\n");
+    exit (2);
+  }
+  if (connections <= 0 || threads <= 0 || threads > MAX_THREADS || threads > connections || window <= 0 || queries_per_connection < 0 || duration <= 0) {
+    usage (argv[0]);
+  }
+  if (query_size < MIN_QUERY_SIZE || query_size > MAX_QUERY_SIZE - 16 || (query_size & 3)) {
+    usage (argv[0]);
+  }
+
+  srand48 (time (0) ^ getpid ());
+  start_time = get_time ();
+  finish_time = start_time + duration;
+
+  for (i = 0; i < threads; i++) {
+    T[i].id = i;
+    T[i].conn_num = connections / threads + (i < connections % threads);
+    T[i].conns = calloc (T[i].conn_num, sizeof (struct lg_conn));
+    assert (T[i].conns);
+    assert (!pthread_create (&T[i].thread, 0, thread_run, &T[i]));
+  }
+
+  while (get_time () < finish_time) {
+    usleep (10000);
+  }
+  stop_sending = 1;
+  duration = get_time () - start_time;
+
+  for (i = 0; i < threads; i++) {
+    pthread_join (T[i].thread, 0);
+  }
+
+  print_results ();
+  return 0;
+}
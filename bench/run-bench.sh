@@ -0,0 +1,81 @@
+#!/bin/sh
+#
+# Loopback proxy benchmark: starts bench/fake-middle-end and mtproto-proxy with
+# a proxy config pointing at 127.0.0.1, then runs mtproto-loadgen once per
+# client transport. Build everything first with `make all bench`.
+#
+# Environment overrides (defaults in brackets):
+#   BIN [objs/bin]  ME_PORT [18888]  PROXY_PORT [14433]  STATS_PORT [18880]  MAXCONN [10000]
+#   TRANSPORTS [abridged intermediate padded tls]
+#   PROXY_ARGS [--multithread]  ME_ARGS []  LOADGEN_ARGS [-c 100 -w 4 -d 10]
+#
+# Results are printed in the loadgen's tab-separated format, one block per transport.
+
+set -e
+
+BIN=${BIN:-objs/bin}
+ME_PORT=${ME_PORT:-18888}
+PROXY_PORT=${PROXY_PORT:-14433}
+STATS_PORT=${STATS_PORT:-18880}
+MAXCONN=${MAXCONN:-10000}
+TRANSPORTS=${TRANSPORTS:-"abridged intermediate padded tls"}
+PROXY_ARGS=${PROXY_ARGS:---multithread}
+ME_ARGS=${ME_ARGS:-}
+LOADGEN_ARGS=${LOADGEN_ARGS:-"-c 100 -w 4 -d 10"}
+DOMAIN=localhost
+SECRET=0123456789abcdef0123456789abcdef
+
+WORK=$(mktemp -d)
+PIDS=
+cleanup () {
+  [ -n "$PIDS" ] && kill $PIDS 2>/dev/null
+  wait 2>/dev/null
+  rm -rf "$WORK"
+}
+trap cleanup EXIT INT TERM
+
+USER_ARGS=
+[ "$(id -u)" = 0 ] && USER_ARGS="-u root"
+
+# middle-end RPC secret shared by the proxy and the fake middle-end
+head -c 128 /dev/urandom > "$WORK/proxy-secret"
+for dc in 1 2 3 4 5; do
+  echo "proxy_for $dc 127.0.0.1:$ME_PORT;"
+  echo "proxy_for -$dc 127.0.0.1:$ME_PORT;"
+done > "$WORK/proxy.conf"
+
+"$BIN/fake-middle-end" $USER_ARGS -c "$MAXCONN" -p "$ME_PORT" --aes-pwd "$WORK/proxy-secret" $ME_ARGS > "$WORK/fake-middle-end.log" 2>&1 &
+PIDS="$PIDS $!"
+
+start_proxy () {
+  "$BIN/mtproto-proxy" $USER_ARGS -c "$MAXCONN" -p "$STATS_PORT" -H "$PROXY_PORT" --http-stats -S "$SECRET" --aes-pwd "$WORK/proxy-secret" $PROXY_ARGS "$@" "$WORK/proxy.conf" >> "$WORK/mtproto-proxy.log" 2>&1 &
+  PROXY_PID=$!
+  # wait until the proxy has a ready connection to the fake middle-end
+  for i in $(seq 50); do
+    sleep 0.2
+    if curl -s "http://127.0.0.1:$STATS_PORT/stats" 2>/dev/null | grep -q "^ready_targets	[1-9]"; then
+      return 0
+    fi
+  done
+  echo "proxy did not connect to the fake middle-end" >&2
+  tail -n 5 "$WORK/mtproto-proxy.log" "$WORK/fake-middle-end.log" >&2
+  kill $PROXY_PID
+  exit 1
+}
+
+stop_proxy () {
+  kill $PROXY_PID
+  wait $PROXY_PID 2>/dev/null || true
+}
+
+for t in $TRANSPORTS; do
+  # TLS-transport needs a domain, which in turn disables the other transports
+  if [ "$t" = tls ]; then
+    start_proxy -D "$DOMAIN"
+  else
+    start_proxy
+  fi
+  "$BIN/mtproto-loadgen" -t "$t" -D "$DOMAIN" $LOADGEN_ARGS "127.0.0.1:$PROXY_PORT" "$SECRET"
+  echo
+  stop_proxy
+done
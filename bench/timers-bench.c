@@ -0,0 +1,254 @@
+/*
+    This file is part of MTProto-proxy
+
+    MTProto-proxy is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    MTProto-Server is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with MTProto-Server.  If not, see <http://www.gnu.org/licenses/>.
+
+    This program is released under the GPL with the additional exemption
+    that compiling, linking, and/or using OpenSSL is allowed.
+    You are free to remove this exemption from derived works.
+
+    Copyright 2014-2018 Telegram Messenger Inc
+*/
+
+/*
+  Micro-benchmark of event timers.
+
+  Compares the timer wheel of net/net-timers.c with the binary heap it
+  replaced (kept here as a reference) on the operations connections do:
+  arming, re-arming to a later time (keepalives, pings), cancelling, and
+  expiring while time advances in 1ms steps as in the event loop.
+  The same pre-generated random sequence is used for both.
+*/
+
+#define	_FILE_OFFSET_BITS	64
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "precise-time.h"
+#include "net/net-timers.h"
+
+#define EXPIRE_STEP	0.001
+
+static int timers_num[16] = { 100000, 1000000 };
+static int timers_num_cnt;
+static double span = 30.0;
+
+static double get_time (void) {
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* {{{ reference binary heap */
+
+static event_timer_t **heap;
+static int heap_size;
+
+static inline void heap_adjust (event_timer_t *et, int i) {
+  int j;
+  while (i > 1) {
+    j = (i >> 1);
+    if (heap[j]->wakeup_time <= et->wakeup_time) {
+      break;
+    }
+    heap[i] = heap[j];
+    heap[i]->h_idx = i;
+    i = j;
+  }
+  j = 2*i;
+  while (j <= heap_size) {
+    if (j < heap_size && heap[j]->wakeup_time > heap[j+1]->wakeup_time) {
+      j++;
+    }
+    if (et->wakeup_time <= heap[j]->wakeup_time) {
+      break;
+    }
+    heap[i] = heap[j];
+    heap[i]->h_idx = i;
+    i = j;
+    j <<= 1;
+  }
+  heap[i] = et;
+  et->h_idx = i;
+}
+
+static int heap_insert (event_timer_t *et) {
+  int i = et->h_idx ? et->h_idx : ++heap_size;
+  heap_adjust (et, i);
+  return 0;
+}
+
+static int heap_remove (event_timer_t *et) {
+  int i = et->h_idx;
+  if (!i) {
+    return 0;
+  }
+  et->h_idx = 0;
+  et = heap[heap_size--];
+  if (i <= heap_size) {
+    heap_adjust (et, i);
+  }
+  return 1;
+}
+
+static int heap_run (void) {
+  while (heap_size > 0 && heap[1]->wakeup_time <= precise_now) {
+    event_timer_t *et = heap[1];
+    heap_remove (et);
+    et->wakeup (et);
+  }
+  return 0;
+}
+
+/* }}} */
+
+struct timers_impl {
+  const char *name;
+  int (*insert)(event_timer_t *et);
+  int (*remove)(event_timer_t *et);
+  int (*run)(void);
+};
+
+static int wheel_run (void) {
+  thread_run_timers ();
+  return 0;
+}
+
+static struct timers_impl impls[] = {
+  { "heap", heap_insert, heap_remove, heap_run },
+  { "wheel", insert_event_timer, remove_event_timer, wheel_run },
+};
+
+static long long expired;
+
+static int count_wakeup (event_timer_t *et) {
+  expired++;
+  return 0;
+}
+
+// nanoseconds per operation of every phase
+static void run_impl (struct timers_impl *I, int n, const double *times, const int *idx, double res[4]) {
+  event_timer_t *T = calloc (n, sizeof (event_timer_t));
+  assert (T);
+  heap = calloc (n + 1, sizeof (event_timer_t *));
+  assert (heap);
+  heap_size = 0;
+  double base = get_utime_monotonic ();
+  precise_now = base;
+  int i;
+
+  double t = get_time ();
+  for (i = 0; i < n; i++) {
+    T[i].wakeup = count_wakeup;
+    T[i].wakeup_time = base + times[i];
+    I->insert (&T[i]);
+  }
+  res[0] = (get_time () - t) * 1e9 / n;
+
+  t = get_time ();
+  for (i = 0; i < n; i++) {
+    event_timer_t *et = &T[idx[i]];
+    et->wakeup_time = base + span / 2 + times[i] / 2;
+    I->insert (et);
+  }
+  res[1] = (get_time () - t) * 1e9 / n;
+
+  t = get_time ();
+  for (i = 0; i < n; i++) {
+    event_timer_t *et = &T[idx[n - 1 - i]];
+    I->remove (et);
+    et->wakeup_time = base + times[n - 1 - i];
+    I->insert (et);
+  }
+  res[2] = (get_time () - t) * 1e9 / n;
+
+  expired = 0;
+  t = get_time ();
+  double now;
+  for (now = base; expired < n; now += EXPIRE_STEP) {
+    precise_now = now;
+    I->run ();
+  }
+  res[3] = (get_time () - t) * 1e9 / n;
+  assert (expired == n);
+
+  free (heap);
+  free (T);
+}
+
+static void usage (const char *progname) {
+  printf ("usage: %s [-n <timers>]... [-s <seconds>]\n"
+    "\tMicro-benchmark of the event timer wheel against a binary heap\n"
+    "\t-n\tnumber of armed timers, can be repeated (default 100000 and 1000000)\n"
+    "\t-s\ttimers are armed at random within this number of seconds (default %.0f)\n",
+    progname, span);
+  exit (2);
+}
+
+int main (int argc, char *argv[]) {
+  int i, j;
+  while ((i = getopt (argc, argv, "n:s:h")) != -1) {
+    switch (i) {
+    case 'n':
+      if (timers_num_cnt == 16) {
+        usage (argv[0]);
+      }
+      timers_num[timers_num_cnt++] = atoi (optarg);
+      if (timers_num[timers_num_cnt - 1] <= 0) {
+        usage (argv[0]);
+      }
+      break;
+    case 's':
+      span = atof (optarg);
+      if (span <= 0) {
+        usage (argv[0]);
+      }
+      break;
+    default:
+      usage (argv[0]);
+    }
+  }
+  if (!timers_num_cnt) {
+    timers_num_cnt = 2;
+  }
+
+  srand48 (1);
+  for (j = 0; j < timers_num_cnt; j++) {
+    int n = timers_num[j];
+    double *times = malloc (n * sizeof (double));
+    int *idx = malloc (n * sizeof (int));
+    assert (times && idx);
+    for (i = 0; i < n; i++) {
+      times[i] = drand48 () * span;
+      idx[i] = lrand48 () % n;
+    }
+
+    printf ("timers\t%d\n", n);
+    printf ("impl\tinsert_ns\trearm_ns\tcancel_insert_ns\texpire_ns\n");
+    for (i = 0; i < sizeof (impls) / sizeof (impls[0]); i++) {
+      double res[4];
+      run_impl (&impls[i], n, times, idx, res);
+      printf ("%s\t%.1f\t%.1f\t%.1f\t%.1f\n", impls[i].name, res[0], res[1], res[2], res[3]);
+    }
+    printf ("\n");
+    free (times);
+    free (idx);
+  }
+  return 0;
+}
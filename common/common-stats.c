@@ -331,3 +331,82 @@ void sbp_print_date (stats_buffer_t *sb, const char *key, time_t unix_time) {
     }
   }
 }
+
+void stats_histogram_merge (struct stats_histogram *res, const struct stats_histogram *H) {
+  int i;
+  for (i = 0; i < STATS_HISTOGRAM_BUCKETS; i++) {
+    res->buckets[i] += H->buckets[i];
+  }
+  res->count += H->count;
+  res->sum += H->sum;
+}
+
+void sb_sum_histogram (struct stats_histogram *res, void **base, int len, int offset) {
+  memset (res, 0, sizeof (*res));
+  int i;
+  for (i = 0; i < len; i++) if (base[i]) {
+    stats_histogram_merge (res, (struct stats_histogram *)((base[i]) + offset));
+  }
+}
+
+void sb_print_prometheus_histogram (stats_buffer_t *sb, const char *name, const char *help, const struct stats_histogram *H, double unit) {
+  sb_printf (sb, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+  long long total = 0;
+  int i;
+  for (i = 0; i < STATS_HISTOGRAM_BUCKETS - 1; i++) {
+    total += H->buckets[i];
+    sb_printf (sb, "%s_bucket{le=\"%.9g\"} %lld\n", name, unit * (1LL << i), total);
+  }
+  total += H->buckets[i];
+  sb_printf (sb, "%s_bucket{le=\"+Inf\"} %lld\n%s_sum %.9g\n%s_count %lld\n", name, total, name, H->sum, name, total);
+}
+
+static int sb_has_prometheus_metric (stats_buffer_t *sb, int start, const char *name, int len) {
+  const char *p = sb->buff + start, *e = sb->buff + sb->pos;
+  while (p && p < e) {
+    if (e - p > len && !memcmp (p, name, len) && p[len] == ' ') {
+      return 1;
+    }
+    p = memchr (p, '\n', e - p);
+    if (p) {
+      p++;
+    }
+  }
+  return 0;
+}
+
+void sb_print_prometheus_stats (stats_buffer_t *sb, const char *prefix, const char *text, int len) {
+  const char *end = text + len;
+  int start = sb->pos;
+  while (text < end) {
+    const char *eol = memchr (text, '\n', end - text);
+    if (!eol) {
+      eol = end;
+    }
+    const char *tab = memchr (text, '\t', eol - text);
+    char value[64];
+    if (tab && tab > text && eol - tab - 1 > 0 && eol - tab - 1 < sizeof (value)) {
+      memcpy (value, tab + 1, eol - tab - 1);
+      value[eol - tab - 1] = 0;
+      char *value_end;
+      strtod (value, &value_end);
+      if (value_end != value && !*value_end) {
+        char name[256];
+        int l = snprintf (name, sizeof (name), "%s%.*s", prefix, (int) (tab - text), text);
+        if (l < sizeof (name)) {
+          int i;
+          for (i = 0; i < l; i++) {
+            if (!isalnum ((unsigned char) name[i]) && name[i] != '_' && name[i] != ':') {
+              name[i] = '_';
+            }
+          }
+          // several modules may report the same key; Prometheus rejects duplicate samples
+          if (!sb_has_prometheus_metric (sb, start, name, l)) {
+            sb_printf (sb, "%s %s\n", name, value);
+          }
+        }
+      }
+    }
+    text = eol + 1;
+  }
+}
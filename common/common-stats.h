@@ -100,6 +100,45 @@ double sb_sum_f (void **base, int len, int offset);
 #define SB_SUM_F(name) \
   sb_sum_f ((void **)MODULE_STAT_ARR, max_job_thread_id + 1, offsetof (MODULE_STAT_TYPE, name))
 
+/*
+  histogram with power-of-two buckets: bucket i < STATS_HISTOGRAM_BUCKETS - 1 counts values
+  not exceeding unit * 2^i, the last one counts everything larger;
+  kept per thread like other module stats and summed on output
+*/
+#define STATS_HISTOGRAM_BUCKETS 24
+
+struct stats_histogram {
+  long long count;
+  double sum;
+  long long buckets[STATS_HISTOGRAM_BUCKETS];
+};
+
+static inline void stats_histogram_add (struct stats_histogram *H, double value, double unit) {
+  double x = value / unit;
+  int i = 0;
+  if (x >= (1LL << (STATS_HISTOGRAM_BUCKETS - 2))) {
+    i = STATS_HISTOGRAM_BUCKETS - 1;
+  } else if (x > 1) {
+    long long u = (long long) x;
+    if (u == x) {
+      u--;
+    }
+    i = 64 - __builtin_clzll (u);
+  }
+  H->buckets[i]++;
+  H->count++;
+  H->sum += value;
+}
+
+void stats_histogram_merge (struct stats_histogram *res, const struct stats_histogram *H);
+void sb_sum_histogram (struct stats_histogram *res, void **base, int len, int offset);
+void sb_print_prometheus_histogram (stats_buffer_t *sb, const char *name, const char *help, const struct stats_histogram *H, double unit);
+// converts "key\tnumber" lines of a text stats dump into untyped Prometheus metrics
+void sb_print_prometheus_stats (stats_buffer_t *sb, const char *prefix, const char *text, int len);
+
+#define SB_SUM_HISTOGRAM(res, name) \
+  sb_sum_histogram (res, (void **)MODULE_STAT_ARR, max_job_thread_id + 1, offsetof (MODULE_STAT_TYPE, name))
+
 #define SB_SUM_ONE_I(name) sb_printf (sb, "%s%s\t%d\n", MODULE_STAT_PREFIX_NAME ?: "", #name, SB_SUM_I(name))
 #define SB_SUM_ONE_LL(name) sb_printf (sb, "%s%s\t%lld\n", MODULE_STAT_PREFIX_NAME ?: "", #name, SB_SUM_LL(name))
 #define SB_SUM_ONE_F(name) sb_printf (sb, "%s%s\t%lf\n", MODULE_STAT_PREFIX_NAME ?: "", #name, SB_SUM_F(name))
@@ -28,6 +28,9 @@
 #include <fcntl.h>
 #include <limits.h>
 #include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -37,16 +40,20 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/file.h>
+#include <sys/syscall.h>
 #include <unistd.h>
+#include <linux/futex.h>
 
 #include "kprintf.h"
 #include "precise-time.h"
 
 int verbosity;
 const char *logname;
+int sync_logging;
 
 void reopen_logs_ext (int slave_mode) {
   int fd;
+  kprintf_flush ();
   fflush (stdout);
   fflush (stderr);
   if ((fd = open ("/dev/null", O_RDWR, 0)) != -1) {
@@ -244,17 +251,263 @@ int kwrite (int fd, const void *buf, int count) {
 #undef S_DATA_SIZE
 }
 
+/* {{{ asynchronous logging */
+/*
+  with asynchronous logging kprintf only formats the message into a ring owned by the calling thread;
+  a flusher thread writes all rings to stderr, which is the log file after reopen_logs ();
+  messages that do not fit into a full ring are dropped and counted
+*/
+#define KPRINTF_RING_SIZE (1 << 18)
+#define KPRINTF_MAX_RINGS 256
+#define KPRINTF_FLUSH_INTERVAL_NS 10000000
+
+struct kprintf_ring {
+  unsigned long long head;	/* advanced by the owner thread */
+  long long queued, dropped;
+  char pad1[40];
+  unsigned long long tail;	/* advanced by the flusher */
+  char pad2[56];
+  char data[KPRINTF_RING_SIZE];
+};
+
+static struct kprintf_ring *kprintf_rings[KPRINTF_MAX_RINGS];
+static int kprintf_rings_num;
+static __thread struct kprintf_ring *kprintf_ring;
+static __thread int kprintf_ring_unavailable;
+
+static int kprintf_async;
+static int kprintf_pid;
+static int kprintf_flusher_pid;
+static int kprintf_flush_lock;
+static long long kprintf_dropped_reported;
+static int kprintf_flusher_sleeping;
+
+static struct kprintf_ring *kprintf_get_ring (void) {
+  if (kprintf_ring || kprintf_ring_unavailable) {
+    return kprintf_ring;
+  }
+  int i = __sync_fetch_and_add (&kprintf_rings_num, 1);
+  struct kprintf_ring *R = 0;
+  if (i >= KPRINTF_MAX_RINGS || posix_memalign ((void **) &R, 64, sizeof (struct kprintf_ring))) {
+    kprintf_ring_unavailable = 1;
+    return 0;
+  }
+  memset (R, 0, offsetof (struct kprintf_ring, data));
+  __atomic_store_n (&kprintf_rings[i], R, __ATOMIC_RELEASE);
+  return kprintf_ring = R;
+}
+
+static void kprintf_write_all (const char *buf, long len) {
+  while (len > 0) {
+    long r = write (2, buf, len);
+    if (r < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return;
+    }
+    buf += r;
+    len -= r;
+  }
+}
+
+static int kprintf_lock_flush (int max_attempts) {
+  int i;
+  for (i = 0; __sync_lock_test_and_set (&kprintf_flush_lock, 1); i++) {
+    if (max_attempts && i >= max_attempts) {
+      return 0;
+    }
+    sched_yield ();
+  }
+  return 1;
+}
+
+static void kprintf_unlock_flush (void) {
+  __sync_lock_release (&kprintf_flush_lock);
+}
+
+// kprintf_flush_lock must be held
+static void kprintf_flush_rings (void) {
+  int n = __atomic_load_n (&kprintf_rings_num, __ATOMIC_ACQUIRE);
+  if (n > KPRINTF_MAX_RINGS) {
+    n = KPRINTF_MAX_RINGS;
+  }
+  long long dropped = 0;
+  int i;
+  for (i = 0; i < n; i++) {
+    struct kprintf_ring *R = __atomic_load_n (&kprintf_rings[i], __ATOMIC_ACQUIRE);
+    if (!R) {
+      continue;
+    }
+    unsigned long long head = __atomic_load_n (&R->head, __ATOMIC_ACQUIRE), tail = R->tail;
+    while (tail < head) {
+      int pos = tail & (KPRINTF_RING_SIZE - 1);
+      long len = head - tail;
+      if (len > KPRINTF_RING_SIZE - pos) {
+        len = KPRINTF_RING_SIZE - pos;
+      }
+      kprintf_write_all (R->data + pos, len);
+      tail += len;
+    }
+    __atomic_store_n (&R->tail, tail, __ATOMIC_RELEASE);
+    dropped += __atomic_load_n (&R->dropped, __ATOMIC_RELAXED);
+  }
+  if (dropped > kprintf_dropped_reported) {
+    char buf[128];
+    int len = snprintf (buf, sizeof (buf), "[%d] %lld log messages dropped: log buffer overflow\n", kprintf_pid, dropped - kprintf_dropped_reported);
+    kprintf_write_all (buf, len);
+    kprintf_dropped_reported = dropped;
+  }
+}
+
+void kprintf_flush (void) {
+  if (!kprintf_async) {
+    return;
+  }
+  // may be called from a crash handler while the flusher holds the lock
+  if (kprintf_lock_flush (1000)) {
+    kprintf_flush_rings ();
+    kprintf_unlock_flush ();
+  }
+}
+
+// sleeps for the flush interval, or until a producer finds its ring half full
+static void *kprintf_flusher_thread (void *arg) {
+  struct timespec ts = { .tv_sec = 0, .tv_nsec = KPRINTF_FLUSH_INTERVAL_NS };
+  while (1) {
+    kprintf_lock_flush (0);
+    kprintf_flush_rings ();
+    kprintf_unlock_flush ();
+    __atomic_store_n (&kprintf_flusher_sleeping, 1, __ATOMIC_SEQ_CST);
+    syscall (SYS_futex, &kprintf_flusher_sleeping, FUTEX_WAIT_PRIVATE, 1, &ts, 0, 0);
+    __atomic_store_n (&kprintf_flusher_sleeping, 0, __ATOMIC_RELAXED);
+  }
+  return 0;
+}
+
+static void kprintf_start_flusher (void) {
+  int pid = kprintf_pid;
+  if (__atomic_load_n (&kprintf_flusher_pid, __ATOMIC_ACQUIRE) == pid || !__sync_bool_compare_and_swap (&kprintf_flusher_pid, 0, pid)) {
+    return;
+  }
+  // signals must be delivered to engine threads, never to the flusher
+  sigset_t all, old;
+  sigfillset (&all);
+  pthread_sigmask (SIG_BLOCK, &all, &old);
+  pthread_t thread;
+  pthread_attr_t attr;
+  pthread_attr_init (&attr);
+  pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+  pthread_attr_setstacksize (&attr, 1 << 18);
+  int r = pthread_create (&thread, &attr, kprintf_flusher_thread, 0);
+  pthread_attr_destroy (&attr);
+  pthread_sigmask (SIG_SETMASK, &old, 0);
+  if (r) {
+    kprintf_async = 0;
+  }
+}
+
+static void kprintf_atfork_prepare (void) {
+  kprintf_lock_flush (0);
+  kprintf_flush_rings ();
+}
+
+static void kprintf_atfork_parent (void) {
+  kprintf_unlock_flush ();
+}
+
+// the flusher does not survive fork; it is restarted by the first kprintf of the child
+static void kprintf_atfork_child (void) {
+  int i;
+  for (i = 0; i < kprintf_rings_num && i < KPRINTF_MAX_RINGS; i++) {
+    if (kprintf_rings[i]) {
+      kprintf_rings[i]->tail = kprintf_rings[i]->head;
+    }
+  }
+  kprintf_pid = getpid ();
+  kprintf_flusher_pid = 0;
+  kprintf_unlock_flush ();
+}
+
+void kprintf_enable_async (void) {
+  if (kprintf_async) {
+    return;
+  }
+  kprintf_pid = getpid ();
+  pthread_atfork (kprintf_atfork_prepare, kprintf_atfork_parent, kprintf_atfork_child);
+  atexit (kprintf_flush);
+  kprintf_async = 1;
+}
+
+long long kprintf_queued_messages (void) {
+  long long res = 0;
+  int i;
+  for (i = 0; i < kprintf_rings_num && i < KPRINTF_MAX_RINGS; i++) {
+    if (kprintf_rings[i]) {
+      res += kprintf_rings[i]->queued;
+    }
+  }
+  return res;
+}
+
+long long kprintf_dropped_messages (void) {
+  long long res = 0;
+  int i;
+  for (i = 0; i < kprintf_rings_num && i < KPRINTF_MAX_RINGS; i++) {
+    if (kprintf_rings[i]) {
+      res += kprintf_rings[i]->dropped;
+    }
+  }
+  return res;
+}
+
+static int kprintf_enqueue (const char *buf, int n) {
+  if (kprintf_flusher_pid != kprintf_pid) {
+    kprintf_start_flusher ();
+  }
+  struct kprintf_ring *R = kprintf_get_ring ();
+  if (!R || !kprintf_async) {
+    return 0;
+  }
+  unsigned long long head = R->head, tail = __atomic_load_n (&R->tail, __ATOMIC_ACQUIRE);
+  if (head - tail + n > KPRINTF_RING_SIZE) {
+    __atomic_store_n (&R->dropped, R->dropped + 1, __ATOMIC_RELAXED);
+    return 1;
+  }
+  int pos = head & (KPRINTF_RING_SIZE - 1);
+  int first = n < KPRINTF_RING_SIZE - pos ? n : KPRINTF_RING_SIZE - pos;
+  memcpy (R->data + pos, buf, first);
+  memcpy (R->data, buf + first, n - first);
+  __atomic_store_n (&R->head, head + n, __ATOMIC_RELEASE);
+  __atomic_store_n (&R->queued, R->queued + 1, __ATOMIC_RELAXED);
+  if (head + n - tail > KPRINTF_RING_SIZE / 2 && __atomic_exchange_n (&kprintf_flusher_sleeping, 0, __ATOMIC_SEQ_CST)) {
+    syscall (SYS_futex, &kprintf_flusher_sleeping, FUTEX_WAKE_PRIVATE, 1, 0, 0, 0);
+  }
+  return 1;
+}
+/* }}} */
+
 void kprintf (const char *format, ...) {
   const int old_errno = errno;
-  struct tm t;
   struct timeval tv;
   char mp_kprintf_buf[PIPE_BUF];
+  // localtime_r takes a global lock, so the formatted time is cached for the current second
+  static __thread long cached_sec = -1;
+  static __thread char cached_time[32];
 
-  if (gettimeofday (&tv, NULL) || !localtime_r (&tv.tv_sec, &t)) {
-    memset (&t, 0, sizeof (t));
+  if (gettimeofday (&tv, NULL)) {
+    memset (&tv, 0, sizeof (tv));
+  }
+  if (tv.tv_sec != cached_sec) {
+    struct tm t;
+    if (!localtime_r (&tv.tv_sec, &t)) {
+      memset (&t, 0, sizeof (t));
+    }
+    snprintf (cached_time, sizeof (cached_time), "%4d-%02d-%02d %02d:%02d:%02d", t.tm_year + 1900, t.tm_mon + 1, t.tm_mday, t.tm_hour, t.tm_min, t.tm_sec);
+    cached_sec = tv.tv_sec;
   }
 
-  int n = snprintf (mp_kprintf_buf, sizeof (mp_kprintf_buf), "[%d][%4d-%02d-%02d %02d:%02d:%02d.%06d local] ", getpid (), t.tm_year + 1900, t.tm_mon + 1, t.tm_mday, t.tm_hour, t.tm_min, t.tm_sec, (int) tv.tv_usec);
+  int n = snprintf (mp_kprintf_buf, sizeof (mp_kprintf_buf), "[%d][%s.%06d local] ", kprintf_async ? kprintf_pid : getpid (), cached_time, (int) tv.tv_usec);
   if (n < sizeof (mp_kprintf_buf) - 1) {
     errno = old_errno;
     va_list ap;
@@ -268,7 +521,9 @@ void kprintf (const char *format, ...) {
       mp_kprintf_buf[n++] = '\n';
     }
   }
-  while (write (2, mp_kprintf_buf, n) < 0 && errno == EINTR);
+  if (!kprintf_async || !kprintf_enqueue (mp_kprintf_buf, n)) {
+    while (write (2, mp_kprintf_buf, n) < 0 && errno == EINTR);
+  }
   //while (flock (2, LOCK_UN) < 0 && errno == EINTR);
   errno = old_errno;
 }
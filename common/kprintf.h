@@ -30,6 +30,7 @@
 
 extern int verbosity;
 extern const char *logname;
+extern int sync_logging;
 
 void reopen_logs (void);
 void reopen_logs_ext (int slave_mode);
@@ -45,6 +46,13 @@ int kwrite (int fd, const void *buf, int count);
 
 // print message with timestamp
 void kprintf (const char *format, ...) __attribute__ ((format (printf, 1, 2)));
+
+// makes kprintf queue messages for a background flusher thread instead of writing them
+void kprintf_enable_async (void);
+// writes out all queued messages
+void kprintf_flush (void);
+long long kprintf_queued_messages (void);
+long long kprintf_dropped_messages (void);
 #define vkprintf(verbosity_level, format, ...) do { \
     if ((verbosity_level) > verbosity) { \
       break; \
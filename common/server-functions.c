@@ -222,6 +222,7 @@ void engine_set_terminal_attributes (void) {}
 void extended_debug_handler (int sig, siginfo_t *info, void *cont) {
   ksignal (sig, SIG_DFL);
   
+  kprintf_flush ();
   print_backtrace ();
     
   kill_main ();
@@ -618,6 +619,9 @@ int builtin_parse_option (int val) {
     case 208:
       max_allocated_buffer_bytes = parse_memory_limit (optarg);
       break;
+    case 209:
+      sync_logging = 1;
+      break;
     default:
       return -1;
   }
@@ -735,6 +739,7 @@ void add_builtin_parse_options (void) {
   parse_option_builtin ("log", required_argument, 0, 'l', LONGOPT_COMMON_SET, "sets log file name");
   parse_option_builtin ("daemonize", optional_argument, 0, 'd', LONGOPT_COMMON_SET, "changes between daemonize/not daemonize mode");
   parse_option_builtin ("nice", required_argument, 0, 202, LONGOPT_COMMON_SET, "sets niceness");
+  parse_option_builtin ("sync-log", no_argument, 0, 209, LONGOPT_COMMON_SET, "writes log messages directly instead of queueing them for the background log thread");
   parse_option_ex ("msg-buffers-size", required_argument, 0, 208, LONGOPT_COMMON_SET, builtin_parse_option, "sets maximal buffers size (default %lld)", (long long)MSG_DEFAULT_MAX_ALLOCATED_BYTES);
   //parse_option_builtin ("tl-history", optional_argument, 0, 210, LONGOPT_NET_SET, "long },
   //parse_option_builtin ("tl-op-stat", no_argument, 0, 211, LONGOPT_NET_SET, "enabled stat about op usage");
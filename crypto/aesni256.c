@@ -24,6 +24,9 @@
 #include "crypto/aesni256.h"
 
 #include <assert.h>
+#include <immintrin.h>
+#include <stdlib.h>
+#include <string.h>
 
 EVP_CIPHER_CTX *evp_cipher_ctx_init (const EVP_CIPHER *cipher, unsigned char *key, unsigned char iv[16], int is_encrypt) {
   EVP_CIPHER_CTX *evp_ctx = EVP_CIPHER_CTX_new();
@@ -39,3 +42,361 @@ void evp_crypt (EVP_CIPHER_CTX *evp_ctx, const void *in, void *out, int size) {
   assert (EVP_CipherUpdate(evp_ctx, out, &len, in, size) == 1);
   assert (len == size);
 }
+
+/* {{{ built-in AES-256 */
+
+#define AESNI_TARGET __attribute__ ((target ("aes")))
+#define VAES_TARGET __attribute__ ((target ("aes,vaes,avx512f,avx512bw")))
+
+enum aes256_impl {
+  AES256_IMPL_EVP,
+  AES256_IMPL_AESNI,
+  AES256_IMPL_VAES
+};
+
+static int aes256_impl = -1;
+
+static void aes256_select_impl (void) {
+  __builtin_cpu_init ();
+  int impl = AES256_IMPL_EVP;
+  if (__builtin_cpu_supports ("aes")) {
+    impl = AES256_IMPL_AESNI;
+    if (__builtin_cpu_supports ("vaes") && __builtin_cpu_supports ("avx512f") && __builtin_cpu_supports ("avx512bw")) {
+      impl = AES256_IMPL_VAES;
+    }
+  }
+  aes256_impl = impl;
+}
+
+const char *aes256_implementation (void) {
+  if (aes256_impl < 0) {
+    aes256_select_impl ();
+  }
+  static const char *names[] = { "evp", "aesni", "vaes" };
+  return names[aes256_impl];
+}
+
+AESNI_TARGET static inline __m128i aes256_key_assist1 (__m128i t1, __m128i t2) {
+  t2 = _mm_shuffle_epi32 (t2, 0xff);
+  __m128i t4 = _mm_slli_si128 (t1, 4);
+  t1 = _mm_xor_si128 (t1, t4);
+  t4 = _mm_slli_si128 (t4, 4);
+  t1 = _mm_xor_si128 (t1, t4);
+  t4 = _mm_slli_si128 (t4, 4);
+  t1 = _mm_xor_si128 (t1, t4);
+  return _mm_xor_si128 (t1, t2);
+}
+
+AESNI_TARGET static inline __m128i aes256_key_assist2 (__m128i t1, __m128i t3) {
+  __m128i t2 = _mm_shuffle_epi32 (_mm_aeskeygenassist_si128 (t1, 0), 0xaa);
+  __m128i t4 = _mm_slli_si128 (t3, 4);
+  t3 = _mm_xor_si128 (t3, t4);
+  t4 = _mm_slli_si128 (t4, 4);
+  t3 = _mm_xor_si128 (t3, t4);
+  t4 = _mm_slli_si128 (t4, 4);
+  t3 = _mm_xor_si128 (t3, t4);
+  return _mm_xor_si128 (t3, t2);
+}
+
+AESNI_TARGET static void aesni_expand_key (struct aes256_ctx *ctx, const unsigned char key[32], int decrypt) {
+  __m128i K[AES256_ROUNDS + 1];
+  __m128i t1 = _mm_loadu_si128 ((const __m128i *) key);
+  __m128i t3 = _mm_loadu_si128 ((const __m128i *) (key + 16));
+  K[0] = t1;
+  K[1] = t3;
+#define AES256_KEY_ROUND(i, rcon) \
+  t1 = aes256_key_assist1 (t1, _mm_aeskeygenassist_si128 (t3, rcon)); \
+  K[i] = t1; \
+  if (i < AES256_ROUNDS) { \
+    t3 = aes256_key_assist2 (t1, t3); \
+    K[i + 1] = t3; \
+  }
+  AES256_KEY_ROUND (2, 0x01);
+  AES256_KEY_ROUND (4, 0x02);
+  AES256_KEY_ROUND (6, 0x04);
+  AES256_KEY_ROUND (8, 0x08);
+  AES256_KEY_ROUND (10, 0x10);
+  AES256_KEY_ROUND (12, 0x20);
+  AES256_KEY_ROUND (14, 0x40);
+#undef AES256_KEY_ROUND
+
+  __m128i *rk = (__m128i *) ctx->round_keys;
+  int i;
+  if (!decrypt) {
+    for (i = 0; i <= AES256_ROUNDS; i++) {
+      rk[i] = K[i];
+    }
+  } else {
+    rk[0] = K[AES256_ROUNDS];
+    for (i = 1; i < AES256_ROUNDS; i++) {
+      rk[i] = _mm_aesimc_si128 (K[AES256_ROUNDS - i]);
+    }
+    rk[AES256_ROUNDS] = K[0];
+  }
+}
+
+static inline __m128i aes256_bswap_mask (void) {
+  return _mm_set_epi8 (0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+}
+
+/* CTR: eight independent blocks are kept in flight to hide aesenc latency */
+AESNI_TARGET static void aesni_ctr_blocks (struct aes256_ctx *ctx, const unsigned char *in, unsigned char *out, long blocks) {
+  const __m128i *rk = (const __m128i *) ctx->round_keys;
+  const __m128i bswap = aes256_bswap_mask ();
+  unsigned long long hi = __builtin_bswap64 (*(unsigned long long *) ctx->iv);
+  unsigned long long lo = __builtin_bswap64 (*(unsigned long long *) (ctx->iv + 8));
+  int i, r;
+
+  for (; blocks >= 8; blocks -= 8, in += 128, out += 128) {
+    __m128i b[8];
+    for (i = 0; i < 8; i++) {
+      b[i] = _mm_xor_si128 (_mm_shuffle_epi8 (_mm_set_epi64x (hi, lo), bswap), rk[0]);
+      hi += !++lo;
+    }
+    for (r = 1; r < AES256_ROUNDS; r++) {
+      for (i = 0; i < 8; i++) {
+        b[i] = _mm_aesenc_si128 (b[i], rk[r]);
+      }
+    }
+    for (i = 0; i < 8; i++) {
+      b[i] = _mm_aesenclast_si128 (b[i], rk[AES256_ROUNDS]);
+      _mm_storeu_si128 ((__m128i *) out + i, _mm_xor_si128 (b[i], _mm_loadu_si128 ((const __m128i *) in + i)));
+    }
+  }
+  for (; blocks > 0; blocks--, in += 16, out += 16) {
+    __m128i b = _mm_xor_si128 (_mm_shuffle_epi8 (_mm_set_epi64x (hi, lo), bswap), rk[0]);
+    hi += !++lo;
+    for (r = 1; r < AES256_ROUNDS; r++) {
+      b = _mm_aesenc_si128 (b, rk[r]);
+    }
+    b = _mm_aesenclast_si128 (b, rk[AES256_ROUNDS]);
+    _mm_storeu_si128 ((__m128i *) out, _mm_xor_si128 (b, _mm_loadu_si128 ((const __m128i *) in)));
+  }
+
+  *(unsigned long long *) ctx->iv = __builtin_bswap64 (hi);
+  *(unsigned long long *) (ctx->iv + 8) = __builtin_bswap64 (lo);
+}
+
+/* CBC encryption is inherently serial */
+AESNI_TARGET static void aesni_cbc_encrypt_blocks (struct aes256_ctx *ctx, const unsigned char *in, unsigned char *out, long blocks) {
+  const __m128i *rk = (const __m128i *) ctx->round_keys;
+  __m128i b = _mm_loadu_si128 ((const __m128i *) ctx->iv);
+  int r;
+  for (; blocks > 0; blocks--, in += 16, out += 16) {
+    b = _mm_xor_si128 (b, _mm_xor_si128 (_mm_loadu_si128 ((const __m128i *) in), rk[0]));
+    for (r = 1; r < AES256_ROUNDS; r++) {
+      b = _mm_aesenc_si128 (b, rk[r]);
+    }
+    b = _mm_aesenclast_si128 (b, rk[AES256_ROUNDS]);
+    _mm_storeu_si128 ((__m128i *) out, b);
+  }
+  _mm_storeu_si128 ((__m128i *) ctx->iv, b);
+}
+
+/* all ciphertext blocks of a batch are loaded before anything is stored, so in == out is fine */
+AESNI_TARGET static void aesni_cbc_decrypt_blocks (struct aes256_ctx *ctx, const unsigned char *in, unsigned char *out, long blocks) {
+  const __m128i *rk = (const __m128i *) ctx->round_keys;
+  __m128i prev = _mm_loadu_si128 ((const __m128i *) ctx->iv);
+  int i, r;
+
+  for (; blocks >= 8; blocks -= 8, in += 128, out += 128) {
+    __m128i c[8], b[8];
+    for (i = 0; i < 8; i++) {
+      c[i] = _mm_loadu_si128 ((const __m128i *) in + i);
+      b[i] = _mm_xor_si128 (c[i], rk[0]);
+    }
+    for (r = 1; r < AES256_ROUNDS; r++) {
+      for (i = 0; i < 8; i++) {
+        b[i] = _mm_aesdec_si128 (b[i], rk[r]);
+      }
+    }
+    for (i = 0; i < 8; i++) {
+      b[i] = _mm_aesdeclast_si128 (b[i], rk[AES256_ROUNDS]);
+      _mm_storeu_si128 ((__m128i *) out + i, _mm_xor_si128 (b[i], i ? c[i - 1] : prev));
+    }
+    prev = c[7];
+  }
+  for (; blocks > 0; blocks--, in += 16, out += 16) {
+    __m128i c = _mm_loadu_si128 ((const __m128i *) in);
+    __m128i b = _mm_xor_si128 (c, rk[0]);
+    for (r = 1; r < AES256_ROUNDS; r++) {
+      b = _mm_aesdec_si128 (b, rk[r]);
+    }
+    b = _mm_aesdeclast_si128 (b, rk[AES256_ROUNDS]);
+    _mm_storeu_si128 ((__m128i *) out, _mm_xor_si128 (b, prev));
+    prev = c;
+  }
+  _mm_storeu_si128 ((__m128i *) ctx->iv, prev);
+}
+
+/*
+  VAES: four 512-bit registers of four blocks each, 16 blocks per iteration;
+  leftovers (and CTR batches where the low counter word wraps) are passed to the AES-NI kernels
+*/
+VAES_TARGET static void vaes_ctr_blocks (struct aes256_ctx *ctx, const unsigned char *in, unsigned char *out, long blocks) {
+  const __m128i *rk128 = (const __m128i *) ctx->round_keys;
+  __m512i rk[AES256_ROUNDS + 1];
+  int i, r;
+  for (r = 0; r <= AES256_ROUNDS; r++) {
+    rk[r] = _mm512_broadcast_i32x4 (rk128[r]);
+  }
+  const __m512i bswap = _mm512_broadcast_i32x4 (aes256_bswap_mask ());
+  const __m512i inc0 = _mm512_set_epi64 (0, 3, 0, 2, 0, 1, 0, 0);
+  const __m512i inc4 = _mm512_set_epi64 (0, 4, 0, 4, 0, 4, 0, 4);
+  unsigned long long hi = __builtin_bswap64 (*(unsigned long long *) ctx->iv);
+  unsigned long long lo = __builtin_bswap64 (*(unsigned long long *) (ctx->iv + 8));
+
+  for (; blocks >= 16 && lo <= ~0ULL - 16; blocks -= 16, lo += 16, in += 256, out += 256) {
+    __m512i b[4];
+    b[0] = _mm512_add_epi64 (_mm512_broadcast_i32x4 (_mm_set_epi64x (hi, lo)), inc0);
+    for (i = 1; i < 4; i++) {
+      b[i] = _mm512_add_epi64 (b[i - 1], inc4);
+    }
+    for (i = 0; i < 4; i++) {
+      b[i] = _mm512_xor_si512 (_mm512_shuffle_epi8 (b[i], bswap), rk[0]);
+    }
+    for (r = 1; r < AES256_ROUNDS; r++) {
+      for (i = 0; i < 4; i++) {
+        b[i] = _mm512_aesenc_epi128 (b[i], rk[r]);
+      }
+    }
+    for (i = 0; i < 4; i++) {
+      b[i] = _mm512_aesenclast_epi128 (b[i], rk[AES256_ROUNDS]);
+      _mm512_storeu_si512 ((__m512i *) out + i, _mm512_xor_si512 (b[i], _mm512_loadu_si512 ((const __m512i *) in + i)));
+    }
+  }
+
+  *(unsigned long long *) ctx->iv = __builtin_bswap64 (hi);
+  *(unsigned long long *) (ctx->iv + 8) = __builtin_bswap64 (lo);
+  if (blocks) {
+    aesni_ctr_blocks (ctx, in, out, blocks);
+  }
+}
+
+VAES_TARGET static void vaes_cbc_decrypt_blocks (struct aes256_ctx *ctx, const unsigned char *in, unsigned char *out, long blocks) {
+  const __m128i *rk128 = (const __m128i *) ctx->round_keys;
+  __m512i rk[AES256_ROUNDS + 1];
+  int i, r;
+  for (r = 0; r <= AES256_ROUNDS; r++) {
+    rk[r] = _mm512_broadcast_i32x4 (rk128[r]);
+  }
+  // only the last block of prev is used: it precedes the first block of the batch
+  __m512i prev = _mm512_broadcast_i32x4 (_mm_loadu_si128 ((const __m128i *) ctx->iv));
+
+  for (; blocks >= 16; blocks -= 16, in += 256, out += 256) {
+    __m512i c[4], b[4];
+    for (i = 0; i < 4; i++) {
+      c[i] = _mm512_loadu_si512 ((const __m512i *) in + i);
+      b[i] = _mm512_xor_si512 (c[i], rk[0]);
+    }
+    for (r = 1; r < AES256_ROUNDS; r++) {
+      for (i = 0; i < 4; i++) {
+        b[i] = _mm512_aesdec_epi128 (b[i], rk[r]);
+      }
+    }
+    for (i = 0; i < 4; i++) {
+      __m512i chain = _mm512_alignr_epi64 (c[i], i ? c[i - 1] : prev, 6);
+      b[i] = _mm512_aesdeclast_epi128 (b[i], rk[AES256_ROUNDS]);
+      _mm512_storeu_si512 ((__m512i *) out + i, _mm512_xor_si512 (b[i], chain));
+    }
+    prev = c[3];
+  }
+
+  _mm_storeu_si128 ((__m128i *) ctx->iv, _mm512_extracti32x4_epi32 (prev, 3));
+  if (blocks) {
+    aesni_cbc_decrypt_blocks (ctx, in, out, blocks);
+  }
+}
+
+struct aes256_ctx *aes256_ctx_init (int mode, const unsigned char key[32], const unsigned char iv[16]) {
+  if (aes256_impl < 0) {
+    aes256_select_impl ();
+  }
+  struct aes256_ctx *ctx = NULL;
+  assert (!posix_memalign ((void **) &ctx, 64, sizeof (struct aes256_ctx)));
+  memset (ctx, 0, sizeof (*ctx));
+  ctx->mode = mode;
+  memcpy (ctx->iv, iv, 16);
+
+  if (aes256_impl == AES256_IMPL_EVP) {
+    switch (mode) {
+    case AES256_CTR:
+      ctx->evp_ctx = evp_cipher_ctx_init (EVP_aes_256_ctr (), (unsigned char *) key, (unsigned char *) iv, 1);
+      break;
+    case AES256_CBC_ENCRYPT:
+    case AES256_CBC_DECRYPT:
+      ctx->evp_ctx = evp_cipher_ctx_init (EVP_aes_256_cbc (), (unsigned char *) key, (unsigned char *) iv, mode == AES256_CBC_ENCRYPT);
+      break;
+    default:
+      assert (0);
+    }
+    return ctx;
+  }
+
+  assert (mode == AES256_CTR || mode == AES256_CBC_ENCRYPT || mode == AES256_CBC_DECRYPT);
+  aesni_expand_key (ctx, key, mode == AES256_CBC_DECRYPT);
+  return ctx;
+}
+
+void aes256_ctx_free (struct aes256_ctx *ctx) {
+  if (ctx->evp_ctx) {
+    EVP_CIPHER_CTX_free (ctx->evp_ctx);
+  }
+  memset (ctx, 0, sizeof (*ctx));
+  free (ctx);
+}
+
+static void aes256_ctr_crypt (struct aes256_ctx *ctx, const unsigned char *in, unsigned char *out, int size) {
+  while (size > 0 && ctx->keystream_used && ctx->keystream_used < 16) {
+    *out++ = *in++ ^ ctx->keystream[ctx->keystream_used++];
+    size--;
+  }
+  long blocks = size >> 4;
+  if (blocks) {
+    if (aes256_impl == AES256_IMPL_VAES) {
+      vaes_ctr_blocks (ctx, in, out, blocks);
+    } else {
+      aesni_ctr_blocks (ctx, in, out, blocks);
+    }
+    in += blocks << 4;
+    out += blocks << 4;
+    size &= 15;
+  }
+  if (size) {
+    static const unsigned char zero[16];
+    aesni_ctr_blocks (ctx, zero, ctx->keystream, 1);
+    ctx->keystream_used = 0;
+    while (size > 0) {
+      *out++ = *in++ ^ ctx->keystream[ctx->keystream_used++];
+      size--;
+    }
+  }
+}
+
+void aes256_crypt (struct aes256_ctx *ctx, const void *in, void *out, int size) {
+  assert (size >= 0);
+  if (ctx->evp_ctx) {
+    evp_crypt (ctx->evp_ctx, in, out, size);
+    return;
+  }
+  switch (ctx->mode) {
+  case AES256_CTR:
+    aes256_ctr_crypt (ctx, in, out, size);
+    break;
+  case AES256_CBC_ENCRYPT:
+    assert (!(size & 15));
+    aesni_cbc_encrypt_blocks (ctx, in, out, size >> 4);
+    break;
+  case AES256_CBC_DECRYPT:
+    assert (!(size & 15));
+    if (aes256_impl == AES256_IMPL_VAES) {
+      vaes_cbc_decrypt_blocks (ctx, in, out, size >> 4);
+    } else {
+      aesni_cbc_decrypt_blocks (ctx, in, out, size >> 4);
+    }
+    break;
+  default:
+    assert (0);
+  }
+}
+/* }}} */
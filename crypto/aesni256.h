@@ -28,3 +28,32 @@
 EVP_CIPHER_CTX *evp_cipher_ctx_init (const EVP_CIPHER *cipher, unsigned char *key, unsigned char iv[16], int is_encrypt);
 
 void evp_crypt (EVP_CIPHER_CTX *evp_ctx, const void *in, void *out, int size);
+
+/*
+  AES-256 in CTR and CBC modes with built-in AES-NI (or VAES) kernels;
+  falls back to OpenSSL EVP when the CPU has no AES instructions
+*/
+#define AES256_ROUNDS 14
+
+enum aes256_mode {
+  AES256_CTR,
+  AES256_CBC_ENCRYPT,
+  AES256_CBC_DECRYPT
+};
+
+struct aes256_ctx {
+  unsigned char round_keys[AES256_ROUNDS + 1][16];
+  unsigned char iv[16];		/* CBC chaining value or big-endian CTR counter */
+  unsigned char keystream[16];	/* CTR: keystream of the last partially used block */
+  int keystream_used;
+  int mode;
+  EVP_CIPHER_CTX *evp_ctx;	/* used instead of round keys when AES-NI is not available */
+} __attribute__ ((aligned (64)));
+
+struct aes256_ctx *aes256_ctx_init (int mode, const unsigned char key[32], const unsigned char iv[16]);
+void aes256_ctx_free (struct aes256_ctx *ctx);
+
+/* CBC sizes must be multiple of 16; in and out may coincide */
+void aes256_crypt (struct aes256_ctx *ctx, const void *in, void *out, int size);
+
+const char *aes256_implementation (void);
@@ -37,6 +37,7 @@
 #include "engine/engine-net.h"
 
 #include "net/net-tcp-rpc-client.h"
+#include "net/net-uring.h"
 
 void default_close_network_sockets (void) /* {{{ */ {
   engine_t *E = engine_state;
@@ -90,6 +91,10 @@ int try_open_port_range (int start_port, int end_port, int mod_port, int rem_por
 /* }}} */
 
 void engine_do_open_port (void) /* {{{ */ {
+  if (engine_state->sfd > 0) {
+    // taken over from another process
+    return;
+  }
   int port_mod = get_port_mod ();
 
   int port = engine_state->port;
@@ -200,6 +205,20 @@ static int f_parse_option_net (int val) {
         exit (2);
       }
       break;
+    case 374:
+      net_uring_requested = 1;
+      break;
+    case 375:
+      {
+        int busy_poll_us = atoi (optarg);
+        if (busy_poll_us < 0 || busy_poll_us > 1000000) {
+          kprintf ("--busy-poll requires a number of microseconds between 0 and 1000000\n");
+          usage ();
+          exit (2);
+        }
+        epoll_set_busy_poll (busy_poll_us);
+      }
+      break;
     case 373:
       {
         engine_t *E = engine_state;
@@ -242,4 +261,6 @@ void engine_add_net_parse_options (void) {
   parse_option_net_builtin ("max-dh-accept-rate", required_argument, 0, 250, LONGOPT_TCP_SET, "max number of DH connections per second that is allowed to accept");
   parse_option_net_builtin ("nat-info", required_argument, 0, 372, LONGOPT_NET_SET, "<local-addr>:<global-addr>\tsets network address translation for RPC protocol handshake");
   parse_option_net_builtin ("address", required_argument, 0, 373, LONGOPT_NET_SET, "tries to bind socket only to specified address");
+  parse_option_net_builtin ("io-uring", no_argument, 0, 374, LONGOPT_NET_SET, "use io_uring instead of epoll for tcp socket reads and writes, if supported by kernel");
+  parse_option_net_builtin ("busy-poll", required_argument, 0, 375, LONGOPT_NET_SET, "microseconds to poll for network events without sleeping after the event loop received some, also sets kernel busy polling of epoll and sockets; pays off only with spare cpu cores (default 0)");
 }
@@ -25,6 +25,7 @@
     Copyright 2015-2016 Telegram Messenger Inc             
               2015-2016 Vitaliy Valtman
 */
+#include <errno.h>
 #include <signal.h>
 #include <unistd.h>
 
@@ -41,8 +42,14 @@ void engine_set_terminal_attributes (void) {}
 
 /* {{{ PENDING SIGNALS */
 
+void wakeup_main_thread (void);
+
 void signal_set_pending (int sig) {
   __sync_fetch_and_or (&pending_signals, SIG2INT(sig));
+  // the signal may be delivered to a job thread while the main thread sleeps in epoll_wait
+  int saved_errno = errno;
+  wakeup_main_thread ();
+  errno = saved_errno;
 }
 
 int signal_check_pending (int sig) {
@@ -60,6 +60,7 @@
 #include "net/net-crypto-aes.h"
 #include "net/net-msg-buffers.h"
 #include "net/net-thread.h"
+#include "net/net-uring.h"
 
 #include "vv/vv-io.h"
 
@@ -265,6 +266,8 @@ void engine_init (const char *const pwd_filename, int do_not_open_port) {
     create_new_job_class (JC_ENGINE, 1, 1);
   }
 
+  net_uring_init ();
+
   create_main_thread_pipe ();
   alloc_timer_manager (JC_EPOLL);
   notification_event_job_create ();
@@ -618,6 +621,10 @@ int default_main (server_functions_t *F, int argc, char *argv[]) {
   
   parse_engine_options_long (argc, argv);
 
+  if (!sync_logging) {
+    kprintf_enable_async ();
+  }
+
   F->parse_extra_args (argc - optind, argv + optind);
 
   E->do_not_open_port = (F->flags & ENGINE_NO_PORT);
@@ -662,7 +669,6 @@ static int f_parse_option_engine (int val) {
         engine_disable_multithread ();
       } else {
         engine_enable_multithread ();
-        epoll_sleep_ns = 10000;
       }
       break;
     case 301:
@@ -74,6 +74,11 @@ MODULE_STAT_TYPE {
   double locked_since;
   long long timer_ops;
   long long timer_ops_scheduler;
+  long long job_pool_alloc_ops;
+  long long job_pool_alloc_fresh;
+  long long job_pool_free_remote;
+  long long job_pool_free_released;
+  long long job_pool_cached_bytes;
 };
 
 MODULE_INIT
@@ -320,6 +325,11 @@ MODULE_STAT_FUNCTION
   SB_SUM_ONE_LL (jobs_allocated_memory);
   SB_SUM_ONE_LL (timer_ops);
   SB_SUM_ONE_LL (timer_ops_scheduler);
+  SB_SUM_ONE_LL (job_pool_alloc_ops);
+  SB_SUM_ONE_LL (job_pool_alloc_fresh);
+  SB_SUM_ONE_LL (job_pool_free_remote);
+  SB_SUM_ONE_LL (job_pool_free_released);
+  SB_SUM_ONE_LL (job_pool_cached_bytes);
 MODULE_STAT_FUNCTION_END
 
 long long jobs_get_allocated_memoty (void) {
@@ -1061,6 +1071,107 @@ void job_change_signals (job_t job, unsigned long long job_signals) {
   job->j_sigclass = (job_signals >> 32);
 }
 
+/* ------ JOB MEMORY POOLS ------
+
+  Jobs of up to JOB_POOL_MAX_SIZE bytes (including 64-byte block header) are
+  allocated from size-classed free lists of the creating thread. Block is freed
+  into local list if freeing thread is the owner, otherwise it is pushed into
+  owner's lock-free remote list, which owner takes over as a whole on its next
+  allocation of this size class. j_align == 64 marks pooled jobs
+  (malloc'ed jobs always have j_align < 64).
+*/
+
+#define JOB_POOL_MIN_SIZE 256
+#define JOB_POOL_CLASSES 5
+#define JOB_POOL_MAX_SIZE (JOB_POOL_MIN_SIZE << (JOB_POOL_CLASSES - 1))
+#define JOB_POOL_MAX_CACHED 1024
+#define JOB_POOL_HEADER 64
+
+struct job_pool_block {
+  struct job_pool_block *next;
+  int size_class;
+  int owner;
+};
+
+struct job_pool {
+  struct job_pool_block *free_list[JOB_POOL_CLASSES];
+  int free_cnt[JOB_POOL_CLASSES];
+  struct job_pool_block *remote_list[JOB_POOL_CLASSES] __attribute__((aligned(64)));
+} __attribute__((aligned(128)));
+
+static struct job_pool JobPools[MAX_JOB_THREADS];
+
+static inline int job_pool_size_class (int bytes) {
+  if (bytes > JOB_POOL_MAX_SIZE) {
+    return -1;
+  }
+  int c = 0;
+  while ((JOB_POOL_MIN_SIZE << c) < bytes) {
+    c++;
+  }
+  return c;
+}
+
+static job_t job_pool_alloc (struct job_thread *JT, int custom_bytes) {
+  int c = job_pool_size_class (JOB_POOL_HEADER + sizeof (struct async_job) + custom_bytes);
+  if (c < 0) {
+    return NULL;
+  }
+  struct job_pool *P = &JobPools[JT->id];
+  struct job_pool_block *B = P->free_list[c];
+  if (!B && P->remote_list[c]) {
+    B = __sync_lock_test_and_set (&P->remote_list[c], NULL);
+    struct job_pool_block *X;
+    for (X = B; X; X = X->next) {
+      P->free_cnt[c] ++;
+      MODULE_STAT->job_pool_cached_bytes += JOB_POOL_MIN_SIZE << c;
+    }
+  }
+  MODULE_STAT->job_pool_alloc_ops ++;
+  if (B) {
+    P->free_list[c] = B->next;
+    P->free_cnt[c] --;
+    MODULE_STAT->job_pool_cached_bytes -= JOB_POOL_MIN_SIZE << c;
+    assert (B->size_class == c && B->owner == JT->id);
+  } else {
+    B = aligned_alloc (64, JOB_POOL_MIN_SIZE << c);
+    assert (B);
+    B->size_class = c;
+    B->owner = JT->id;
+    MODULE_STAT->job_pool_alloc_fresh ++;
+  }
+  B->next = NULL;
+  return (void *) B + JOB_POOL_HEADER;
+}
+
+static void job_pool_free (job_t job) {
+  struct job_pool_block *B = (void *) job - JOB_POOL_HEADER;
+  int c = B->size_class;
+  assert (c >= 0 && c < JOB_POOL_CLASSES && B->owner > 0 && B->owner < MAX_JOB_THREADS);
+  struct job_pool *P = &JobPools[B->owner];
+  struct job_thread *JT = this_job_thread;
+  if (JT && JT->id == B->owner) {
+    if (P->free_cnt[c] >= JOB_POOL_MAX_CACHED) {
+      MODULE_STAT->job_pool_free_released ++;
+      free (B);
+      return;
+    }
+    B->next = P->free_list[c];
+    P->free_list[c] = B;
+    P->free_cnt[c] ++;
+    MODULE_STAT->job_pool_cached_bytes += JOB_POOL_MIN_SIZE << c;
+    return;
+  }
+  if (JT) {
+    MODULE_STAT->job_pool_free_remote ++;
+  }
+  struct job_pool_block *H;
+  do {
+    H = P->remote_list[c];
+    B->next = H;
+  } while (!__sync_bool_compare_and_swap (&P->remote_list[c], H, B));
+}
+
 /* "destroys" one reference to parent_job */
 job_t create_async_job (job_function_t run_job, unsigned long long job_signals, int job_subclass, int custom_bytes, unsigned long long job_type, JOB_REF_ARG (parent_job)) {
   if (parent_job) {
@@ -1072,10 +1183,14 @@ job_t create_async_job (job_function_t run_job, unsigned long long job_signals,
   MODULE_STAT->jobs_allocated_memory += sizeof (struct async_job) + custom_bytes;
   struct job_thread *JT = this_job_thread;
   assert (JT);
-  void *p = malloc (sizeof (struct async_job) + custom_bytes + 64);
-  assert (p);
-  int align = -((uintptr_t) p) & 63;
-  job_t job = p + align;
+  int align = JOB_POOL_HEADER;
+  job_t job = job_pool_alloc (JT, custom_bytes);
+  if (!job) {
+    void *p = malloc (sizeof (struct async_job) + custom_bytes + 64);
+    assert (p);
+    align = -((uintptr_t) p) & 63;
+    job = p + align;
+  }
   assert (!(((uintptr_t) job) & 63));
 
   job->j_flags = JF_LOCKED;
@@ -1232,8 +1347,18 @@ struct job_timer_manager_extra {
 
 job_t timer_manager_job;
 
-int insert_event_timer (event_timer_t *et);
-int remove_event_timer (event_timer_t *et);
+// the main thread blocked in epoll_wait looks at timers of other threads only when it wakes up
+static void job_thread_set_wakeup_time (struct job_thread *JT, double wakeup_time) {
+  JT->wakeup_time = wakeup_time;
+  if (JT->thread_class == JC_MAIN || wakeup_time <= 0) {
+    return;
+  }
+  __sync_synchronize ();
+  if (main_thread_interrupt_status == 1 && wakeup_time < epoll_wakeup_time && __sync_fetch_and_add (&main_thread_interrupt_status, 1) == 1) {
+    vkprintf (JOBS_DEBUG, "WAKING UP MAIN THREAD FOR TIMER\n");
+    wakeup_main_thread ();
+  }
+}
 
 void do_immediate_timer_insert (job_t W) {
   MODULE_STAT->timer_ops ++;
@@ -1257,7 +1382,7 @@ void do_immediate_timer_insert (job_t W) {
   }
 
   if (this_job_thread) {
-    this_job_thread->wakeup_time = timers_get_first ();
+    job_thread_set_wakeup_time (this_job_thread, timers_get_first ());
   }
 }
 
@@ -1268,7 +1393,7 @@ int do_timer_manager_job (job_t job, int op, struct job_thread *JT) {
 
   if (op == JS_AUX) {
     thread_run_timers ();
-    JT->wakeup_time = timers_get_first ();
+    job_thread_set_wakeup_time (JT, timers_get_first ());
     return 0;
   }
 
@@ -1293,6 +1418,25 @@ void jobs_check_all_timers (void) {
   }
 }
 
+// first timer of job threads, timers already due count as due in a millisecond, while their threads process them
+double jobs_get_first_timer (void) {
+  double first = 0;
+  int i;
+  for (i = 1; i <= max_job_thread_id; i++) {
+    struct job_thread *JT = &JobThreads[i];
+    double t = JT->wakeup_time;
+    if (JT->timer_manager && t) {
+      if (t <= precise_now) {
+        t = precise_now + 0.001;
+      }
+      if (!first || t < first) {
+        first = t;
+      }
+    }
+  }
+  return first;
+}
+
 job_t alloc_timer_manager (int thread_class) {
   if (thread_class == JC_EPOLL && timer_manager_job) {
     return job_incref (timer_manager_job);
@@ -1633,7 +1777,11 @@ int job_free (JOB_REF_ARG (job)) {
   if (job->j_type & JT_HAVE_MSG_QUEUE) {
     job_message_queue_free (job);
   }
-  free (((void *)job) - job->j_align);
+  if (job->j_align == JOB_POOL_HEADER) {
+    job_pool_free (job);
+  } else {
+    free (((void *)job) - job->j_align);
+  }
   return JOB_DESTROYED;
 }
 
@@ -94,6 +94,8 @@ extern int engine_multithread_mode;
 #define JC_GMS JC_ENGINE
 #define JC_GMS_CPU 10
 #define JC_ENGINE_MULT 11
+#define JC_ACCEPT 12
+#define JC_URING 13
 
 
 #define DEFAULT_IO_JOB_THREADS	16
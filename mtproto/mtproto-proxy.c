@@ -58,6 +58,7 @@
 #include "net/net-tcp-rpc-ext-server.h"
 #include "net/net-crypto-aes.h"
 #include "net/net-crypto-dh.h"
+#include "net/net-handoff.h"
 #include "mtproto-common.h"
 #include "mtproto-config.h"
 #include "common/tl-parse.h"
@@ -80,10 +81,12 @@ const char FullVersionStr[] = VERSION_STR " make with love <(._.)>  at " __DATE_
 #define EXT_CONN_TABLE_SIZE	(1 << 22)
 #define EXT_CONN_HASH_SHIFT	20
 #define EXT_CONN_HASH_SIZE	(1 << EXT_CONN_HASH_SHIFT)
+#define	MAX_EXT_CONN_SHARDS	16
 
 #define	RPC_TIMEOUT_INTERVAL	5.0
 
 #define	MAX_HTTP_LISTEN_PORTS	128
+#define	MAX_PORT_ACCEPTORS	16
 
 #define	HTTP_MAX_WAIT_TIMEOUT	960.0
 
@@ -190,25 +193,85 @@ struct ext_connection_ref {
 
 long long ext_connections, ext_connections_created;
 
+// number of ext_connections bound to each outbound connection, indexed by out_fd; updated from all shards
+int ext_conn_out_count[MAX_CONNECTIONS];
+
 struct ext_connection_ref OutExtConnections[EXT_CONN_TABLE_SIZE];
 struct ext_connection *InExtConnectionHash[EXT_CONN_HASH_SIZE];
 struct ext_connection ExtConnectionHead[MAX_CONNECTIONS];
 
+/*
+  The table may be split into ext_conn_shards (power of two) independent shards,
+  each one owned by a separate subclass of JC_ENGINE_MULT.
+  Shard of an inbound connection is (in_fd & (ext_conn_shards - 1));
+  low bits of hash buckets and of out_conn_id slots always equal the shard number,
+  so OutExtConnections and InExtConnectionHash are shared without locking.
+  Lists of ext_connections by out_fd are kept separately for each shard.
+*/
+struct ext_conn_shard {
+  struct ext_connection *OutHead;
+  struct ext_connection ConnLRU;
+  long long ext_connections;
+} __attribute__ ((aligned (64)));
+
+int ext_conn_shards = 1, ext_conn_shards_req = 1;
+struct ext_conn_shard ExtConnShards[MAX_EXT_CONN_SHARDS] = {
+  [0] = { .OutHead = ExtConnectionHead, .ConnLRU = { .lru_prev = &ExtConnShards[0].ConnLRU, .lru_next = &ExtConnShards[0].ConnLRU } }
+};
+
 void lru_delete_ext_conn (struct ext_connection *Ext);
 
+static inline int ext_conn_shard_by_fd (int fd) {
+  return fd & (ext_conn_shards - 1);
+}
+
+static inline int ext_conn_shard_by_out_conn_id (long long out_conn_id) {
+  return out_conn_id & (ext_conn_shards - 1);
+}
+
+static inline int ext_conn_job_class (void) {
+  return ext_conn_shards > 1 ? JC_ENGINE_MULT : JC_ENGINE;
+}
+
+static inline int ext_conn_job_subclass (int shard) {
+  return ext_conn_shards > 1 ? shard : -2;
+}
+
 static inline void check_engine_class (void) {
-  check_thread_class (JC_ENGINE);
+  check_thread_class (ext_conn_job_class ());
+}
+
+static inline void check_ext_conn_shard (int shard) {
+  check_engine_class ();
+  assert (ext_conn_shards == 1 || this_job_thread->current_job->j_subclass == shard);
+}
+
+static inline struct ext_connection *ext_conn_out_head (int shard, int out_fd) {
+  return &ExtConnShards[shard].OutHead[out_fd];
+}
+
+void init_ext_conn_shards (int shards) {
+  assert (shards > 0 && shards <= MAX_EXT_CONN_SHARDS && !(shards & (shards - 1)));
+  assert (ext_conn_shards == 1);
+  int i;
+  for (i = 1; i < shards; i++) {
+    struct ext_conn_shard *X = &ExtConnShards[i];
+    X->OutHead = calloc (sizeof (struct ext_connection), MAX_CONNECTIONS);
+    assert (X->OutHead);
+    X->ConnLRU.lru_prev = X->ConnLRU.lru_next = &X->ConnLRU;
+  }
+  ext_conn_shards = shards;
 }
 
 static inline int ext_conn_hash (int in_fd, long long in_conn_id) {
   unsigned long long h = (unsigned long long) in_fd * 11400714819323198485ULL + (unsigned long long) in_conn_id * 13043817825332782213ULL;
-  return (h >> (64 - EXT_CONN_HASH_SHIFT));
+  return ((h >> (64 - EXT_CONN_HASH_SHIFT)) & -ext_conn_shards) | ext_conn_shard_by_fd (in_fd);
 }
 
 // makes sense only for !IS_PROXY_IN
 // returns the only ext_connection with given in_fd
 struct ext_connection *get_ext_connection_by_in_fd (int in_fd) {
-  check_engine_class ();
+  check_ext_conn_shard (ext_conn_shard_by_fd (in_fd));
   assert ((unsigned) in_fd < MAX_CONNECTIONS);
   struct ext_connection *H = &ExtConnectionHead[in_fd];
   struct ext_connection *Ex = H->i_next;
@@ -222,7 +285,9 @@ struct ext_connection *get_ext_connection_by_in_fd (int in_fd) {
 
 // mode: 0 = find, 1 = delete, 2 = create if not found, 3 = find or create
 struct ext_connection *get_ext_connection_by_in_conn_id (int in_fd, int in_gen, long long in_conn_id, int mode, int *created) {
-  check_engine_class ();
+  int shard = ext_conn_shard_by_fd (in_fd);
+  check_ext_conn_shard (shard);
+  struct ext_conn_shard *X = &ExtConnShards[shard];
   int h = ext_conn_hash (in_fd, in_conn_id);
   struct ext_connection **prev = &InExtConnectionHash[h], *cur = *prev;
   for (; cur; cur = *prev) {
@@ -243,6 +308,7 @@ struct ext_connection *get_ext_connection_by_in_conn_id (int in_fd, int in_gen,
 	cur->o_next->o_prev = cur->o_prev;
 	cur->o_prev->o_next = cur->o_next;
 	cur->o_next = cur->o_prev = 0;
+	__sync_fetch_and_add (&ext_conn_out_count[cur->out_fd], -1);
       }
       lru_delete_ext_conn (cur);
       *prev = cur->h_next;
@@ -254,7 +320,8 @@ struct ext_connection *get_ext_connection_by_in_conn_id (int in_fd, int in_gen,
       cur->out_conn_id = 0;
       memset (cur, 0, sizeof (struct ext_connection));
       free (cur);
-      ext_connections--;
+      X->ext_connections--;
+      __sync_fetch_and_add (&ext_connections, -1);
       return (void *) -1L;
     }
     prev = &(cur->h_next);
@@ -262,7 +329,7 @@ struct ext_connection *get_ext_connection_by_in_conn_id (int in_fd, int in_gen,
   if (mode != 2 && mode != 3) {
     return 0;
   }
-  assert (ext_connections < EXT_CONN_TABLE_SIZE / 2);
+  assert (X->ext_connections < EXT_CONN_TABLE_SIZE / 2 / ext_conn_shards);
   cur = calloc (sizeof (struct ext_connection), 1);
   assert (cur);
   cur->h_next = InExtConnectionHash[h];
@@ -282,9 +349,9 @@ struct ext_connection *get_ext_connection_by_in_conn_id (int in_fd, int in_gen,
     H->i_prev->i_next = cur;
     H->i_prev = cur;
   }
-  h = in_conn_id ? lrand48() : in_fd;
+  h = in_conn_id ? (lrand48_j () & -ext_conn_shards) | shard : in_fd;
   while (OutExtConnections[h &= (EXT_CONN_TABLE_SIZE - 1)].ref) {
-    h = lrand48();
+    h = (lrand48_j () & -ext_conn_shards) | shard;
   }
   OutExtConnections[h].ref = cur;
   cur->out_conn_id = OutExtConnections[h].out_conn_id = (OutExtConnections[h].out_conn_id | (EXT_CONN_TABLE_SIZE - 1)) + 1 + h;
@@ -292,13 +359,14 @@ struct ext_connection *get_ext_connection_by_in_conn_id (int in_fd, int in_gen,
   if (created) {
     ++*created;
   }
-  ext_connections++;
-  ext_connections_created++;
+  X->ext_connections++;
+  __sync_fetch_and_add (&ext_connections, 1);
+  __sync_fetch_and_add (&ext_connections_created, 1);
   return cur;
 }
 
 struct ext_connection *find_ext_connection_by_out_conn_id (long long out_conn_id) {
- check_engine_class ();
+  check_ext_conn_shard (ext_conn_shard_by_out_conn_id (out_conn_id));
   int h = out_conn_id & (EXT_CONN_TABLE_SIZE - 1);
   struct ext_connection *cur = OutExtConnections[h].ref;
   if (!cur || OutExtConnections[h].out_conn_id != out_conn_id) {
@@ -310,21 +378,27 @@ struct ext_connection *find_ext_connection_by_out_conn_id (long long out_conn_id
 
 // MUST be new
 struct ext_connection *create_ext_connection (connection_job_t CI, long long in_conn_id, connection_job_t CO, long long auth_key_id) {
-  check_engine_class ();
+  int shard = ext_conn_shard_by_fd (CONN_INFO(CI)->fd);
+  check_ext_conn_shard (shard);
   struct ext_connection *Ex = get_ext_connection_by_in_conn_id (CONN_INFO(CI)->fd, CONN_INFO(CI)->generation, in_conn_id, 2, 0);
   assert (Ex && "ext_connection already exists");
   assert (!Ex->out_fd && !Ex->o_next && !Ex->auth_key_id);
   assert (!CO || (unsigned) CONN_INFO(CO)->fd < MAX_CONNECTIONS);
   assert (CO != CI);
   if (CO) {
-    struct ext_connection *H = &ExtConnectionHead[CONN_INFO(CO)->fd];
-    assert (H->o_next);
+    struct ext_connection *H = ext_conn_out_head (shard, CONN_INFO(CO)->fd);
+    if (!H->o_next) {
+      // out list heads are created lazily by the first user in each shard
+      H->o_prev = H->o_next = H;
+      H->out_fd = CONN_INFO(CO)->fd;
+    }
     Ex->o_next = H;
     Ex->o_prev = H->o_prev;
     H->o_prev->o_next = Ex;
     H->o_prev = Ex;
     Ex->out_fd = CONN_INFO(CO)->fd;
     Ex->out_gen = CONN_INFO(CO)->generation;
+    __sync_fetch_and_add (&ext_conn_out_count[Ex->out_fd], 1);
   }
   Ex->auth_key_id = auth_key_id;
   return Ex;
@@ -372,6 +446,38 @@ void remove_ext_connection (struct ext_connection *Ex, int send_notifications) {
 
 #define MAX_WORKERS	256
 
+/* {{{ STAT */
+#define MODULE mtfront
+
+#define RPC_LATENCY_UNIT	0.0001
+#define PACKET_SIZE_UNIT	16
+#define QUEUE_BYTES_UNIT	256
+
+MODULE_STAT_TYPE {
+  struct stats_histogram rpc_latency, client_packet_size, upstream_queue_bytes;
+};
+
+MODULE_INIT
+/* }}} */
+
+struct mtfront_histograms {
+  struct stats_histogram rpc_latency, client_packet_size, handshake_time, upstream_queue_bytes;
+};
+
+static void fetch_mtfront_histograms (struct mtfront_histograms *H) {
+  SB_SUM_HISTOGRAM (&H->rpc_latency, rpc_latency);
+  SB_SUM_HISTOGRAM (&H->client_packet_size, client_packet_size);
+  SB_SUM_HISTOGRAM (&H->upstream_queue_bytes, upstream_queue_bytes);
+  fetch_ext_server_handshake_time (&H->handshake_time);
+}
+
+static void merge_mtfront_histograms (struct mtfront_histograms *res, struct mtfront_histograms *H) {
+  stats_histogram_merge (&res->rpc_latency, &H->rpc_latency);
+  stats_histogram_merge (&res->client_packet_size, &H->client_packet_size);
+  stats_histogram_merge (&res->handshake_time, &H->handshake_time);
+  stats_histogram_merge (&res->upstream_queue_bytes, &H->upstream_queue_bytes);
+}
+
 struct worker_stats {
   int cnt;
   int updated_at;
@@ -392,7 +498,7 @@ struct worker_stats {
 
   long long active_rpcs, active_rpcs_created;
   long long rpc_dropped_running, rpc_dropped_answers;
-  long long tot_forwarded_queries, expired_forwarded_queries;
+  long long tot_forwarded_queries, expired_forwarded_queries, tot_forward_batches;
   long long tot_forwarded_responses;
   long long dropped_queries, dropped_responses;
   long long tot_forwarded_simple_acks, dropped_simple_acks;
@@ -402,6 +508,8 @@ struct worker_stats {
 
   long long ext_connections, ext_connections_created;
   long long http_queries, http_bad_headers;
+
+  struct mtfront_histograms hist;
 };
 
 struct worker_stats *WStats, SumStats;
@@ -414,7 +522,7 @@ int pending_http_queries;
 
 long long active_rpcs, active_rpcs_created;
 long long rpc_dropped_running, rpc_dropped_answers;
-long long tot_forwarded_queries, expired_forwarded_queries, dropped_queries;
+long long tot_forwarded_queries, expired_forwarded_queries, dropped_queries, tot_forward_batches;
 long long tot_forwarded_responses, dropped_responses;
 long long tot_forwarded_simple_acks, dropped_simple_acks;
 long long mtproto_proxy_errors;
@@ -422,6 +530,16 @@ long long mtproto_proxy_errors;
 char proxy_tag[16];
 int proxy_tag_set;
 
+/*
+  graceful upgrade: a new process started with the same --handoff-socket takes over listening sockets
+  and checked domains, then this one stops accepting and exits once its clients are gone or the drain timeout expires
+*/
+#define DEFAULT_HANDOFF_DRAIN_TIMEOUT	600
+
+static char *handoff_path;
+static int handoff_drain_timeout = DEFAULT_HANDOFF_DRAIN_TIMEOUT;
+static int handoff_drain_until;
+
 static void update_local_stats_copy (struct worker_stats *S) {
   S->cnt++;
   __sync_synchronize();
@@ -431,6 +549,7 @@ static void update_local_stats_copy (struct worker_stats *S) {
   fetch_connections_stat (&S->conn);
   fetch_aes_crypto_stat (&S->allocated_aes_crypto, &S->allocated_aes_crypto_temp);
   fetch_buffers_stat (&S->bufs);
+  fetch_mtfront_histograms (&S->hist);
 
   UPD (ev_heap_size); 
 
@@ -443,6 +562,7 @@ static void update_local_stats_copy (struct worker_stats *S) {
   UPD (rpc_dropped_answers);
   UPD (tot_forwarded_queries); 
   UPD (expired_forwarded_queries); 
+  UPD (tot_forward_batches);
   UPD (dropped_queries); 
   UPD (tot_forwarded_responses); 
   UPD (dropped_responses); 
@@ -516,6 +636,7 @@ static inline void add_stats (struct worker_stats *W) {
   UPD (rpc_dropped_answers);
   UPD (tot_forwarded_queries); 
   UPD (expired_forwarded_queries); 
+  UPD (tot_forward_batches);
   UPD (dropped_queries); 
   UPD (tot_forwarded_responses); 
   UPD (dropped_responses); 
@@ -529,6 +650,7 @@ static inline void add_stats (struct worker_stats *W) {
   UPD (http_queries); 
   UPD (http_bad_headers);
 #undef UPD
+  merge_mtfront_histograms (&SumStats.hist, &W->hist);
 }
 
 void update_local_stats (void) {
@@ -603,6 +725,7 @@ void mtfront_prepare_stats (stats_buffer_t *sb) {
 	     "qps_get\t%.3f\n"
 	     "tot_forwarded_queries\t%lld\n"
 	     "expired_forwarded_queries\t%lld\n"
+	     "tot_forward_batches\t%lld\n"
 	     "dropped_queries\t%lld\n"
 	     "tot_forwarded_responses\t%lld\n"
 	     "dropped_responses\t%lld\n"
@@ -663,6 +786,7 @@ void mtfront_prepare_stats (stats_buffer_t *sb) {
 	     safe_div (S(get_queries), uptime),
 	     S(tot_forwarded_queries),
 	     S(expired_forwarded_queries),
+	     S(tot_forward_batches),
 	     S(dropped_queries),
 	     S(tot_forwarded_responses),
 	     S(dropped_responses),
@@ -713,11 +837,39 @@ void mtfront_prepare_stats (stats_buffer_t *sb) {
 	     proxy_mode,
 	     proxy_tag_set
   );
+  sb_printf (sb,
+	     "handoff_sockets_received\t%d\n"
+	     "handoff_sockets_passed\t%d\n"
+	     "handoff_draining\t%d\n",
+	     handoff_sockets_received,
+	     handoff_sockets_passed,
+	     handoff_drain_until > 0
+  );
 #undef S
 #undef S1
 #undef SW
 }
 
+// Prometheus text exposition: histograms followed by all numeric values of the text stats
+void mtfront_prepare_prometheus_stats (stats_buffer_t *sb) {
+  stats_buffer_t text;
+  sb_alloc (&text, 1 << 20);
+  mtfront_prepare_stats (&text);
+
+  struct mtfront_histograms H;
+  fetch_mtfront_histograms (&H);
+  if (workers) {
+    merge_mtfront_histograms (&H, &SumStats.hist);
+  }
+  sb_print_prometheus_histogram (sb, "mtproxy_rpc_latency_seconds", "Time from a client query to the first middle-end answer forwarded back.", &H.rpc_latency, RPC_LATENCY_UNIT);
+  sb_print_prometheus_histogram (sb, "mtproxy_client_packet_size_bytes", "Size of packets received from clients.", &H.client_packet_size, PACKET_SIZE_UNIT);
+  sb_print_prometheus_histogram (sb, "mtproxy_handshake_duration_seconds", "Time from accept to completed client handshake.", &H.handshake_time, HANDSHAKE_TIME_UNIT);
+  sb_print_prometheus_histogram (sb, "mtproxy_upstream_queue_bytes", "Bytes queued in the middle-end connection a query is forwarded to.", &H.upstream_queue_bytes, QUEUE_BYTES_UNIT);
+
+  sb_print_prometheus_stats (sb, "mtproxy_", text.buff, text.pos);
+  sb_release (&text);
+}
+
 /*
  *
  *      JOB UTILS
@@ -726,6 +878,7 @@ void mtfront_prepare_stats (stats_buffer_t *sb) {
 
 typedef int (*job_callback_func_t)(void *data, int len);
 void schedule_job_callback (int context, job_callback_func_t func, void *data, int len);
+void schedule_job_callback_sub (int context, int subclass, job_callback_func_t func, void *data, int len);
 
 struct job_callback_info {
   job_callback_func_t func;
@@ -746,7 +899,11 @@ int callback_job_run (job_t job, int op, struct job_thread *JT) {
 }
 
 void schedule_job_callback (int context, job_callback_func_t func, void *data, int len) {
-  job_t job = create_async_job (callback_job_run, JSP_PARENT_RWE | JSC_ALLOW (context, JS_RUN) | JSIG_FAST (JS_FINISH), -2, offsetof (struct job_callback_info, data) + len, 0, JOB_REF_NULL);
+  schedule_job_callback_sub (context, -2, func, data, len);
+}
+
+void schedule_job_callback_sub (int context, int subclass, job_callback_func_t func, void *data, int len) {
+  job_t job = create_async_job (callback_job_run, JSP_PARENT_RWE | JSC_ALLOW (context, JS_RUN) | JSIG_FAST (JS_FINISH), subclass, offsetof (struct job_callback_info, data) + len, 0, JOB_REF_NULL);
   assert (job);
   struct job_callback_info *D = (struct job_callback_info *)(job->j_custom);
   D->func = func;
@@ -754,6 +911,15 @@ void schedule_job_callback (int context, job_callback_func_t func, void *data, i
   schedule_job (JOB_REF_PASS (job));
 }
 
+// runs func in the context of given ext_connection shard
+void schedule_ext_conn_callback (int shard, job_callback_func_t func, void *data, int len) {
+  if (ext_conn_shards == 1 && this_job_thread && ((this_job_thread->job_class_mask >> JC_ENGINE) & 1)) {
+    func (data, len);
+  } else {
+    schedule_job_callback_sub (ext_conn_job_class (), ext_conn_job_subclass (shard), func, data, len);
+  }
+}
+
 
 /*
  *
@@ -851,11 +1017,16 @@ int process_client_packet (struct tl_in_state *tlio_in, int op, connection_job_t
       }
       if (D) {
 	vkprintf (2, "proxying answer into connection %d:%llx\n", Ex->in_fd, Ex->in_conn_id);
-	tot_forwarded_responses++;
+	__sync_fetch_and_add (&tot_forwarded_responses, 1);
+	double query_start_time = CONN_INFO(D)->query_start_time;
+	if (query_start_time > 0) {
+	  stats_histogram_add (&MODULE_STAT->rpc_latency, get_utime_monotonic () - query_start_time, RPC_LATENCY_UNIT);
+	  CONN_INFO(D)->query_start_time = 0;
+	}
 	client_send_message (JOB_REF_PASS(D), Ex->in_conn_id, tlio_in, flags);
       } else {
 	vkprintf (2, "external connection not found, dropping proxied answer\n");
-	dropped_responses++;
+	__sync_fetch_and_add (&dropped_responses, 1);
 	_notify_remote_closed (JOB_REF_CREATE_PASS(C), out_conn_id);
       }
       return 1;
@@ -881,10 +1052,10 @@ int process_client_packet (struct tl_in_state *tlio_in, int op, connection_job_t
 	  }
 	  push_rpc_confirmation (JOB_REF_PASS (D), confirm);
 	}
-	tot_forwarded_simple_acks++;
+	__sync_fetch_and_add (&tot_forwarded_simple_acks, 1);
       } else {
 	vkprintf (2, "external connection not found, dropping simple ack\n");
-	dropped_simple_acks++;
+	__sync_fetch_and_add (&dropped_simple_acks, 1);
 	_notify_remote_closed (JOB_REF_CREATE_PASS (C), out_conn_id);
       }
       return 1;
@@ -952,7 +1123,17 @@ int rpcc_execute (connection_job_t C, int op, struct raw_message *msg) {
   case RPC_PROXY_ANS:
   case RPC_SIMPLE_ACK:
   case RPC_CLOSE_EXT: {
-    job_t job = create_async_job (client_packet_job_run, JSP_PARENT_RWE | JSC_ALLOW (JC_ENGINE, JS_RUN) | JSC_ALLOW (JC_ENGINE, JS_ABORT) | JSC_ALLOW (JC_ENGINE, JS_ALARM) | JSC_ALLOW (JC_ENGINE, JS_FINISH), -2, sizeof (struct client_packet_info), JT_HAVE_TIMER, JOB_REF_NULL);
+    int shard = 0;
+    if (ext_conn_shards > 1) {
+      // out_conn_id follows op (and flags for RPC_PROXY_ANS)
+      char hdr[16];
+      int offset = (op == RPC_PROXY_ANS ? 8 : 4);
+      if (rwm_fetch_lookup (msg, hdr, 16) >= offset + 8) {
+        shard = ext_conn_shard_by_out_conn_id (*(long long *)(hdr + offset));
+      }
+    }
+    int jc = ext_conn_job_class ();
+    job_t job = create_async_job (client_packet_job_run, JSP_PARENT_RWE | JSC_ALLOW (jc, JS_RUN) | JSC_ALLOW (jc, JS_ABORT) | JSC_ALLOW (jc, JS_ALARM) | JSC_ALLOW (jc, JS_FINISH), ext_conn_job_subclass (shard), sizeof (struct client_packet_info), JT_HAVE_TIMER, JOB_REF_NULL);
     struct client_packet_info *D = (struct client_packet_info *)(job->j_custom);
     D->msg = *msg;
     D->type = op;
@@ -971,7 +1152,7 @@ static inline int get_conn_tag (connection_job_t C) {
 }
 
 int mtfront_client_ready (connection_job_t C) {
-  check_engine_class ();
+  check_thread_class (JC_ENGINE);
   struct tcp_rpc_data *D = TCP_RPC_DATA(C);
   int fd = CONN_INFO(C)->fd;
   assert ((unsigned) fd < MAX_CONNECTIONS);
@@ -980,33 +1161,51 @@ int mtfront_client_ready (connection_job_t C) {
   vkprintf (1, "Connected to RPC Middle-End (fd=%d)\n", fd);
   rpcc_exists++;
 
-  struct ext_connection *H = &ExtConnectionHead[fd];
-  assert (!H->o_prev);
-  H->o_prev = H->o_next = H;
-  H->out_fd = fd;
-
   CONN_INFO(C)->last_response_time = precise_now;
   return 0;
 }
 
+struct out_conn_close_data {
+  int shard;
+  int fd, generation;
+};
+
+// ENGINE (shard) context
+int do_close_out_ext_conns (void *_data, int s_len) {
+  struct out_conn_close_data *data = _data;
+  assert (s_len == sizeof (struct out_conn_close_data));
+  check_ext_conn_shard (data->shard);
+  struct ext_connection *H = ext_conn_out_head (data->shard, data->fd), *Ex, *Ex_next;
+  if (!H->o_next) {
+    return JOB_COMPLETED;
+  }
+  for (Ex = H->o_next; Ex != H; Ex = Ex_next) {
+    Ex_next = Ex->o_next;
+    assert (Ex->out_fd == data->fd);
+    if (Ex->out_gen == data->generation) {
+      remove_ext_connection (Ex, 2);
+    }
+  }
+  if (H->o_next == H) {
+    assert (H->o_prev == H);
+    H->o_next = H->o_prev = 0;
+    H->out_fd = 0;
+  }
+  return JOB_COMPLETED;
+}
+
 int mtfront_client_close (connection_job_t C, int who) {
-  check_engine_class ();
+  check_thread_class (JC_ENGINE);
   struct tcp_rpc_data *D = TCP_RPC_DATA(C);
   int fd = CONN_INFO(C)->fd;
   assert ((unsigned) fd < MAX_CONNECTIONS);
   vkprintf (1, "Disconnected from RPC Middle-End (fd=%d)\n", fd);
   if (D->extra_int) {
     assert (D->extra_int == get_conn_tag (C));
-    struct ext_connection *H = &ExtConnectionHead[fd], *Ex, *Ex_next;
-    assert (H->o_next);
-    for (Ex = H->o_next; Ex != H; Ex = Ex_next) {
-      Ex_next = Ex->o_next;
-      assert (Ex->out_fd == fd);
-      remove_ext_connection (Ex, 2);
+    struct out_conn_close_data data = { .fd = fd, .generation = CONN_INFO(C)->generation };
+    for (data.shard = 0; data.shard < ext_conn_shards; data.shard++) {
+      schedule_ext_conn_callback (data.shard, do_close_out_ext_conns, &data, sizeof (data));
     }
-    assert (H->o_next == H && H->o_prev == H);
-    H->o_next = H->o_prev = 0;
-    H->out_fd = 0;
   }
   D->extra_int = 0;
   return 0;
@@ -1038,9 +1237,11 @@ int ext_rpcs_execute (connection_job_t C, int op, struct raw_message *msg);
 
 int mtproto_ext_rpc_ready (connection_job_t C);
 int mtproto_ext_rpc_close (connection_job_t C, int who);
+void ext_rpcs_flush_execute (connection_job_t C);
 
 struct tcp_rpc_server_functions ext_rpc_methods = {
   .execute = ext_rpcs_execute,
+  .flush_execute = ext_rpcs_flush_execute,
   .check_ready = server_check_ready,
   .flush_packet = tcp_rpc_flush_packet,
   .rpc_ready = mtproto_ext_rpc_ready,
@@ -1053,17 +1254,26 @@ struct tcp_rpc_server_functions ext_rpc_methods = {
 int mtproto_proxy_rpc_ready (connection_job_t C);
 int mtproto_proxy_rpc_close (connection_job_t C, int who);
 
-// ENGINE context
+struct in_conn_close_data {
+  int fd, generation;
+};
+
+// ENGINE (shard) context
 int do_close_in_ext_conn (void *_data, int s_len) {
-  assert (s_len == 4);
-  int fd = *(int *)_data;
-  struct ext_connection *Ex = get_ext_connection_by_in_fd (fd);
-  if (Ex) {
+  struct in_conn_close_data *data = _data;
+  assert (s_len == sizeof (struct in_conn_close_data));
+  struct ext_connection *Ex = get_ext_connection_by_in_fd (data->fd);
+  if (Ex && Ex->in_gen == data->generation) {
     remove_ext_connection (Ex, 1);
   }
   return JOB_COMPLETED;
 }
 
+static void schedule_close_in_ext_conn (connection_job_t C) {
+  struct in_conn_close_data data = { .fd = CONN_INFO(C)->fd, .generation = CONN_INFO(C)->generation };
+  schedule_ext_conn_callback (ext_conn_shard_by_fd (data.fd), do_close_in_ext_conn, &data, sizeof (data));
+}
+
 // NET_CPU context
 int mtproto_http_close (connection_job_t C, int who) {
   assert ((unsigned) CONN_INFO(C)->fd < MAX_CONNECTIONS);
@@ -1073,32 +1283,39 @@ int mtproto_http_close (connection_job_t C, int who) {
     pending_http_queries--;
     CONN_INFO(C)->pending_queries = 0;
   }
-  schedule_job_callback (JC_ENGINE, do_close_in_ext_conn, &CONN_INFO(C)->fd, 4);
+  schedule_close_in_ext_conn (C);
   return 0;
 }
 
+// ENGINE (shard) context
+int do_lru_insert_conn (void *_data, int s_len) {
+  assert (s_len == sizeof (connection_job_t));
+  connection_job_t C = *(connection_job_t *)_data;
+  lru_insert_conn (C);
+  job_decref (JOB_REF_PASS (C));
+  return JOB_COMPLETED;
+}
+
 int mtproto_ext_rpc_ready (connection_job_t C) {
   assert ((unsigned) CONN_INFO(C)->fd < MAX_CONNECTIONS);
   vkprintf (3, "ext_rpc connection ready (%d)\n", CONN_INFO(C)->fd);
-  lru_insert_conn (C);
+  connection_job_t CC = job_incref (C);
+  schedule_ext_conn_callback (ext_conn_shard_by_fd (CONN_INFO(C)->fd), do_lru_insert_conn, &CC, sizeof (CC));
   return 0;
 }
 
 int mtproto_ext_rpc_close (connection_job_t C, int who) {
   assert ((unsigned) CONN_INFO(C)->fd < MAX_CONNECTIONS);
   vkprintf (3, "ext_rpc connection closing (%d) by %d\n", CONN_INFO(C)->fd, who);
-  struct ext_connection *Ex = get_ext_connection_by_in_fd (CONN_INFO(C)->fd);
-  if (Ex) {
-    remove_ext_connection (Ex, 1);
-  }
+  schedule_close_in_ext_conn (C);
   return 0;
 }
 
 int mtproto_proxy_rpc_ready (connection_job_t C) {
-  check_engine_class ();
   struct tcp_rpc_data *D = TCP_RPC_DATA(C);
   int fd = CONN_INFO(C)->fd;
   assert ((unsigned) fd < MAX_CONNECTIONS);
+  check_ext_conn_shard (ext_conn_shard_by_fd (fd));
   vkprintf (3, "proxy_rpc connection ready (%d)\n", fd);
   struct ext_connection *H = &ExtConnectionHead[fd];
   assert (!H->i_prev);
@@ -1111,10 +1328,10 @@ int mtproto_proxy_rpc_ready (connection_job_t C) {
 }
 
 int mtproto_proxy_rpc_close (connection_job_t C, int who) {
-  check_engine_class ();
   struct tcp_rpc_data *D = TCP_RPC_DATA(C);
   int fd = CONN_INFO(C)->fd;
   assert ((unsigned) fd < MAX_CONNECTIONS);
+  check_ext_conn_shard (ext_conn_shard_by_fd (fd));
   vkprintf (3, "proxy_rpc connection closing (%d) by %d\n", fd, who);
   if (D->extra_int) {
     assert (D->extra_int == -get_conn_tag (C));
@@ -1396,24 +1613,31 @@ int hts_stats_execute (connection_job_t c, struct raw_message *msg, int op) {
     return -404;
   }
 
-  if (D->uri_size != 6) {
+  if (D->uri_size != 6 && D->uri_size != 8) {
     return -404;
   }
   
   char ReqHdr[MAX_HTTP_HEADER_SIZE];
   assert (rwm_fetch_data (msg, &ReqHdr, D->header_size) == D->header_size);
   
-  if (memcmp (ReqHdr + D->uri_offset, "/stats", 6)) {
+  int prometheus = 0;
+  if (D->uri_size == 8 && !memcmp (ReqHdr + D->uri_offset, "/metrics", 8)) {
+    prometheus = 1;
+  } else if (D->uri_size != 6 || memcmp (ReqHdr + D->uri_offset, "/stats", 6)) {
     return -404;
   }
 
   stats_buffer_t sb;
   sb_alloc(&sb, 1 << 20);
-  mtfront_prepare_stats(&sb);
+  if (prometheus) {
+    mtfront_prepare_prometheus_stats (&sb);
+  } else {
+    mtfront_prepare_stats(&sb);
+  }
 
   struct raw_message *raw = calloc (sizeof (*raw), 1);
   rwm_init (raw, 0);
-  write_basic_http_header_raw (c, raw, 200, 0, sb.pos, 0, "text/plain");
+  write_basic_http_header_raw (c, raw, 200, 0, sb.pos, 0, prometheus ? "text/plain; version=0.0.4" : "text/plain");
   assert (rwm_push_data (raw, sb.buff, sb.pos) == sb.pos);
   mpq_push_w (CONN_INFO(c)->out_queue, raw, 0);
   job_signal (JOB_REF_CREATE_PASS (c), JS_RUN);
@@ -1465,7 +1689,8 @@ int hts_execute (connection_job_t c, struct raw_message *msg, int op) {
   assert (msg->total_bytes == D->header_size + D->data_size);
 
   // create http query job here
-  job_t job = create_async_job (http_query_job_run, JSP_PARENT_RWE | JSC_ALLOW (JC_ENGINE, JS_RUN) | JSC_ALLOW (JC_ENGINE, JS_ABORT) | JSC_ALLOW (JC_ENGINE, JS_ALARM) | JSC_ALLOW (JC_CONNECTION, JS_FINISH), -2, sizeof (struct http_query_info) + D->header_size + 1, JT_HAVE_TIMER, JOB_REF_NULL);
+  int jc = ext_conn_job_class ();
+  job_t job = create_async_job (http_query_job_run, JSP_PARENT_RWE | JSC_ALLOW (jc, JS_RUN) | JSC_ALLOW (jc, JS_ABORT) | JSC_ALLOW (jc, JS_ALARM) | JSC_ALLOW (JC_CONNECTION, JS_FINISH), ext_conn_job_subclass (ext_conn_shard_by_fd (CONN_INFO(c)->fd)), sizeof (struct http_query_info) + D->header_size + 1, JT_HAVE_TIMER, JOB_REF_NULL);
   assert (job);
   struct http_query_info *HQ = (struct http_query_info *)(job->j_custom);
 
@@ -1493,34 +1718,63 @@ int hts_execute (connection_job_t c, struct raw_message *msg, int op) {
   return 0;
 }
 
-struct rpcs_exec_data {
+/* packets parsed from one connection during one reader pass are forwarded by a single engine job */
+#define RPCS_BATCH_MAX 32
+
+struct rpcs_exec_packet {
   struct raw_message msg;
-  connection_job_t conn;
-  int op;
   int rpc_flags;
 };
 
+struct rpcs_exec_data {
+  connection_job_t conn;
+  int packets;
+  struct rpcs_exec_packet P[RPCS_BATCH_MAX];
+};
+
+static __thread struct rpcs_exec_data rpcs_batch;
+
 int do_rpcs_execute (void *_data, int s_len) {
   struct rpcs_exec_data *data = _data;
-  assert (s_len == sizeof (struct rpcs_exec_data));
   assert (data);
+  assert (data->packets > 0 && data->packets <= RPCS_BATCH_MAX);
+  assert (s_len == offsetof (struct rpcs_exec_data, P) + data->packets * sizeof (struct rpcs_exec_packet));
 
   lru_insert_conn (data->conn);
 
-  int len = data->msg.total_bytes;
-  struct tl_in_state *tlio_in = tl_in_state_alloc ();
-  tlf_init_raw_message (tlio_in, &data->msg, len, 0);
+  tcp_rpc_conn_send_defer_start ();
+  int i;
+  for (i = 0; i < data->packets; i++) {
+    struct rpcs_exec_packet *P = &data->P[i];
+    int len = P->msg.total_bytes;
+    struct tl_in_state *tlio_in = tl_in_state_alloc ();
+    tlf_init_raw_message (tlio_in, &P->msg, len, 0);
 
-  int res = forward_mtproto_packet (tlio_in, data->conn, len, 0, data->rpc_flags);
-  tl_in_state_free (tlio_in);
-  job_decref (JOB_REF_PASS (data->conn));
+    int res = forward_mtproto_packet (tlio_in, data->conn, len, 0, P->rpc_flags);
+    tl_in_state_free (tlio_in);
 
-  if (!res) {
-    vkprintf (1, "ext_rpcs_execute: cannot forward mtproto packet\n");
+    if (!res) {
+      vkprintf (1, "ext_rpcs_execute: cannot forward mtproto packet\n");
+    }
   }
+  tcp_rpc_conn_send_defer_end ();
+
+  job_decref (JOB_REF_PASS (data->conn));
   return JOB_COMPLETED;
 }
-  
+
+// NET-CPU context
+void ext_rpcs_flush_execute (connection_job_t c) {
+  struct rpcs_exec_data *B = &rpcs_batch;
+  if (!B->packets) {
+    return;
+  }
+  assert (B->conn);
+  __sync_fetch_and_add (&tot_forward_batches, 1);
+  schedule_job_callback_sub (ext_conn_job_class (), ext_conn_job_subclass (ext_conn_shard_by_fd (CONN_INFO(B->conn)->fd)), do_rpcs_execute, B, offsetof (struct rpcs_exec_data, P) + B->packets * sizeof (struct rpcs_exec_packet));
+  B->conn = 0;
+  B->packets = 0;
+}
 
 int ext_rpcs_execute (connection_job_t c, int op, struct raw_message *msg) {
   int len = msg->total_bytes;
@@ -1531,18 +1785,24 @@ int ext_rpcs_execute (connection_job_t c, int op, struct raw_message *msg) {
     vkprintf (1, "ext_rpcs_execute: packet too long (%d bytes), skipping\n", len);
     return SKIP_ALL_BYTES;
   }
+  stats_histogram_add (&MODULE_STAT->client_packet_size, len, PACKET_SIZE_UNIT);
 
   // lru_insert_conn (c); // dangerous in net-cpu context
   if (check_conn_buffers (c) < 0) {
     return SKIP_ALL_BYTES;
   }
 
-  struct rpcs_exec_data data;
-  rwm_move (&data.msg, msg);
-  data.conn = job_incref (c);
-  data.rpc_flags = TCP_RPC_DATA(c)->flags & (RPC_F_QUICKACK | RPC_F_DROPPED | RPC_F_COMPACT_MEDIUM | RPC_F_EXTMODE3);
+  struct rpcs_exec_data *B = &rpcs_batch;
+  if (B->packets && (B->conn != c || B->packets == RPCS_BATCH_MAX)) {
+    ext_rpcs_flush_execute (B->conn);
+  }
+  if (!B->packets) {
+    B->conn = job_incref (c);
+  }
 
-  schedule_job_callback (JC_ENGINE, do_rpcs_execute, &data, sizeof (struct rpcs_exec_data));
+  struct rpcs_exec_packet *P = &B->P[B->packets++];
+  rwm_move (&P->msg, msg);
+  P->rpc_flags = TCP_RPC_DATA(c)->flags & (RPC_F_QUICKACK | RPC_F_DROPPED | RPC_F_COMPACT_MEDIUM | RPC_F_EXTMODE3);
 
   return 1;
 }
@@ -1652,24 +1912,56 @@ int client_send_message (JOB_REF_ARG(C), long long in_conn_id, struct tl_in_stat
 
 // connection_job_t get_target_connection (conn_target_job_t S, int rotate);
 
+// each client bound to an outbound connection weighs as much as 1KB of data queued into it
+static int mtfront_connection_load (connection_job_t C) {
+  return ext_conn_out_count[CONN_INFO(C)->fd];
+}
+
+// less loaded of two random ready connections to middle-end, or 0
+static connection_job_t choose_proxy_connection (conn_target_job_t S) {
+  int attempts = 5;
+  while (S && attempts --> 0) {
+    connection_job_t C = rpc_target_choose_least_loaded_connection (S, 0);
+    if (!C) {
+      return 0;
+    }
+    if (TCP_RPC_DATA(C)->extra_int == get_conn_tag (C)) {
+      return C;
+    }
+    job_decref (JOB_REF_PASS (C));
+  }
+  return 0;
+}
+
+// power of two choices among targets of the cluster, compared by load of their best connections
 conn_target_job_t choose_proxy_target (int target_dc) {
   assert (CurConf->auth_clusters > 0);
   struct mf_cluster *MFC = mf_cluster_lookup (CurConf, target_dc, 1);
   if (!MFC) {
     return 0;
   }
+  assert (MFC->targets_num > 0);
+  conn_target_job_t best = 0;
+  int best_load = 0, choices = MFC->targets_num > 1 ? 2 : 1;
   int attempts = 5;
-  while (attempts --> 0) {
-    assert (MFC->targets_num > 0);
-    conn_target_job_t S = MFC->cluster_targets[lrand48() % MFC->targets_num];
-    connection_job_t C = 0;
-    rpc_target_choose_random_connections (S, 0, 1, &C);
-    if (C && TCP_RPC_DATA(C)->extra_int == get_conn_tag (C)) {
-      job_decref (JOB_REF_PASS (C));
-      return S;
+  while (choices > 0 && attempts --> 0) {
+    conn_target_job_t S = MFC->cluster_targets[lrand48_j () % MFC->targets_num];
+    if (S == best) {
+      continue;
     }
+    connection_job_t C = choose_proxy_connection (S);
+    if (!C) {
+      continue;
+    }
+    int load = rpc_target_connection_load (C);
+    job_decref (JOB_REF_PASS (C));
+    if (!best || load < best_load) {
+      best = S;
+      best_load = load;
+    }
+    choices--;
   }
-  return 0;
+  return best;
 }
 
 static int forward_mtproto_enc_packet (struct tl_in_state *tlio_in, connection_job_t C, long long auth_key_id, int len, int remote_ip_port[5], int rpc_flags) {
@@ -1736,6 +2028,12 @@ int forward_tcp_query (struct tl_in_state *tlio_in, connection_job_t c, conn_tar
     flags |= 0x3005;
   }
 
+  if (Ex && Ex->in_gen != CONN_INFO(c)->generation) {
+    // left from a closed connection with the same fd, its close notification is still pending
+    remove_ext_connection (Ex, 1);
+    Ex = 0;
+  }
+
   if (Ex && Ex->auth_key_id != auth_key_id) {
     Ex->auth_key_id = auth_key_id;
   }
@@ -1753,20 +2051,10 @@ int forward_tcp_query (struct tl_in_state *tlio_in, connection_job_t c, conn_tar
   }
 
   if (!d) {
-    int attempts = 5;
-    while (S && attempts --> 0) {
-      rpc_target_choose_random_connections (S, 0, 1, &d);
-      if (d) {
-	if (TCP_RPC_DATA(d)->extra_int == get_conn_tag (d)) {
-	  break;
-	} else {
-	  job_decref (JOB_REF_PASS (d));
-	}
-      }
-    }
+    d = choose_proxy_connection (S);
     if (!d) {
       vkprintf (2, "nowhere to forward user query from connection %d, dropping\n", CONN_INFO(c)->fd);
-      dropped_queries++;
+      __sync_fetch_and_add (&dropped_queries, 1);
       if (CONN_INFO(c)->type == &ct_tcp_rpc_ext_server_mtfront) {
 	__sync_fetch_and_or (&TCP_RPC_DATA(c)->flags, RPC_F_DROPPED);
       }
@@ -1780,7 +2068,9 @@ int forward_tcp_query (struct tl_in_state *tlio_in, connection_job_t c, conn_tar
     Ex = create_ext_connection (c, 0, d, auth_key_id);
   }
 
-  tot_forwarded_queries++;
+  __sync_fetch_and_add (&tot_forwarded_queries, 1);
+  // read without locking d, good enough for statistics
+  stats_histogram_add (&MODULE_STAT->upstream_queue_bytes, CONN_INFO(d)->out.total_bytes + CONN_INFO(d)->out_p.total_bytes, QUEUE_BYTES_UNIT);
 
   assert (Ex);
 
@@ -1875,8 +2165,6 @@ struct tl_act_extra *mtfront_parse_function (struct tl_in_state *tlio_in, long l
 
 /* ------------------------ FLOOD CONTROL -------------------------- */
 
-struct ext_connection ConnLRU = { .lru_prev = &ConnLRU, .lru_next = &ConnLRU };
-
 void lru_delete_ext_conn (struct ext_connection *Ext) {
   if (Ext->lru_next) {
     Ext->lru_next->lru_prev = Ext->lru_prev;
@@ -1886,9 +2174,10 @@ void lru_delete_ext_conn (struct ext_connection *Ext) {
 }
 
 void lru_insert_ext_conn (struct ext_connection *Ext) {
+  struct ext_connection *ConnLRU = &ExtConnShards[ext_conn_shard_by_fd (Ext->in_fd)].ConnLRU;
   lru_delete_ext_conn (Ext);
-  Ext->lru_prev = ConnLRU.lru_prev;
-  Ext->lru_next = &ConnLRU;
+  Ext->lru_prev = ConnLRU->lru_prev;
+  Ext->lru_next = ConnLRU;
   Ext->lru_next->lru_prev = Ext;
   Ext->lru_prev->lru_next = Ext;
 }
@@ -1907,14 +2196,21 @@ void lru_insert_conn (connection_job_t c) {
   }
 }
 
-void check_all_conn_buffers (void) {
-  struct buffers_stat bufs;
-  fetch_buffers_stat (&bufs);
-  long long max_buffer_memory = bufs.max_buffer_chunks * (long long) MSG_BUFFERS_CHUNK_SIZE;
-  long long to_free = bufs.total_used_buffers_size - max_buffer_memory * 3/4;
-  while (to_free > 0 && ConnLRU.lru_next != &ConnLRU) {
-    struct ext_connection *Ext = ConnLRU.lru_next;
-    vkprintf (2, "check_all_conn_buffers(): closing connection %d because of %lld total used buffer vytes (%lld max, %lld bytes to free)\n", Ext->in_fd, bufs.total_used_buffers_size, max_buffer_memory, to_free);
+struct conn_buffers_free_data {
+  int shard;
+  long long to_free;
+};
+
+// ENGINE (shard) context
+int do_free_conn_buffers (void *_data, int s_len) {
+  struct conn_buffers_free_data *data = _data;
+  assert (s_len == sizeof (struct conn_buffers_free_data));
+  check_ext_conn_shard (data->shard);
+  struct ext_connection *ConnLRU = &ExtConnShards[data->shard].ConnLRU;
+  long long to_free = data->to_free;
+  while (to_free > 0 && ConnLRU->lru_next != ConnLRU) {
+    struct ext_connection *Ext = ConnLRU->lru_next;
+    vkprintf (2, "check_all_conn_buffers(): closing connection %d of shard %d (%lld bytes to free)\n", Ext->in_fd, data->shard, to_free);
     connection_job_t d = connection_get_by_fd_generation (Ext->in_fd, Ext->in_gen);
     if (d) {
       int tot_used_bytes = CONN_INFO(d)->in.total_bytes + CONN_INFO(d)->in_u.total_bytes + CONN_INFO(d)->out.total_bytes + CONN_INFO(d)->out_p.total_bytes;
@@ -1923,7 +2219,23 @@ void check_all_conn_buffers (void) {
       job_decref (JOB_REF_PASS (d));
     }
     lru_delete_ext_conn (Ext);
-    ++connections_failed_lru;
+    __sync_fetch_and_add (&connections_failed_lru, 1);
+  }
+  return JOB_COMPLETED;
+}
+
+void check_all_conn_buffers (void) {
+  struct buffers_stat bufs;
+  fetch_buffers_stat (&bufs);
+  long long max_buffer_memory = bufs.max_buffer_chunks * (long long) MSG_BUFFERS_CHUNK_SIZE;
+  long long to_free = bufs.total_used_buffers_size - max_buffer_memory * 3/4;
+  if (to_free <= 0) {
+    return;
+  }
+  vkprintf (2, "check_all_conn_buffers(): %lld total used buffer bytes (%lld max, %lld bytes to free)\n", bufs.total_used_buffers_size, max_buffer_memory, to_free);
+  struct conn_buffers_free_data data = { .to_free = (to_free + ext_conn_shards - 1) / ext_conn_shards };
+  for (data.shard = 0; data.shard < ext_conn_shards; data.shard++) {
+    schedule_ext_conn_callback (data.shard, do_free_conn_buffers, &data, sizeof (data));
   }
 }
 
@@ -2066,46 +2378,126 @@ void check_special_connections_overflow (void) {
   }
 }
 
+static void check_handoff_drained (void);
+
 void cron (void) {
   check_children_status ();
   compute_stats_sum ();
   check_special_connections_overflow ();
   check_all_conn_buffers ();
+  check_handoff_drained ();
 }
 
 int sfd;
 int http_ports_num;
 int http_sfd[MAX_HTTP_LISTEN_PORTS], http_port[MAX_HTTP_LISTEN_PORTS];
+int listen_acceptors;
+int http_acceptor_sfd[MAX_HTTP_LISTEN_PORTS][MAX_PORT_ACCEPTORS];
 static int domain_count;
 static int secret_count;
 
+static int mtfront_handoff_get_listeners (int *fds, int max_fds) {
+  int i, j, n = 0;
+  for (i = 0; i < http_ports_num; i++) {
+    for (j = 0; j < (listen_acceptors ? listen_acceptors : 1) && n < max_fds; j++) {
+      fds[n++] = listen_acceptors ? http_acceptor_sfd[i][j] : http_sfd[i];
+    }
+  }
+  if (engine_state->sfd > 0 && n < max_fds) {
+    fds[n++] = engine_state->sfd;
+  }
+  return n;
+}
+
+static int mtfront_handoff_get_state (char *buf, int size) {
+  return domain_count ? tcp_rpc_export_proxy_domains (buf, size) : 0;
+}
+
+static void mtfront_handoff_complete (void) {
+  stop_listening_connections ();
+  if (workers) {
+    kill_children (SIGUSR2);
+  }
+  handoff_drain_until = now + handoff_drain_timeout;
+  kprintf ("stopped accepting, exiting when client connections are closed, at most in %d seconds\n", handoff_drain_timeout);
+}
+
+static struct handoff_functions mtfront_handoff_functions = {
+  .get_listeners = mtfront_handoff_get_listeners,
+  .get_state = mtfront_handoff_get_state,
+  .on_complete = mtfront_handoff_complete,
+};
+
+static void check_handoff_drained (void) {
+  if (!handoff_drain_until) {
+    return;
+  }
+  struct connections_stat st;
+  if (workers) {
+    st = SumStats.conn;
+  } else {
+    fetch_connections_stat (&st);
+  }
+  int clients = st.active_connections - st.active_outbound_connections;
+  if (clients <= 0 || now >= handoff_drain_until) {
+    kprintf ("exiting after takeover with %d client connections left\n", clients);
+    handoff_drain_until = 0;
+    signal_set_pending (SIGTERM);
+  }
+}
+
+static int open_http_listener (int port, int mode) {
+  int sfd = handoff_take_listener (port, (mode & SM_IPV6) != 0);
+  return sfd >= 0 ? sfd : server_socket (port, engine_state->settings_addr, engine_get_backlog (), mode);
+}
+
 // static double next_create_outbound;
 // int outbound_connections_per_second = DEFAULT_OUTBOUND_CONNECTION_CREATION_RATE;
 
-void mtfront_pre_loop (void) {
-  int i, enable_ipv6 = engine_check_ipv6_enabled () ? SM_IPV6 : 0;
-  if (domain_count == 0) {
-    tcp_maximize_buffers = 1;
-    if (window_clamp == 0) {
-      window_clamp = DEFAULT_WINDOW_CLAMP;
+static void init_http_listener (int sfd, int mode) {
+  assert (init_listening_tcpv6_connection (sfd, &ct_tcp_rpc_ext_server_mtfront, &ext_rpc_methods, mode) >= 0);
+  // assert (setsockopt (sfd, IPPROTO_TCP, TCP_MAXSEG, (int[]){1410}, sizeof (int)) >= 0);
+  // assert (setsockopt (sfd, IPPROTO_TCP, TCP_NODELAY, (int[]){1}, sizeof (int)) >= 0);
+  if (window_clamp) {
+    listening_connection_job_t LC = Events[sfd].data;
+    assert (LC);
+    LISTEN_CONN_INFO(LC)->window_clamp = window_clamp;
+    if (setsockopt (sfd, IPPROTO_TCP, TCP_WINDOW_CLAMP, &window_clamp, 4) < 0) {
+      vkprintf (0, "error while setting window size for socket #%d to %d: %m\n", sfd, window_clamp);
     }
   }
+}
+
+void mtfront_pre_loop (void) {
+  int i, j, enable_ipv6 = engine_check_ipv6_enabled () ? SM_IPV6 : 0;
+  if (domain_count && !slave_mode) {
+    tcp_rpc_start_proxy_domain_probes ();
+  }
   if (!workers) {
+    int mode = enable_ipv6 | SM_LOWPRIO | (domain_count == 0 ? SM_NOQACK : 0) | (max_special_connections ? SM_SPECIAL : 0);
     for (i = 0; i < http_ports_num; i++) {
-      init_listening_tcpv6_connection (http_sfd[i], &ct_tcp_rpc_ext_server_mtfront, &ext_rpc_methods, enable_ipv6 | SM_LOWPRIO | (domain_count == 0 ? SM_NOQACK : 0) | (max_special_connections ? SM_SPECIAL : 0));
-      // assert (setsockopt (http_sfd[i], IPPROTO_TCP, TCP_MAXSEG, (int[]){1410}, sizeof (int)) >= 0);
-      // assert (setsockopt (http_sfd[i], IPPROTO_TCP, TCP_NODELAY, (int[]){1}, sizeof (int)) >= 0);
-      if (window_clamp) {
-        listening_connection_job_t LC = Events[http_sfd[i]].data;
-        assert (LC);
-        CONN_INFO(LC)->window_clamp = window_clamp;
-        if (setsockopt (http_sfd[i], IPPROTO_TCP, TCP_WINDOW_CLAMP, &window_clamp, 4) < 0) {
-          vkprintf (0, "error while setting window size for socket #%d to %d: %m\n", http_sfd[i], window_clamp);
+      if (listen_acceptors) {
+        for (j = 0; j < listen_acceptors; j++) {
+          init_http_listener (http_acceptor_sfd[i][j], mode | SM_ACCEPTOR);
         }
+      } else {
+        init_http_listener (http_sfd[i], mode);
       }
     }
+    if (listen_acceptors) {
+      start_listening_acceptors ();
+      vkprintf (0, "accepting on %d SO_REUSEPORT listeners per port\n", listen_acceptors);
+    }
+    if (domain_count) {
+      tcp_rpcs_init_key_share_pool ();
+    }
     // create_all_outbound_connections ();
   }
+  if (!slave_mode) {
+    // listening sockets are served now (by workers soon), the process taken over from may stop accepting
+    handoff_ready ();
+    handoff_start (&mtfront_handoff_functions);
+  }
 }
 
 void precise_cron (void) {
@@ -2119,6 +2511,14 @@ void mtfront_sigusr1_handler (void) {
   }
 }
 
+// sent to workers when listening sockets are taken over by a new process
+void mtfront_sigusr2_handler (void) {
+  if (slave_mode) {
+    stop_listening_connections ();
+    vkprintf (0, "worker %d stopped accepting\n", worker_id);
+  }
+}
+
 /*
  *
  *		MAIN
@@ -2189,6 +2589,89 @@ int f_parse_option (int val) {
     engine_set_http_fallback (&ct_http_server, &http_methods_stats);
     mtproto_front_functions.flags &= ~ENGINE_NO_PORT;
     break;
+  case 2001:
+    ext_conn_shards_req = atoi (optarg);
+    if (ext_conn_shards_req < 1 || ext_conn_shards_req > MAX_EXT_CONN_SHARDS || (ext_conn_shards_req & (ext_conn_shards_req - 1))) {
+      kprintf ("--engine-shards requires a power of two between 1 and %d\n", MAX_EXT_CONN_SHARDS);
+      usage ();
+      return 2;
+    }
+    break;
+  case 2002:
+    listen_acceptors = atoi (optarg);
+    if (listen_acceptors < 0 || listen_acceptors > MAX_PORT_ACCEPTORS) {
+      kprintf ("--acceptors requires a number between 0 and %d\n", MAX_PORT_ACCEPTORS);
+      usage ();
+      return 2;
+    }
+    break;
+  case 2003:
+    {
+      long long size = atoll (optarg);
+      if (size <= 0) {
+        kprintf ("--replay-cache-size requires a positive number\n");
+        usage ();
+        return 2;
+      }
+      tcp_rpcs_set_client_random_cache (size, 0);
+    }
+    break;
+  case 2004:
+    {
+      int cache_time = atoi (optarg);
+      if (cache_time <= 0) {
+        kprintf ("--replay-cache-time requires a positive number of seconds\n");
+        usage ();
+        return 2;
+      }
+      tcp_rpcs_set_client_random_cache (0, cache_time);
+    }
+    break;
+  case 2005:
+  case 2006:
+    {
+      int size = atoi (optarg);
+      if (size < 256 || size > TLS_MAX_RECORD_SIZE) {
+        kprintf ("--%s requires a number between 256 and %d\n", val == 2005 ? "tls-record-min-size" : "tls-record-max-size", TLS_MAX_RECORD_SIZE);
+        usage ();
+        return 2;
+      }
+      tcp_set_tls_record_sizing (val == 2005 ? size : 0, val == 2006 ? size : 0, -1);
+    }
+    break;
+  case 2007:
+    {
+      int boost_bytes = atoi (optarg);
+      if (boost_bytes < 0) {
+        kprintf ("--tls-record-boost-bytes requires a non-negative number\n");
+        usage ();
+        return 2;
+      }
+      tcp_set_tls_record_sizing (0, 0, boost_bytes);
+    }
+    break;
+  case 2008:
+    {
+      double interval = atof (optarg);
+      if (interval < 0) {
+        kprintf ("--domain-probe-interval requires a non-negative number\n");
+        usage ();
+        return 2;
+      }
+      tcp_rpcs_set_domain_probe_interval (interval);
+    }
+    break;
+  case 2009:
+    handoff_path = optarg;
+    break;
+  case 2010:
+    handoff_drain_timeout = atoi (optarg);
+    if (handoff_drain_timeout < 0) {
+      kprintf ("--handoff-drain-timeout requires a non-negative number\n");
+      usage ();
+      return 2;
+    }
+    break;
   case 'D':
     tcp_rpc_add_proxy_domain (optarg);
     domain_count++;
@@ -2239,13 +2722,23 @@ void mtfront_prepare_parse_options (void) {
   parse_option ("http-stats", no_argument, 0, 2000, "allow http server to answer on stats queries");
   parse_option ("mtproto-secret", required_argument, 0, 'S', "16-byte secret in hex mode");
   parse_option ("proxy-tag", required_argument, 0, 'P', "16-byte proxy tag in hex mode to be passed along with all forwarded queries");
-  parse_option ("domain", required_argument, 0, 'D', "adds allowed domain for TLS-transport mode, disables other transports; can be specified more than once");
+  parse_option ("domain", required_argument, 0, 'D', "adds allowed domain for TLS-transport mode, disables other transports; can be specified more than once; <domain>:<port> checks and proxies to a non-default port");
   parse_option ("max-special-connections", required_argument, 0, 'C', "sets maximal number of accepted client connections per worker");
   parse_option ("window-clamp", required_argument, 0, 'W', "sets window clamp for client TCP connections");
   parse_option ("http-ports", required_argument, 0, 'H', "comma-separated list of client (HTTP) ports to listen");
   // parse_option ("outbound-connections-ps", required_argument, 0, 'o', "limits creation rate of outbound connections to mtproto-servers (default %d)", DEFAULT_OUTBOUND_CONNECTION_CREATION_RATE);
-  parse_option ("slaves", required_argument, 0, 'M', "spawn several slave workers; not recommended for TLS-transport mode for better replay protection");
+  parse_option ("slaves", required_argument, 0, 'M', "spawn several slave workers");
   parse_option ("ping-interval", required_argument, 0, 'T', "sets ping interval in second for local TCP connections (default %.3lf)", PING_INTERVAL);
+  parse_option ("acceptors", required_argument, 0, 2002, "opens each client port <arg> times with SO_REUSEPORT, every listener served by its own acceptor thread; alternative to -M sharing config, middle-end connections and stats (default 0)");
+  parse_option ("engine-shards", required_argument, 0, 2001, "splits client connections table into <arg> shards processed by separate engine threads, power of two (default 1); requires multithread mode");
+  parse_option ("replay-cache-size", required_argument, 0, 2003, "number of TLS-transport client randoms remembered for replay protection, shared by all workers (default %d)", DEFAULT_CLIENT_RANDOM_CACHE_SIZE);
+  parse_option ("replay-cache-time", required_argument, 0, 2004, "seconds TLS-transport client randoms are remembered for replay protection (default %d)", DEFAULT_CLIENT_RANDOM_CACHE_TIME);
+  parse_option ("tls-record-min-size", required_argument, 0, 2005, "size of TLS-transport records sent after the connection was idle (default %d)", DEFAULT_TLS_RECORD_MIN_SIZE);
+  parse_option ("tls-record-max-size", required_argument, 0, 2006, "size of TLS-transport records sent during sustained transfers (default %d)", DEFAULT_TLS_RECORD_MAX_SIZE);
+  parse_option ("tls-record-boost-bytes", required_argument, 0, 2007, "bytes sent without a pause after which TLS-transport records grow to maximal size, 0 to always use it (default %d)", DEFAULT_TLS_RECORD_BOOST_BYTES);
+  parse_option ("domain-probe-interval", required_argument, 0, 2008, "seconds between background checks of TLS-transport domains, 0 to check only at start (default %.0lf)", DEFAULT_DOMAIN_PROBE_INTERVAL);
+  parse_option ("handoff-socket", required_argument, 0, 2009, "unix socket for graceful upgrades: a new process started with the same path takes over listening sockets and checked domains from the running one, which stops accepting and exits when its clients disconnect");
+  parse_option ("handoff-drain-timeout", required_argument, 0, 2010, "seconds a process serves its remaining clients after its listening sockets were taken over (default %d)", DEFAULT_HANDOFF_DRAIN_TIMEOUT);
 }
 
 void mtfront_parse_extra_args (int argc, char *argv[]) /* {{{ */ {
@@ -2270,28 +2763,69 @@ void mtfront_pre_init (void) {
 
   vkprintf (1, "config loaded!\n");
 
+  char *handoff_state = NULL;
+  int handoff_state_len = 0;
+  if (handoff_path && handoff_receive (handoff_path, &handoff_state, &handoff_state_len) >= 0 && handoff_state) {
+    tcp_rpc_set_proxy_domains_snapshot (handoff_state);
+  }
+
   if (domain_count) {
     tcp_rpc_init_proxy_domains();
-
-    if (workers) {
-      kprintf ("It is recommended to not use workers with TLS-transport");
-    }
+    tcp_rpc_set_proxy_domains_snapshot (NULL);
+    tcp_rpcs_init_client_random_cache ();
     if (secret_count == 0) {
       kprintf ("You must specify at least one mtproto-secret to use when using TLS-transport");
       exit (2);
     }
   }
 
+  // set before the listening sockets are created, accepted sockets inherit their buffer sizes
+  if (domain_count == 0) {
+    tcp_maximize_buffers = 1;
+    if (window_clamp == 0) {
+      window_clamp = DEFAULT_WINDOW_CLAMP;
+    }
+  }
+
   int i, enable_ipv6 = engine_check_ipv6_enabled () ? SM_IPV6 : 0;
 
+  if (listen_acceptors && workers) {
+    kprintf ("--acceptors and -M are alternative ways of spreading accepts, use only one of them\n");
+    exit (2);
+  }
+
   for (i = 0; i < http_ports_num; i++) {
-    http_sfd[i] = server_socket (http_port[i], engine_state->settings_addr, engine_get_backlog (), enable_ipv6);
+    if (listen_acceptors) {
+      int j;
+      for (j = 0; j < listen_acceptors; j++) {
+        http_acceptor_sfd[i][j] = open_http_listener (http_port[i], enable_ipv6 | SM_REUSEPORT);
+        if (http_acceptor_sfd[i][j] < 0) {
+          kprintf ("cannot open SO_REUSEPORT http/tcp server socket #%d at port %d: %m\n", j, http_port[i]);
+          exit (1);
+        }
+      }
+      http_sfd[i] = http_acceptor_sfd[i][0];
+      continue;
+    }
+    http_sfd[i] = open_http_listener (http_port[i], enable_ipv6);
     if (http_sfd[i] < 0) {
       kprintf ("cannot open http/tcp server socket at port %d: %m\n", http_port[i]);
       exit (1);
     }
   }
 
+  free (handoff_state);
+  if (engine_state->port > 0) {
+    // stats port
+    int sfd = handoff_take_listener (engine_state->port, 0);
+    if (sfd >= 0) {
+      engine_state->sfd = sfd;
+    }
+  }
+  if (handoff_path) {
+    handoff_listen (handoff_path);
+  }
+
   if (workers) {
     if (!kdb_hosts_loaded) {
       kdb_load_hosts ();
@@ -2312,6 +2846,7 @@ void mtfront_pre_init (void) {
         assert (parent_pid == real_parent_pid);
 	engine_enable_slave_mode ();
 	engine_state->do_not_open_port = 1;
+        handoff_close_listener ();
         break;
       } else {
         pids[i] = pid;
@@ -2333,8 +2868,19 @@ void mtfront_pre_start (void) {
   proxy_mode |= PROXY_MODE_OUT;
   mtfront_rpc_client.mode_flags |= TCP_RPC_IGNORE_PID;
   ct_tcp_rpc_client_mtfront.flags |= C_EXTERNAL;
+  rpc_target_set_connection_load_func (mtfront_connection_load);
 
   assert (proxy_mode == PROXY_MODE_OUT);
+
+  if (ext_conn_shards_req > 1) {
+    if (!engine_check_multithread_enabled ()) {
+      kprintf ("--engine-shards ignored: multithread mode is disabled\n");
+    } else {
+      init_ext_conn_shards (ext_conn_shards_req);
+      create_job_class_sub (JC_ENGINE_MULT, ext_conn_shards, ext_conn_shards, 1, ext_conn_shards);
+      vkprintf (0, "using %d ext connection shards\n", ext_conn_shards);
+    }
+  }
 }
 
 void mtfront_on_exit (void) {
@@ -2370,5 +2916,7 @@ int main (int argc, char *argv[]) {
   mtproto_front_functions.allowed_signals |= SIG2INT (SIGCHLD);
   mtproto_front_functions.signal_handlers[SIGCHLD] = on_child_termination;
   mtproto_front_functions.signal_handlers[SIGUSR1] = mtfront_sigusr1_handler;
+  mtproto_front_functions.allowed_signals |= SIG2INT (SIGUSR2);
+  mtproto_front_functions.signal_handlers[SIGUSR2] = mtfront_sigusr2_handler;
   return default_main (&mtproto_front_functions, argc, argv);
 }
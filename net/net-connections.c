@@ -35,6 +35,7 @@
 #include <math.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -62,6 +63,7 @@
 
 #include "net/net-msg-buffers.h"
 #include "net/net-tcp-connections.h"
+#include "net/net-uring.h"
 
 #include "common/common-stats.h"
 
@@ -105,9 +107,14 @@ int allocated_targets, active_targets, inactive_targets, free_targets;
 int allocated_connections, allocated_socket_connections;
 long long accept_calls_failed, accept_nonblock_set_failed, accept_connection_limit_failed,
           accept_rate_limit_failed, accept_init_accepted_failed;
+long long accept_syscalls, accepted_sockets, accept_batches_cut;
 
 long long tcp_readv_calls, tcp_writev_calls, tcp_readv_intr, tcp_writev_intr;
 long long tcp_readv_bytes, tcp_writev_bytes;
+long long tcp_readv_parts, tcp_readv_large_calls;
+
+int listening_acceptors;
+long long acceptor_accepted, acceptor_wakeups;
 
 int free_later_size;
 long long free_later_total;
@@ -131,6 +138,9 @@ MODULE_STAT_FUNCTION
   SB_SUM_ONE_LL (inbound_connections_accepted);
 
   SB_SUM_ONE_I (listening_connections);
+  SB_SUM_ONE_I (listening_acceptors);
+  SB_SUM_ONE_LL (acceptor_accepted);
+  SB_SUM_ONE_LL (acceptor_wakeups);
   SB_SUM_ONE_LL (unused_connections_closed);
   SB_SUM_ONE_I (ready_targets);
   SB_SUM_ONE_I (allocated_targets);
@@ -158,6 +168,8 @@ MODULE_STAT_FUNCTION
   SB_SUM_ONE_LL (tcp_readv_calls);
   SB_SUM_ONE_LL (tcp_readv_intr);
   SB_SUM_ONE_LL (tcp_readv_bytes);
+  SB_SUM_ONE_LL (tcp_readv_parts);
+  SB_SUM_ONE_LL (tcp_readv_large_calls);
   SB_SUM_ONE_LL (tcp_writev_calls);
   SB_SUM_ONE_LL (tcp_writev_intr);
   SB_SUM_ONE_LL (tcp_writev_bytes);
@@ -169,6 +181,11 @@ MODULE_STAT_FUNCTION
   SB_SUM_ONE_LL (accept_connection_limit_failed);
   SB_SUM_ONE_LL (accept_rate_limit_failed);
   SB_SUM_ONE_LL (accept_init_accepted_failed);
+  SB_SUM_ONE_LL (accept_syscalls);
+  SB_SUM_ONE_LL (accepted_sockets);
+  SB_SUM_ONE_LL (accept_batches_cut);
+  long long accepted = SB_SUM_LL (accepted_sockets);
+  sb_printf (sb, "accept_syscalls_per_connection\t%.3f\n", accepted > 0 ? (double) SB_SUM_LL (accept_syscalls) / accepted : 0);
 MODULE_STAT_FUNCTION_END
 
 void fetch_connections_stat (struct connections_stat *st) {
@@ -215,29 +232,55 @@ int set_write_timer (connection_job_t C);
 int prealloc_tcp_buffers (void);
 int clear_connection_write_timeout (connection_job_t c);
 
-static int tcp_recv_buffers_num;
-static int tcp_recv_buffers_total_size;
-static struct iovec tcp_recv_iovec[MAX_TCP_RECV_BUFFERS + 1];
-static struct msg_buffer *tcp_recv_buffers[MAX_TCP_RECV_BUFFERS];
+/*
+  preallocated receive buffers are kept in sets of equal-sized buffers;
+  each readv fills one set, chosen by the average read size of the connection,
+  so that bulk transfers use few large msg_parts and small reads do not pin large buffers
+*/
+#define TCP_RECV_SETS 3
+
+struct tcp_recv_set {
+  int buffer_size;
+  int max_buffers;
+  int buffers_num;
+  int total_size;
+  struct iovec iovec[MAX_TCP_RECV_BUFFERS + 1];
+  struct msg_buffer *buffers[MAX_TCP_RECV_BUFFERS];
+};
+
+static struct tcp_recv_set tcp_recv_sets[TCP_RECV_SETS] = {
+  { .buffer_size = TCP_RECV_BUFFER_SIZE, .max_buffers = MAX_TCP_RECV_BUFFERS },
+  { .buffer_size = TCP_RECV_MEDIUM_BUFFER_SIZE, .max_buffers = TCP_RECV_MEDIUM_BUFFERS },
+  { .buffer_size = TCP_RECV_LARGE_BUFFER_SIZE, .max_buffers = TCP_RECV_LARGE_BUFFERS },
+};
 
-int prealloc_tcp_buffers (void) /* {{{ */ {
-  assert (!tcp_recv_buffers_num);   
+static void prealloc_tcp_recv_set (struct tcp_recv_set *S) /* {{{ */ {
+  assert (!S->buffers_num && S->max_buffers <= MAX_TCP_RECV_BUFFERS);
 
   int i;
-  for (i = MAX_TCP_RECV_BUFFERS - 1; i >= 0; i--) {
-    struct msg_buffer *X = alloc_msg_buffer ((tcp_recv_buffers_num) ? tcp_recv_buffers[i + 1] : 0, TCP_RECV_BUFFER_SIZE);
+  for (i = S->max_buffers - 1; i >= 0; i--) {
+    struct msg_buffer *X = alloc_msg_buffer ((S->buffers_num) ? S->buffers[i + 1] : 0, S->buffer_size);
     if (!X) {
       vkprintf (0, "**FATAL**: cannot allocate tcp receive buffer\n");
       exit (2);
     }
     vkprintf (3, "allocated %d byte tcp receive buffer #%d at %p\n", X->chunk->buffer_size, i, X);
-    tcp_recv_buffers[i] = X;
-    tcp_recv_iovec[i + 1].iov_base = X->data;
-    tcp_recv_iovec[i + 1].iov_len = X->chunk->buffer_size;
-    ++ tcp_recv_buffers_num;
-    tcp_recv_buffers_total_size += X->chunk->buffer_size;
+    S->buffers[i] = X;
+    S->iovec[i + 1].iov_base = X->data;
+    S->iovec[i + 1].iov_len = X->chunk->buffer_size;
+    ++ S->buffers_num;
+    S->total_size += X->chunk->buffer_size;
+  }
+}
+/* }}} */
+
+int prealloc_tcp_buffers (void) /* {{{ */ {
+  int i, num = 0;
+  for (i = 0; i < TCP_RECV_SETS; i++) {
+    prealloc_tcp_recv_set (&tcp_recv_sets[i]);
+    num += tcp_recv_sets[i].buffers_num;
   }
-  return tcp_recv_buffers_num;
+  return num;
 }
 /* }}} */
 
@@ -297,6 +340,10 @@ static inline int compute_conn_events (connection_job_t c) {
   if (flags & (C_ERROR | C_FAILED | C_NET_FAILED)) {
     return 0;
   }
+  if (flags & C_URING) {
+    // reads and writes are io_uring requests, epoll only reports hangups
+    return EVT_SPEC;
+  }
   return (((flags & (C_WANTRD | C_STOPREAD)) == C_WANTRD) ? EVT_READ : 0) | (flags & C_WANTWR ? EVT_WRITE : 0) | EVT_SPEC 
        | (((flags & (C_WANTRD | C_NORD)) == (C_WANTRD | C_NORD))
          || ((flags & (C_WANTWR | C_NOWR)) == (C_WANTWR | C_NOWR)) ? EVT_LEVEL : 0);
@@ -589,19 +636,22 @@ connection_job_t alloc_new_connection (int cfd, conn_target_job_t CTJ, listening
   struct conn_target_info *CT = CTJ ? CONN_TARGET_INFO (CTJ) : NULL;
   struct listening_connection_info *LC = LCJ ? LISTEN_CONN_INFO (LCJ) : NULL;
 
-  unsigned flags;
-  if ((flags = fcntl (cfd, F_GETFL, 0) < 0) || fcntl (cfd, F_SETFL, flags | O_NONBLOCK) < 0) {
-    kprintf ("cannot set O_NONBLOCK on accepted socket #%d: %m\n", cfd);
-    MODULE_STAT->accept_nonblock_set_failed ++;
-    close (cfd);
-    return NULL;
-  }  
+  // accepted sockets come from accept4 () non-blocking, with TCP_NODELAY, keepalive and buffer sizes inherited from the listening socket
+  if (basic_type != ct_inbound) {
+    unsigned flags;
+    if ((flags = fcntl (cfd, F_GETFL, 0) < 0) || fcntl (cfd, F_SETFL, flags | O_NONBLOCK) < 0) {
+      kprintf ("cannot set O_NONBLOCK on socket #%d: %m\n", cfd);
+      MODULE_STAT->accept_nonblock_set_failed ++;
+      close (cfd);
+      return NULL;
+    }  
   
-  flags = 1;
-  setsockopt (cfd, IPPROTO_TCP, TCP_NODELAY, &flags, sizeof (flags));
-  if (tcp_maximize_buffers) {
-    maximize_sndbuf (cfd, 0);
-    maximize_rcvbuf (cfd, 0);
+    flags = 1;
+    setsockopt (cfd, IPPROTO_TCP, TCP_NODELAY, &flags, sizeof (flags));
+    if (tcp_maximize_buffers) {
+      maximize_sndbuf (cfd, 0);
+      maximize_rcvbuf (cfd, 0);
+    }
   }
 
   if (cfd >= max_connection_fd) {
@@ -738,9 +788,10 @@ connection_job_t alloc_new_connection (int cfd, conn_target_job_t CTJ, listening
         }
       }
       if (c->window_clamp) {
+        MODULE_STAT->accept_syscalls ++;
         if (setsockopt (cfd, IPPROTO_TCP, TCP_WINDOW_CLAMP, &c->window_clamp, 4) < 0) {
           vkprintf (0, "error while setting window size for socket #%d to %d: %m\n", cfd, c->window_clamp);
-        } else {
+        } else if (verbosity >= 2) {
           int t1 = -1, t2 = -1;
           socklen_t s1 = 4, s2 = 4;
           getsockopt (cfd, IPPROTO_TCP, TCP_WINDOW_CLAMP, &t1, &s1);
@@ -800,6 +851,13 @@ void fail_socket_connection (socket_connection_job_t C, int who) /* {{{ */ {
     epoll_insert (c->fd, 0);
     c->ev = NULL;
 
+    if (c->flags & C_URING_RECV) {
+      net_uring_cancel (C, URING_OP_RECV);
+    }
+    if (c->flags & C_URING_SEND) {
+      net_uring_cancel (C, URING_OP_SEND);
+    }
+
     c->type->socket_close (C);
 
     fail_connection (c->conn, who);
@@ -835,6 +893,12 @@ int net_server_socket_free (socket_connection_job_t C) /* {{{ */ {
 
   rwm_free (&c->out);
 
+  if (c->uring_send) {
+    assert (!(c->flags & (C_URING_RECV | C_URING_SEND)));
+    free (c->uring_send);
+    c->uring_send = NULL;
+  }
+
   MODULE_STAT->allocated_socket_connections --;
   return 0;
 }
@@ -849,21 +913,26 @@ int net_server_socket_reader (socket_connection_job_t C) /* {{{ */ {
   struct socket_connection_info *c = SOCKET_CONN_INFO (C);
 
   while ((c->flags & (C_WANTRD | C_NORD | C_STOPREAD | C_ERROR | C_NET_FAILED)) == C_WANTRD) {
-    if (!tcp_recv_buffers_num) {
+    if (!tcp_recv_sets[0].buffers_num) {
       prealloc_tcp_buffers ();
     }
 
+    struct tcp_recv_set *S = &tcp_recv_sets[c->recv_avg >= TCP_RECV_LARGE_THRESHOLD ? 2 : c->recv_avg >= TCP_RECV_MEDIUM_THRESHOLD ? 1 : 0];
+
     struct raw_message *in = malloc (sizeof (*in));
     rwm_init (in, 0);
     
-    int s = tcp_recv_buffers_total_size;
+    int s = S->total_size;
     assert (s > 0);
 
     int p = 1;
 
     __sync_fetch_and_or (&c->flags, C_NORD);
-    int r = readv (c->fd, tcp_recv_iovec + p, MAX_TCP_RECV_BUFFERS + 1 - p);
+    int r = readv (c->fd, S->iovec + p, S->buffers_num + 1 - p);
     MODULE_STAT->tcp_readv_calls ++;
+    if (S != tcp_recv_sets) {
+      MODULE_STAT->tcp_readv_large_calls ++;
+    }
 
     if (r <= 0) {
       if (r < 0 && errno == EAGAIN) {
@@ -893,12 +962,14 @@ int net_server_socket_reader (socket_connection_job_t C) /* {{{ */ {
     }
 
     MODULE_STAT->tcp_readv_bytes += r;
+    c->recv_avg = (3 * c->recv_avg + r) >> 2;
+
     struct msg_part *mp = 0;
     assert (p == 1);
-    mp = new_msg_part (0, tcp_recv_buffers[p - 1]);
-    assert (tcp_recv_buffers[p - 1]->data == tcp_recv_iovec[p].iov_base);
+    mp = new_msg_part (0, S->buffers[p - 1]);
+    assert (S->buffers[p - 1]->data == S->iovec[p].iov_base);
     mp->offset = 0;
-    mp->data_end = r > tcp_recv_iovec[p].iov_len ? tcp_recv_iovec[p].iov_len : r;
+    mp->data_end = r > S->iovec[p].iov_len ? S->iovec[p].iov_len : r;
     r -= mp->data_end;
     in->first = in->last = mp;
     in->total_bytes = mp->data_end;
@@ -908,9 +979,9 @@ int net_server_socket_reader (socket_connection_job_t C) /* {{{ */ {
 
     int rs = r;
     while (rs > 0) {
-      mp = new_msg_part (0, tcp_recv_buffers[p - 1]);
+      mp = new_msg_part (0, S->buffers[p - 1]);
       mp->offset = 0;
-      mp->data_end = rs > tcp_recv_iovec[p].iov_len ? tcp_recv_iovec[p].iov_len : rs;
+      mp->data_end = rs > S->iovec[p].iov_len ? S->iovec[p].iov_len : rs;
       rs -= mp->data_end;
       in->last->next = mp;
       in->last = mp;
@@ -919,17 +990,18 @@ int net_server_socket_reader (socket_connection_job_t C) /* {{{ */ {
       p ++;
     }
     assert (!rs);
+    MODULE_STAT->tcp_readv_parts += p - 1;
 
     int i;
     for (i = 0; i < p - 1; i++) {
-      struct msg_buffer *X = alloc_msg_buffer (tcp_recv_buffers[i], TCP_RECV_BUFFER_SIZE);
+      struct msg_buffer *X = alloc_msg_buffer (S->buffers[i], S->buffer_size);
       if (!X) {
         vkprintf (0, "**FATAL**: cannot allocate tcp receive buffer\n");
         assert (0);
       }
-      tcp_recv_buffers[i] = X;
-      tcp_recv_iovec[i + 1].iov_base = X->data;
-      tcp_recv_iovec[i + 1].iov_len = X->chunk->buffer_size;
+      S->buffers[i] = X;
+      S->iovec[i + 1].iov_base = X->data;
+      S->iovec[i + 1].iov_len = X->chunk->buffer_size;
     }
 
     assert (c->conn);
@@ -940,12 +1012,133 @@ int net_server_socket_reader (socket_connection_job_t C) /* {{{ */ {
 }
 /* }}} */
 
+/*
+  Invoked in JC_URING thread
+  Puts received data to conn->in_queue; rearms receive request after its last completion
+*/
+void net_server_socket_uring_received (socket_connection_job_t C, struct raw_message *in, int res, int more) /* {{{ */ {
+  struct socket_connection_info *c = SOCKET_CONN_INFO (C);
+
+  if (in) {
+    if (!(c->flags & (C_ERROR | C_NET_FAILED | C_STOPREAD))) {
+      MODULE_STAT->tcp_readv_bytes += res;
+      assert (c->conn);
+      mpq_push_w (CONN_INFO(c->conn)->in_queue, in, 0);
+      job_signal (JOB_REF_CREATE_PASS (c->conn), JS_RUN);
+    } else {
+      rwm_free (in);
+      free (in);
+    }
+  } else if (res != -ENOBUFS && res != -EAGAIN && res != -EINTR && res != -ECANCELED) {
+    if (res < 0) {
+      vkprintf (1, "Connection %d: Fatal error %s\n", c->fd, strerror (-res));
+    }
+    __sync_fetch_and_or (&c->flags, C_NET_FAILED);
+    job_signal (JOB_REF_CREATE_PASS (C), JS_ABORT);
+    more = 0;
+  }
+
+  if (!more) {
+    if (net_uring_submit_recv (C, c->fd, &c->flags, C_ERROR | C_NET_FAILED | C_STOPREAD) < 0) {
+      __sync_fetch_and_and (&c->flags, ~C_URING_RECV);
+    }
+  }
+}
+/* }}} */
+
+/*
+  Invoked in JC_URING thread
+  Result is applied by socket_writer in socket job
+*/
+void net_server_socket_uring_sent (socket_connection_job_t C, int res) /* {{{ */ {
+  struct socket_connection_info *c = SOCKET_CONN_INFO (C);
+  c->uring_send->res = res;
+  __sync_fetch_and_and (&c->flags, ~(C_URING_SEND | C_NOWR));
+  job_signal (JOB_REF_CREATE_PASS (C), JS_RUN);
+}
+/* }}} */
+
+/*
+  io_uring version of socket_writer: accounts completed sendmsg and submits next one
+  at most one request is in flight, it references iovecs of out raw message
+*/
+static int net_server_socket_uring_writer (socket_connection_job_t C) /* {{{ */{
+  struct socket_connection_info *c = SOCKET_CONN_INFO (C);
+  struct uring_send *u = c->uring_send;
+  struct raw_message *out = &c->out;
+
+  if (c->flags & C_URING_SEND) {
+    return out->total_bytes;
+  }
+
+  int check_watermark = out->total_bytes >= c->write_low_watermark;
+  int stop = c->flags & C_STOPWRITE;
+  int r = 0;
+
+  if (u->inflight) {
+    r = u->res;
+    u->inflight = 0;
+    MODULE_STAT->tcp_writev_calls ++;
+    if (r < 0 && r != -EAGAIN && r != -EINTR) {
+      vkprintf (1, "Connection %d: Fatal error %s\n", c->fd, strerror (-r));
+      job_signal (JOB_REF_CREATE_PASS (C), JS_ABORT);
+      __sync_fetch_and_or (&c->flags, C_NET_FAILED);
+      return 0;
+    }
+    if (r > 0) {
+      MODULE_STAT->tcp_writev_bytes += r;
+      rwm_skip_data (out, r);
+      if (c->type->data_sent) {
+        c->type->data_sent (C, r);
+      }
+    }
+  }
+
+  if (!out->total_bytes) {
+    __sync_fetch_and_and (&c->flags, ~C_WANTWR);
+  } else if ((c->flags & (C_WANTWR | C_ERROR | C_NET_FAILED)) == C_WANTWR) {
+    int iovcnt = -1;
+    int s = tcp_prepare_iovec (u->iov, &iovcnt, URING_SEND_IOVECS, out);
+    assert (iovcnt > 0 && s > 0);
+    u->msg.msg_iov = u->iov;
+    u->msg.msg_iovlen = iovcnt;
+    u->inflight = s;
+
+    __sync_fetch_and_or (&c->flags, C_URING_SEND | C_NOWR);
+    if (net_uring_submit_sendmsg (C, c->fd, &c->flags, C_ERROR | C_NET_FAILED, &u->msg) < 0) {
+      u->inflight = 0;
+      __sync_fetch_and_and (&c->flags, ~(C_URING_SEND | C_NOWR));
+      return out->total_bytes;
+    }
+  }
+
+  if (check_watermark && out->total_bytes < c->write_low_watermark) {
+    if (c->type->ready_to_write) {
+      c->type->ready_to_write (C);
+    }
+  }
+
+  if (stop && !(c->flags & C_WANTWR)) {
+    vkprintf (1, "Closing write_close socket\n");
+    job_signal (JOB_REF_CREATE_PASS (C), JS_ABORT);
+    __sync_fetch_and_or (&c->flags, C_NET_FAILED);
+  }
+
+  vkprintf (2, "socket_server_uring_writer: written %d bytes to %d, flags=0x%08x\n", r, c->fd, c->flags);
+  return out->total_bytes;
+}
+/* }}} */
+
 /* 
   Get data from out raw message and writes it to socket 
 */
 int net_server_socket_writer (socket_connection_job_t C) /* {{{ */{
   assert_net_net_thread ();
   struct socket_connection_info *c = SOCKET_CONN_INFO (C);
+
+  if (c->flags & C_URING) {
+    return net_server_socket_uring_writer (C);
+  }
   
   struct raw_message *out = &c->out;
 
@@ -1054,8 +1247,21 @@ int net_server_socket_read_write (socket_connection_job_t C) /* {{{ */ {
   
   vkprintf (2, "END processing connection %d, flags=%d\n", c->fd, c->flags);
 
-  while ((c->flags & (C_WANTRD | C_NORD | C_ERROR | C_STOPREAD | C_NET_FAILED)) == C_WANTRD) {
-    c->type->socket_reader (C);
+  if (c->uring_send && !(c->flags & C_URING)) {
+    __sync_fetch_and_or (&c->flags, C_URING);
+  }
+
+  if (c->flags & C_URING) {
+    if ((c->flags & (C_WANTRD | C_URING_RECV | C_ERROR | C_STOPREAD | C_NET_FAILED)) == C_WANTRD) {
+      __sync_fetch_and_or (&c->flags, C_URING_RECV);
+      if (net_uring_submit_recv (C, c->fd, &c->flags, C_ERROR | C_NET_FAILED | C_STOPREAD) < 0) {
+        __sync_fetch_and_and (&c->flags, ~C_URING_RECV);
+      }
+    }
+  } else {
+    while ((c->flags & (C_WANTRD | C_NORD | C_ERROR | C_STOPREAD | C_NET_FAILED)) == C_WANTRD) {
+      c->type->socket_reader (C);
+    }
   }
   
   struct raw_message *out = &c->out;
@@ -1195,6 +1401,11 @@ socket_connection_job_t alloc_new_socket_connection (connection_job_t C) /* {{{
   memcpy (s->remote_ipv6, c->remote_ipv6, 16);
 
   s->out_packet_queue = alloc_mp_queue_w ();
+
+  if (net_uring_enabled && s->type->socket_read_write == net_server_socket_read_write && s->type->socket_reader == net_server_socket_reader && s->type->socket_writer == net_server_socket_writer) {
+    s->uring_send = calloc (1, sizeof (struct uring_send));
+    assert (s->uring_send);
+  }
   
   struct event_descr *ev = Events + s->fd;
   assert (!ev->data);
@@ -1220,21 +1431,102 @@ socket_connection_job_t alloc_new_socket_connection (connection_job_t C) /* {{{
 
 /* {{{ LISTENING CONNECTION */
 
+// sockets accepted per listener wakeup, the listener job is rescheduled if more may be pending
+#define ACCEPT_BATCH		64
+
+struct accepted_socket {
+  int fd;
+  unsigned peer_addrlen;
+  union sockaddr_in46 peer;
+};
+
+static int net_accept_socket (int fd, union sockaddr_in46 *peer, unsigned *peer_addrlen) /* {{{ */ {
+  *peer_addrlen = sizeof (*peer);
+  memset (peer, 0, sizeof (*peer));
+  MODULE_STAT->accept_syscalls ++;
+  int cfd = accept4 (fd, (struct sockaddr *) peer, peer_addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (cfd >= 0) {
+    MODULE_STAT->accepted_sockets ++;
+  }
+  return cfd;
+}
+/* }}} */
+
+static void net_accept_new_connection (listening_connection_job_t LCJ, int cfd, union sockaddr_in46 *peer, unsigned peer_addrlen) /* {{{ */ {
+  struct listening_connection_info *LC = LISTEN_CONN_INFO (LCJ);
+
+  if (max_accept_rate) {
+    cur_accept_rate_remaining += (precise_now - cur_accept_rate_time) * max_accept_rate;
+    cur_accept_rate_time = precise_now;
+    if (cur_accept_rate_remaining > max_accept_rate) {
+      cur_accept_rate_remaining = max_accept_rate;
+    }
+    
+    if (cur_accept_rate_remaining < 1) {
+      MODULE_STAT->accept_rate_limit_failed ++;
+      close (cfd);
+      return;
+    }
+
+    cur_accept_rate_remaining -= 1;
+  }
+   
+  if (LC->flags & C_IPV6) {
+    assert (peer_addrlen == sizeof (struct sockaddr_in6));
+    assert (peer->a6.sin6_family == AF_INET6);
+  } else {
+    assert (peer_addrlen == sizeof (struct sockaddr_in));
+    assert (peer->a4.sin_family == AF_INET);
+  }
+ 
+  connection_job_t C;
+  if (peer->a4.sin_family == AF_INET) {
+    C = alloc_new_connection (cfd, NULL, LCJ, ct_inbound, LC->type, LC->extra,
+      ntohl (peer->a4.sin_addr.s_addr), NULL, ntohs (peer->a4.sin_port));
+  } else {
+    C = alloc_new_connection (cfd, NULL, LCJ, ct_inbound, LC->type, LC->extra,
+      0, peer->a6.sin6_addr.s6_addr, ntohs (peer->a6.sin6_port));
+  }
+  if (C) {
+    assert (CONN_INFO(C)->io_conn);
+    unlock_job (JOB_REF_PASS (C));
+  }
+}
+/* }}} */
+
 /*
-  accepts new connections
+  accepts up to ACCEPT_BATCH new connections
   executes alloc_new_connection ()
+  returns 1 if more connections may be pending
 */
 int net_accept_new_connections (listening_connection_job_t LCJ) /* {{{ */ {
   struct listening_connection_info *LC = LISTEN_CONN_INFO (LCJ);
+  int acc = 0;
+
+  if (LC->accept_queue) {
+    // sockets were already accepted by the acceptor thread of this listener
+    struct accepted_socket *A;
+    while ((A = mpq_pop_nw (LC->accept_queue, 4))) {
+      net_accept_new_connection (LCJ, A->fd, &A->peer, A->peer_addrlen);
+      free (A);
+      if (++acc == ACCEPT_BATCH) {
+        MODULE_STAT->accept_batches_cut ++;
+        return 1;
+      }
+    }
+    return 0;
+  }
 
   union sockaddr_in46 peer;
   unsigned peer_addrlen;
-  int cfd, acc = 0;
+  int cfd;
 
   while (Events[LC->fd].state & EVT_IN_EPOLL) {   
-    peer_addrlen = sizeof (peer);
-    memset (&peer, 0, sizeof (peer));
-    cfd = accept (LC->fd, (struct sockaddr *) &peer, &peer_addrlen);
+    if (acc == ACCEPT_BATCH) {
+      MODULE_STAT->accept_batches_cut ++;
+      return 1;
+    }
+    cfd = net_accept_socket (LC->fd, &peer, &peer_addrlen);
 
     vkprintf (2, "%s: cfd = %d\n", __func__, cfd);
     if (cfd < 0) {
@@ -1242,62 +1534,143 @@ int net_accept_new_connections (listening_connection_job_t LCJ) /* {{{ */ {
         MODULE_STAT->accept_calls_failed ++;
       }
       if (!acc) {
-        vkprintf ((errno == EAGAIN) * 2, "accept(%d) unexpectedly returns %d: %m\n", LC->fd, cfd);
+        vkprintf ((errno == EAGAIN) * 2, "accept4(%d) unexpectedly returns %d: %m\n", LC->fd, cfd);
       }
       break;
     }
     
     acc ++;
     MODULE_STAT->inbound_connections_accepted ++;
-    
-    if (max_accept_rate) {
-      cur_accept_rate_remaining += (precise_now - cur_accept_rate_time) * max_accept_rate;
-      cur_accept_rate_time = precise_now;
-      if (cur_accept_rate_remaining > max_accept_rate) {
-        cur_accept_rate_remaining = max_accept_rate;
+
+    net_accept_new_connection (LCJ, cfd, &peer, peer_addrlen);
+  }
+  return 0;
+}
+/* }}} */
+
+/* {{{ ACCEPTOR THREADS */
+
+/*
+  a listener opened with SM_ACCEPTOR (normally one of several SO_REUSEPORT sockets on the same port)
+  is not inserted into the main epoll: a dedicated JC_ACCEPT thread waits on it, accepts
+  new sockets and passes them to the listening connection job in batches
+*/
+
+#define MAX_LISTEN_ACCEPTORS	64
+
+struct acceptor_info {
+  listening_connection_job_t listener;
+};
+
+static job_t Acceptors[MAX_LISTEN_ACCEPTORS];
+static int acceptors_num, acceptors_started;
+static int listening_stopped;
+
+static int net_acceptor_accept (listening_connection_job_t LCJ) /* {{{ */ {
+  struct listening_connection_info *LC = LISTEN_CONN_INFO (LCJ);
+  int acc = 0;
+
+  while (acc < ACCEPT_BATCH) {
+    struct accepted_socket *A = malloc (sizeof (*A));
+    A->fd = net_accept_socket (LC->fd, &A->peer, &A->peer_addrlen);
+
+    vkprintf (2, "%s: cfd = %d\n", __func__, A->fd);
+    if (A->fd < 0) {
+      int err = errno;
+      free (A);
+      if (err == EAGAIN || err == EINTR) {
+        break;
       }
-      
-      if (cur_accept_rate_remaining < 1) {
-        MODULE_STAT->accept_rate_limit_failed ++;
-        close (cfd);
-        continue;
+      MODULE_STAT->accept_calls_failed ++;
+      vkprintf (1, "accept4(%d) unexpectedly returns -1: %s\n", LC->fd, strerror (err));
+      if (!acc) {
+        // e.g. EMFILE: do not spin on a listener that stays readable
+        usleep (10000);
       }
-
-      cur_accept_rate_remaining -= 1;
-    }
-     
-    if (LC->flags & C_IPV6) {
-      assert (peer_addrlen == sizeof (struct sockaddr_in6));
-      assert (peer.a6.sin6_family == AF_INET6);
-    } else {
-      assert (peer_addrlen == sizeof (struct sockaddr_in));
-      assert (peer.a4.sin_family == AF_INET);
-    }
-   
-    connection_job_t C;
-    if (peer.a4.sin_family == AF_INET) {
-      C = alloc_new_connection (cfd, NULL, LCJ, ct_inbound, LC->type, LC->extra,
-        ntohl (peer.a4.sin_addr.s_addr), NULL, ntohs (peer.a4.sin_port));
-    } else {
-      C = alloc_new_connection (cfd, NULL, LCJ, ct_inbound, LC->type, LC->extra,
-        0, peer.a6.sin6_addr.s6_addr, ntohs (peer.a6.sin6_port));
-    }
-    if (C) {
-      assert (CONN_INFO(C)->io_conn);
-      unlock_job (JOB_REF_PASS (C));
+      break;
     }
+
+    acc ++;
+    MODULE_STAT->inbound_connections_accepted ++;
+    mpq_push_w (LC->accept_queue, A, 0);
   }
-  return 0;
+
+  if (acc) {
+    MODULE_STAT->acceptor_accepted += acc;
+    MODULE_STAT->acceptor_wakeups ++;
+    job_signal (JOB_REF_CREATE_PASS (LCJ), JS_RUN);
+  }
+  return acc;
+}
+/* }}} */
+
+int do_listening_acceptor_job (job_t job, int op, struct job_thread *JT) /* {{{ */ {
+  struct acceptor_info *A = (struct acceptor_info *) job->j_custom;
+  if (op != JS_RUN) {
+    return JOB_ERROR;
+  }
+  listening_connection_job_t LCJ = A->listener;
+  struct listening_connection_info *LC = LISTEN_CONN_INFO (LCJ);
+
+  if (listening_stopped) {
+    // the thread stays idle for good
+    return 0;
+  }
+  if ((LC->flags & C_SPECIAL) && active_special_connections >= max_special_connections) {
+    // main thread would have removed this listener from epoll
+    usleep (10000);
+    return JOB_SENDSIG (JS_RUN);
+  }
+
+  struct pollfd pfd = { .fd = LC->fd, .events = POLLIN };
+  if (poll (&pfd, 1, 1000) > 0 && !listening_stopped) {
+    net_acceptor_accept (LCJ);
+  }
+  // this thread belongs to the listener for good
+  return JOB_SENDSIG (JS_RUN);
 }
 /* }}} */
 
+static void init_listening_acceptor (listening_connection_job_t LCJ) /* {{{ */ {
+  assert (acceptors_num < MAX_LISTEN_ACCEPTORS);
+  assert (!acceptors_started);
+  job_t AJ = create_async_job (do_listening_acceptor_job, JSC_ALLOW (JC_ACCEPT, JS_RUN), -2, sizeof (struct acceptor_info), 0, JOB_REF_NULL);
+  struct acceptor_info *A = (struct acceptor_info *) AJ->j_custom;
+  A->listener = job_incref (LCJ);
+  LISTEN_CONN_INFO(LCJ)->accept_queue = alloc_mp_queue_w ();
+  Acceptors[acceptors_num++] = AJ;
+}
+/* }}} */
+
+/* creates one JC_ACCEPT thread per SM_ACCEPTOR listener; must be invoked after all listeners are initialized */
+int start_listening_acceptors (void) /* {{{ */ {
+  if (!acceptors_num || acceptors_started) {
+    return 0;
+  }
+  assert (create_new_job_class (JC_ACCEPT, acceptors_num, acceptors_num) >= 0);
+  int i;
+  for (i = 0; i < acceptors_num; i++) {
+    schedule_job (JOB_REF_PASS (Acceptors[i]));
+  }
+  acceptors_started = acceptors_num;
+  MODULE_STAT->listening_acceptors += acceptors_num;
+  vkprintf (1, "started %d listening acceptor threads\n", acceptors_num);
+  return acceptors_num;
+}
+/* }}} */
+
+/* }}} */
+
 int do_listening_connection_job (job_t job, int op, struct job_thread *JT) /* {{{ */ {
   listening_connection_job_t LCJ = job;
 
   if (op == JS_RUN) {
-    net_accept_new_connections (LCJ);
-    return 0;
+    // let other jobs run before accepting the rest of a connection storm
+    return net_accept_new_connections (LCJ) > 0 ? JOB_SENDSIG (JS_RUN) : 0;
   } else if (op == JS_AUX) {
+    if (LISTEN_CONN_INFO(LCJ)->accept_queue || listening_stopped) {
+      return 0;
+    }
     vkprintf (2, "**Invoking epoll_insert(%d,%d)\n", LISTEN_CONN_INFO(LCJ)->fd, EVT_RWX);
     epoll_insert (LISTEN_CONN_INFO(LCJ)->fd, EVT_RWX);
     return 0;
@@ -1314,6 +1687,10 @@ int init_listening_connection_ext (int fd, conn_type_t *type, void *extra, int m
     vkprintf (0, "TOO big fd for listening connection %d (max %d)\n", fd, max_connection_fd);
     return -1;
   }
+  if ((mode & SM_ACCEPTOR) && acceptors_num >= MAX_LISTEN_ACCEPTORS) {
+    vkprintf (0, "too many listening acceptors (max %d)\n", MAX_LISTEN_ACCEPTORS);
+    return -1;
+  }
   if (fd > max_connection) {
     max_connection = fd;
   }
@@ -1361,7 +1738,11 @@ int init_listening_connection_ext (int fd, conn_type_t *type, void *extra, int m
   }
 
   epoll_sethandler (fd, prio, net_server_socket_read_write_gateway, LCJ);
-  epoll_insert (fd, EVT_RWX);
+  if (mode & SM_ACCEPTOR) {
+    init_listening_acceptor (LCJ);
+  } else {
+    epoll_insert (fd, EVT_RWX);
+  }
 
   MODULE_STAT->listening_connections ++;
 
@@ -1370,6 +1751,22 @@ int init_listening_connection_ext (int fd, conn_type_t *type, void *extra, int m
   return 0;
 }
 
+/* stops accepting on all listening sockets for good, e.g. after they were passed to another process; the sockets stay open */
+void stop_listening_connections (void) /* {{{ */ {
+  assert_main_thread ();
+  listening_stopped = 1;
+  int fd, stopped = 0;
+  for (fd = 0; fd <= max_connection; fd++) {
+    job_t J = Events[fd].data;
+    if (Events[fd].fd == fd && J && J->j_execute == do_listening_connection_job) {
+      epoll_remove (fd);
+      stopped ++;
+    }
+  }
+  vkprintf (1, "stopped accepting on %d listening sockets\n", stopped);
+}
+/* }}} */
+
 int init_listening_connection (int fd, conn_type_t *type, void *extra) {
   return init_listening_connection_ext (fd, type, extra, 0, -10);
 }
@@ -1605,6 +2002,91 @@ static void count_connection_num (connection_job_t C, void *good_c, void *stoppe
 }
 /* }}} */
 
+/* {{{ ready connections index */
+
+static void incref_conn_ready_index (void *ptr) {
+  struct conn_ready_index *I = ptr;
+  if (I) {
+    assert (__sync_fetch_and_add (&I->refcnt, 1) > 0);
+  }
+}
+
+struct conn_ready_index *get_conn_ready_index_ptr (struct conn_ready_index **P) {
+  return get_ptr_multithread_copy ((void **)P, incref_conn_ready_index);
+}
+
+void conn_ready_index_decref (struct conn_ready_index *I) {
+  if (I && __sync_fetch_and_add (&I->refcnt, -1) == 1) {
+    int i;
+    for (i = 0; i < I->cnt; i++) {
+      job_decref_f (I->conns[i]);
+    }
+    free (I);
+  }
+}
+
+static void free_conn_ready_index_ptr (struct conn_ready_index *I) {
+  if (I && is_hazard_ptr (I, COMMON_HAZARD_PTR_NUM, COMMON_HAZARD_PTR_NUM)) {
+    struct free_later *F = malloc (sizeof (*F));
+    F->ptr = I;
+    F->free = (void *)free_conn_ready_index_ptr;
+    insert_free_later_struct (F);
+  } else {
+    conn_ready_index_decref (I);
+  }
+}
+
+struct ready_index_builder {
+  connection_job_t *A;
+  int cnt, size;
+  int ready_only;
+};
+
+static void add_ready_index_connection (connection_job_t C, void *ex) {
+  struct ready_index_builder *B = ex;
+  struct connection_info *c = CONN_INFO (C);
+  if (B->ready_only && ((c->flags & (C_ERROR | C_FAILED | C_NET_FAILED)) || c->error || c->type->check_ready (C) != cr_ok)) {
+    return;
+  }
+  if (B->cnt == B->size) {
+    B->size = B->size ? 2 * B->size : 16;
+    B->A = realloc (B->A, B->size * sizeof (connection_job_t));
+    assert (B->A);
+  }
+  B->A[B->cnt ++] = C;
+}
+
+int update_conn_ready_index (struct conn_ready_index **P, struct tree_connection *T, int ready_only) {
+  struct ready_index_builder B = { .ready_only = ready_only };
+  tree_act_ex_connection (T, add_ready_index_connection, &B);
+
+  struct conn_ready_index *old = *P;
+  if (old ? old->cnt == B.cnt && !memcmp (old->conns, B.A, B.cnt * sizeof (connection_job_t)) : !B.cnt) {
+    free (B.A);
+    return 0;
+  }
+
+  struct conn_ready_index *I = 0;
+  if (B.cnt) {
+    I = malloc (sizeof (struct conn_ready_index) + B.cnt * sizeof (connection_job_t));
+    assert (I);
+    I->refcnt = 1;
+    I->cnt = B.cnt;
+    int i;
+    for (i = 0; i < B.cnt; i++) {
+      I->conns[i] = job_incref (B.A[i]);
+    }
+  }
+  free (B.A);
+
+  *P = I;
+  barrier ();
+  __sync_synchronize ();
+  free_conn_ready_index_ptr (old);
+  return 1;
+}
+/* }}} */
+
 static void find_bad_connection (connection_job_t C, void *x) /* {{{ */ {
   connection_job_t *T = x;
   if (*T) { return; }
@@ -1665,6 +2147,9 @@ void destroy_dead_target_connections (conn_target_job_t CTJ) /* {{{ */ {
     __sync_synchronize ();
     free_tree_ptr_connection (old);
   }
+
+  // readiness is rechecked on every target timer, so the index lags at most one tick behind
+  update_conn_ready_index (&CT->ready_index, CT->conn_tree, 1);
 }
 /* }}} */
 
@@ -1834,7 +2319,7 @@ static int free_target (conn_target_job_t CTJ) /* {{{ */ {
   }
 
   assert (CT && CT->type && !CT->global_refcnt);
-  assert (!CT->conn_tree);
+  assert (!CT->conn_tree && !CT->ready_index);
   if (CT->target.s_addr) {
     vkprintf (1, "Freeing unused target to %s:%d\n", inet_ntoa (CT->target), CT->port);
     assert (CTJ == find_target (CT->target, CT->port, CT->type, CT->extra, -1, 0));
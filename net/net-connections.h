@@ -42,6 +42,14 @@
 
 #define MAX_TCP_RECV_BUFFERS 128
 #define TCP_RECV_BUFFER_SIZE 1024
+#define TCP_RECV_MEDIUM_BUFFERS 8
+#define TCP_RECV_MEDIUM_BUFFER_SIZE 16384
+#define TCP_RECV_LARGE_BUFFERS 1
+#define TCP_RECV_LARGE_BUFFER_SIZE 262144
+
+/* average readv size (bytes) from which medium and large receive buffers are used */
+#define TCP_RECV_MEDIUM_THRESHOLD 4096
+#define TCP_RECV_LARGE_THRESHOLD 98304
 
 #define MAX_NET_RES	(1L << 16)
 
@@ -84,6 +92,9 @@
 #define C_CONNECTED	0x2000000
 #define C_STOPWRITE	0x4000000
 #define C_IS_TLS	0x8000000
+#define C_URING		0x10000000	/* socket i/o goes through io_uring */
+#define C_URING_RECV	0x20000000	/* io_uring receive request is armed */
+#define C_URING_SEND	0x40000000	/* io_uring sendmsg request is in flight */
 
 #define C_PERMANENT (C_IPV6 | C_RAWMSG)
 /* for connection status */
@@ -179,6 +190,7 @@ struct conn_target_info {
   int max_connections;
 
   struct tree_connection *conn_tree;
+  struct conn_ready_index *ready_index;
   //connection_job_t first_conn, last_conn;
   conn_type_t *type;
   void *extra;
@@ -201,6 +213,7 @@ struct pseudo_conn_target_info {
   int pad2;
 
   void *pad3;
+  void *pad4;
   conn_type_t *type;
   void *extra;
   struct in_addr target;
@@ -252,6 +265,8 @@ struct connection_info {
   int listening, listening_generation;
   int window_clamp;
   int left_tls_packet_length;
+  int tls_burst_bytes;		/* bytes sent in TLS records since the connection was last idle */
+  double tls_last_write_time;
 
   struct raw_message in_u, in, out, out_p;
 
@@ -279,6 +294,8 @@ struct socket_connection_info {
   unsigned char our_ipv6[16], remote_ipv6[16];
   int write_low_watermark;
   int eagain_count;
+  int recv_avg;			/* moving average of bytes returned by readv, selects receive buffer size */
+  struct uring_send *uring_send;	/* allocated only when io_uring backend is used */
 };
 
 struct listening_connection_info {
@@ -291,6 +308,7 @@ struct listening_connection_info {
   event_t *ev;
   void *extra;
   int window_clamp;
+  struct mp_queue *accept_queue;	/* sockets accepted by dedicated acceptor thread (SM_ACCEPTOR) */
 };
 
 struct connections_stat {
@@ -407,6 +425,8 @@ void delete_connection_tree_ptr (struct tree_connection *T);
 int init_listening_connection_ext (int fd, conn_type_t *type, void *extra, int mode, int prio);
 int init_listening_connection (int fd, conn_type_t *type, void *extra);
 int init_listening_tcpv6_connection (int fd, conn_type_t *type, void *extra, int mode);
+int start_listening_acceptors (void);
+void stop_listening_connections (void);
 
 //struct tree_connection *get_connection_tree_ptr (struct tree_connection **);
 //void free_connection_tree_ptr (struct tree_connection *);
@@ -416,6 +436,21 @@ struct free_later {
   void (*free)(void *);
 };
 
+/*
+  immutable array of connections of a target, allows picking random ones in O(1);
+  replaced as a whole by the thread owning conn_tree, readers take it with get_conn_ready_index_ptr
+*/
+struct conn_ready_index {
+  int refcnt;
+  int cnt;
+  connection_job_t conns[0];  // each one holds a reference
+};
+
+struct conn_ready_index *get_conn_ready_index_ptr (struct conn_ready_index **P);
+void conn_ready_index_decref (struct conn_ready_index *I);
+// rebuilds *P from T (keeping only cr_ok connections if ready_only), returns 1 if it was changed
+int update_conn_ready_index (struct conn_ready_index **P, struct tree_connection *T, int ready_only);
+
 
 struct query_info {
   struct event_timer ev;
@@ -60,6 +60,7 @@ MODULE_INIT
 MODULE_STAT_FUNCTION
   SB_SUM_ONE_I (allocated_aes_crypto);
   SB_SUM_ONE_I (allocated_aes_crypto_temp);
+  sb_printf (sb, "aes_implementation\t%s\n", aes256_implementation ());
 
   sb_printf (sb,
     "aes_pwd_hash\t%s\n",
@@ -86,8 +87,8 @@ int aes_crypto_init (connection_job_t c, void *key_data, int key_data_len) {
 
   MODULE_STAT->allocated_aes_crypto ++;
   
-  T->read_aeskey = evp_cipher_ctx_init (EVP_aes_256_cbc(), D->read_key, D->read_iv, 0);
-  T->write_aeskey = evp_cipher_ctx_init (EVP_aes_256_cbc(), D->write_key, D->write_iv, 1);
+  T->read_aeskey = aes256_ctx_init (AES256_CBC_DECRYPT, D->read_key, D->read_iv);
+  T->write_aeskey = aes256_ctx_init (AES256_CBC_ENCRYPT, D->write_key, D->write_iv);
   CONN_INFO(c)->crypto = T;
   return 0;
 }
@@ -101,8 +102,8 @@ int aes_crypto_ctr128_init (connection_job_t c, void *key_data, int key_data_len
 
   MODULE_STAT->allocated_aes_crypto ++;
   
-  T->read_aeskey = evp_cipher_ctx_init (EVP_aes_256_ctr(), D->read_key, D->read_iv, 1); // NB: is_encrypt == 1 here!
-  T->write_aeskey = evp_cipher_ctx_init (EVP_aes_256_ctr(), D->write_key, D->write_iv, 1);
+  T->read_aeskey = aes256_ctx_init (AES256_CTR, D->read_key, D->read_iv);
+  T->write_aeskey = aes256_ctx_init (AES256_CTR, D->write_key, D->write_iv);
   CONN_INFO(c)->crypto = T;
   return 0;
 }
@@ -110,8 +111,8 @@ int aes_crypto_ctr128_init (connection_job_t c, void *key_data, int key_data_len
 int aes_crypto_free (connection_job_t c) {
   struct aes_crypto *crypto = CONN_INFO(c)->crypto;
   if (crypto) {
-    EVP_CIPHER_CTX_free (crypto->read_aeskey);
-    EVP_CIPHER_CTX_free (crypto->write_aeskey);
+    aes256_ctx_free (crypto->read_aeskey);
+    aes256_ctx_free (crypto->write_aeskey);
 
     free (crypto);
     CONN_INFO(c)->crypto = 0;
@@ -70,8 +70,8 @@ struct aes_key_data {
 
 /* for c->crypto */
 struct aes_crypto {
-  EVP_CIPHER_CTX *read_aeskey;
-  EVP_CIPHER_CTX *write_aeskey;
+  struct aes256_ctx *read_aeskey;
+  struct aes256_ctx *write_aeskey;
 };
 
 extern int aes_initialized;
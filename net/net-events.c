@@ -37,6 +37,7 @@
 #include <string.h>
 #include <sys/epoll.h>
 #include <sys/io.h>
+#include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <time.h>
 #include <unistd.h>
@@ -69,6 +70,41 @@ long long event_timer_remove_ops;
 
 int epoll_remove (int fd);
 
+int epoll_busy_poll_us;
+
+// kernel epoll busy poll parameters (linux 6.9+), not yet in libc headers
+struct epoll_busy_poll_params {
+  unsigned busy_poll_usecs;
+  unsigned short busy_poll_budget;
+  unsigned char prefer_busy_poll;
+  unsigned char pad;
+};
+#define EPOLL_IOC_SET_PARAMS _IOW(0x8A, 0x01, struct epoll_busy_poll_params)
+#define EPOLL_BUSY_POLL_BUDGET 8
+
+static void epoll_apply_busy_poll (void) {
+  if (!epoll_busy_poll_us || !epoll_fd) {
+    return;
+  }
+  struct epoll_busy_poll_params params = { .busy_poll_usecs = epoll_busy_poll_us, .busy_poll_budget = EPOLL_BUSY_POLL_BUDGET };
+  if (ioctl (epoll_fd, EPOLL_IOC_SET_PARAMS, &params) < 0) {
+    vkprintf (0, "cannot set epoll busy poll parameters: %m\n");
+  }
+}
+
+void epoll_set_busy_poll (int busy_poll_us) {
+  epoll_busy_poll_us = busy_poll_us;
+  epoll_apply_busy_poll ();
+}
+
+static void socket_set_busy_poll (int fd) {
+  static int warned;
+  if (epoll_busy_poll_us && setsockopt (fd, SOL_SOCKET, SO_BUSY_POLL, &epoll_busy_poll_us, sizeof (epoll_busy_poll_us)) < 0 && !warned) {
+    warned = 1;
+    vkprintf (0, "setsockopt(SO_BUSY_POLL): %m\n");
+  }
+}
+
 int init_epoll (void) {
   int fd;
   if (epoll_fd) {
@@ -82,6 +118,7 @@ int init_epoll (void) {
   }
   epoll_fd = fd;
   assert (fd > 0);
+  epoll_apply_busy_poll ();
   return fd;
 }
 
@@ -360,18 +397,48 @@ int epoll_runqueue (void) {
 
 double last_epoll_wait_at;
 struct epoll_event new_ev_list[MAX_EVENTS];
-int epoll_sleep_ns = 0;
+
+/*
+  adaptive loop: after an iteration that received events epoll is polled without blocking
+  for up to epoll_busy_poll_us, otherwise epoll_wait blocks until the first timer of any job thread,
+  at most EPOLL_MAX_WAIT_MS; job threads arming an earlier timer, jobs queued for the main thread
+  and signals wake it up through the wakeup pipe
+*/
+
+#define EPOLL_MAX_WAIT_MS 1000
+
+volatile double epoll_wakeup_time;
+
+long long epoll_loop_iterations;
+long long epoll_loop_busy_iterations;
+long long epoll_busy_polls;
+long long epoll_busy_poll_hits;
+double epoll_loop_busy_time;
+double epoll_busy_poll_time;
+
+static int epoll_last_events;
+
+void jobs_check_all_timers (void);
+double jobs_get_first_timer (void);
 
 int epoll_fetch_events (int timeout) {
   epoll_calls ++;
   int fd, i;
+  if (timeout > 0) {
+    epoll_wakeup_time = get_utime_monotonic () + timeout * 0.001;
+  }
   main_thread_interrupt_status = 1;
-  struct timespec ts;
-  ts.tv_sec = 0;
-  ts.tv_nsec = epoll_sleep_ns;
-  nanosleep (&ts, NULL);
+  if (timeout > 0) {
+    // timers armed by job threads before they could see the interrupt status
+    __sync_synchronize ();
+    double first_timer = jobs_get_first_timer ();
+    if (first_timer > 0 && first_timer < epoll_wakeup_time) {
+      timeout = first_timer > precise_now ? (int) ((first_timer - precise_now) * 1000) + 1 : 0;
+    }
+  }
   int res = epoll_wait (epoll_fd, new_ev_list, MAX_EVENTS, timeout);
   main_thread_interrupt_status = 0;
+  epoll_wakeup_time = 0;
   if (res < 0 && errno == EINTR) {
     epoll_intr ++;
     res = 0;
@@ -394,7 +461,6 @@ int epoll_fetch_events (int timeout) {
   return res;
 }
 
-void jobs_check_all_timers (void);
 int epoll_work (int timeout) {
   int timeout2 = 10000;
   if (1) {
@@ -408,10 +474,32 @@ int epoll_work (int timeout) {
   if (term_signal_received ()) {
     return 0;
   }
+  jobs_check_all_timers ();
 
   double epoll_wait_start = get_utime_monotonic ();
+  if (last_epoll_wait_at > 0) {
+    epoll_loop_busy_time += epoll_wait_start - last_epoll_wait_at;
+  }
+  epoll_loop_iterations ++;
 
-  epoll_fetch_events (1);
+  int res = 0;
+  if (epoll_last_events > 0 && epoll_busy_poll_us > 0) {
+    double busy_poll_end = epoll_wait_start + epoll_busy_poll_us * 1e-6;
+    epoll_busy_polls ++;
+    while (!(res = epoll_fetch_events (0)) && get_utime_monotonic () < busy_poll_end && !term_signal_received ()) {
+    }
+    if (res > 0) {
+      epoll_busy_poll_hits ++;
+    }
+    epoll_busy_poll_time += get_utime_monotonic () - epoll_wait_start;
+  }
+  if (!res) {
+    res = epoll_fetch_events (timeout2 < EPOLL_MAX_WAIT_MS ? timeout2 : EPOLL_MAX_WAIT_MS);
+  }
+  epoll_last_events = res;
+  if (res > 0) {
+    epoll_loop_busy_iterations ++;
+  }
 
   last_epoll_wait_at = get_utime_monotonic ();
   double epoll_wait_time = last_epoll_wait_at - epoll_wait_start;
@@ -463,6 +551,9 @@ int new_socket (int mode, int nonblock) {
     }
   }
 
+  // inherited by accepted sockets
+  socket_set_busy_poll (socket_fd);
+
   if (!nonblock) {
     return socket_fd;
   }
@@ -594,6 +685,14 @@ int server_socket (int port, struct in_addr in_addr, int backlog, int mode) {
     setsockopt (socket_fd, SOL_SOCKET, SO_REUSEADDR, &flags, sizeof (flags));
   }
 
+  if (mode & SM_REUSEPORT) {
+    if (setsockopt (socket_fd, SOL_SOCKET, SO_REUSEPORT, &flags, sizeof (flags)) < 0) {
+      perror ("setsockopt(SO_REUSEPORT)");
+      close (socket_fd);
+      return -1;
+    }
+  }
+
   if (!(mode & SM_IPV6)) {
     struct sockaddr_in addr;
     memset (&addr, 0, sizeof (addr));
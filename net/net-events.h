@@ -114,9 +114,11 @@ extern struct in_addr settings_addr;
 #define	SM_IPV6_ONLY	4
 #define	SM_LOWPRIO	8
 #define SM_REUSE 16
+#define SM_REUSEPORT 32
 #define	SM_SPECIAL	0x10000
 #define	SM_NOQACK	0x20000
 #define	SM_RAWMSG	0x40000
+#define	SM_ACCEPTOR	0x80000
 
 int server_socket (int port, struct in_addr in_addr, int backlog, int mode);
 int client_socket (in_addr_t in_addr, int port, int mode);
@@ -142,4 +144,10 @@ const char *show_ip (unsigned ip);
 const char *conv_addr6 (const unsigned char a[16], char *buf);
 const char *show_ipv6 (const unsigned char ipv6[16]);
 
-extern int epoll_sleep_ns;
+// microseconds epoll is polled without blocking after an iteration that received events, 0 disables
+extern int epoll_busy_poll_us;
+// also enables kernel busy polling of epoll and sockets
+void epoll_set_busy_poll (int busy_poll_us);
+
+// time the main thread blocked in epoll_wait is going to wake up at, 0 if it is not blocked
+extern volatile double epoll_wakeup_time;
@@ -0,0 +1,339 @@
+/*
+    This file is part of Mtproto-proxy Library.
+
+    Mtproto-proxy Library is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    Mtproto-proxy Library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with Mtproto-proxy Library.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "net/net-handoff.h"
+#include "net/net-events.h"
+#include "common/kprintf.h"
+
+/*
+  protocol: the old process sends struct handoff_header with the listening sockets attached,
+  followed by state_len bytes of state; the new process answers with HANDOFF_READY
+  once it accepts on the sockets, or just closes the connection if it fails to start
+*/
+
+#define	HANDOFF_MAGIC	0x46464f48
+#define	HANDOFF_READY	'R'
+#define	HANDOFF_IO_TIMEOUT	5
+
+struct handoff_header {
+  int magic;
+  int fds_num;
+  int state_len;
+};
+
+int handoff_sockets_received, handoff_sockets_passed;
+
+/* new process side */
+static int received_fds[HANDOFF_MAX_FDS];
+static int received_fds_num;
+static int handoff_conn_fd = -1;
+
+/* old process side */
+static int handoff_listen_fd = -1;
+static int handoff_client_fd = -1;
+static struct handoff_functions *handoff_F;
+
+static int handoff_set_path (struct sockaddr_un *addr, const char *path) {
+  memset (addr, 0, sizeof (*addr));
+  addr->sun_family = AF_UNIX;
+  if (strlen (path) >= sizeof (addr->sun_path)) {
+    kprintf ("handoff socket path %s is too long\n", path);
+    return -1;
+  }
+  strcpy (addr->sun_path, path);
+  return 0;
+}
+
+static void handoff_set_timeout (int fd) {
+  struct timeval tv = { .tv_sec = HANDOFF_IO_TIMEOUT };
+  setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+  setsockopt (fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof (tv));
+}
+
+/* {{{ new process */
+
+static void handoff_close_received (void) {
+  int i;
+  for (i = 0; i < received_fds_num; i++) {
+    if (received_fds[i] >= 0) {
+      close (received_fds[i]);
+      received_fds[i] = -1;
+    }
+  }
+}
+
+int handoff_receive (const char *path, char **state, int *state_len) {
+  *state = NULL;
+  *state_len = 0;
+
+  struct sockaddr_un addr;
+  if (handoff_set_path (&addr, path) < 0) {
+    return -1;
+  }
+  int fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  assert (fd >= 0);
+  if (connect (fd, (struct sockaddr *) &addr, sizeof (addr)) < 0) {
+    vkprintf (1, "no process to take over from at %s: %m\n", path);
+    close (fd);
+    return -1;
+  }
+  handoff_set_timeout (fd);
+
+  struct handoff_header H;
+  union {
+    char buf[CMSG_SPACE (HANDOFF_MAX_FDS * sizeof (int))];
+    struct cmsghdr align;
+  } control;
+  struct iovec iov = { .iov_base = &H, .iov_len = sizeof (H) };
+  struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf, .msg_controllen = sizeof (control.buf) };
+  int r = recvmsg (fd, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+
+  // take the sockets first, so that they are closed on any error
+  received_fds_num = 0;
+  struct cmsghdr *cmsg;
+  for (cmsg = r > 0 ? CMSG_FIRSTHDR (&msg) : NULL; cmsg; cmsg = CMSG_NXTHDR (&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      int n = (cmsg->cmsg_len - CMSG_LEN (0)) / sizeof (int);
+      assert (received_fds_num + n <= HANDOFF_MAX_FDS);
+      memcpy (received_fds + received_fds_num, CMSG_DATA (cmsg), n * sizeof (int));
+      received_fds_num += n;
+    }
+  }
+
+  if (r != sizeof (H) || H.magic != HANDOFF_MAGIC || H.fds_num != received_fds_num || (msg.msg_flags & MSG_CTRUNC) || H.state_len < 0 || H.state_len > HANDOFF_MAX_STATE) {
+    kprintf ("bad handoff message from %s (%d bytes received)\n", path, r);
+    handoff_close_received ();
+    received_fds_num = 0;
+    close (fd);
+    return -1;
+  }
+
+  if (H.state_len) {
+    *state = malloc (H.state_len + 1);
+    assert (*state);
+    r = recv (fd, *state, H.state_len, MSG_WAITALL);
+    if (r != H.state_len) {
+      kprintf ("cannot receive %d bytes of handoff state from %s: %d received\n", H.state_len, path, r);
+      free (*state);
+      *state = NULL;
+      handoff_close_received ();
+      received_fds_num = 0;
+      close (fd);
+      return -1;
+    }
+    (*state)[H.state_len] = 0;
+    *state_len = H.state_len;
+  }
+
+  handoff_conn_fd = fd;
+  handoff_sockets_received = received_fds_num;
+  vkprintf (0, "taking over %d listening sockets and %d bytes of state from %s\n", received_fds_num, H.state_len, path);
+  return received_fds_num;
+}
+
+int handoff_take_listener (int port, int ipv6) {
+  int i;
+  for (i = 0; i < received_fds_num; i++) {
+    int fd = received_fds[i];
+    if (fd < 0) {
+      continue;
+    }
+    union {
+      struct sockaddr_in a4;
+      struct sockaddr_in6 a6;
+    } addr;
+    socklen_t addr_len = sizeof (addr);
+    int listening = 0;
+    socklen_t listening_len = sizeof (listening);
+    if (getsockname (fd, (struct sockaddr *) &addr, &addr_len) < 0 || getsockopt (fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &listening_len) < 0 || !listening) {
+      continue;
+    }
+    if (ipv6 ? (addr.a6.sin6_family == AF_INET6 && ntohs (addr.a6.sin6_port) == port) : (addr.a4.sin_family == AF_INET && ntohs (addr.a4.sin_port) == port)) {
+      received_fds[i] = -1;
+      return fd;
+    }
+  }
+  return -1;
+}
+
+void handoff_ready (void) {
+  int i, unused = 0;
+  for (i = 0; i < received_fds_num; i++) {
+    unused += received_fds[i] >= 0;
+  }
+  if (unused) {
+    vkprintf (0, "closing %d received listening sockets not used by this configuration\n", unused);
+    handoff_close_received ();
+  }
+  if (handoff_conn_fd >= 0) {
+    char c = HANDOFF_READY;
+    if (write (handoff_conn_fd, &c, 1) != 1) {
+      kprintf ("cannot confirm takeover of listening sockets: %m\n");
+    }
+    close (handoff_conn_fd);
+    handoff_conn_fd = -1;
+  }
+}
+
+/* }}} */
+
+/* {{{ old process */
+
+int handoff_listen (const char *path) {
+  struct sockaddr_un addr;
+  if (handoff_set_path (&addr, path) < 0) {
+    return -1;
+  }
+  int fd = socket (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  assert (fd >= 0);
+  // socket of the process taken over from, or a stale one
+  unlink (path);
+  if (bind (fd, (struct sockaddr *) &addr, sizeof (addr)) < 0 || listen (fd, 4) < 0) {
+    kprintf ("cannot listen on handoff socket %s: %m\n", path);
+    close (fd);
+    return -1;
+  }
+  if (fd >= MAX_EVENTS) {
+    close (fd);
+    return -1;
+  }
+  handoff_listen_fd = fd;
+  return 0;
+}
+
+void handoff_close_listener (void) {
+  if (handoff_listen_fd >= 0) {
+    close (handoff_listen_fd);
+    handoff_listen_fd = -1;
+  }
+}
+
+static int handoff_client_event (int fd, void *data, event_t *ev) {
+  assert (fd == handoff_client_fd);
+  char c = 0;
+  int r = read (fd, &c, 1);
+  if (r < 0 && (errno == EAGAIN || errno == EINTR)) {
+    return EVA_CONTINUE;
+  }
+  epoll_close (fd);
+  close (fd);
+  handoff_client_fd = -1;
+
+  if (r != 1 || c != HANDOFF_READY) {
+    kprintf ("new process did not take over the listening sockets, continuing to accept\n");
+    return EVA_CONTINUE;
+  }
+  kprintf ("new process accepts on %d passed listening sockets\n", handoff_sockets_passed);
+  // only one takeover per process
+  epoll_close (handoff_listen_fd);
+  close (handoff_listen_fd);
+  handoff_listen_fd = -1;
+  handoff_F->on_complete ();
+  return EVA_CONTINUE;
+}
+
+static int handoff_send (int fd, int *fds, int fds_num, char *state, int state_len) {
+  struct handoff_header H = { .magic = HANDOFF_MAGIC, .fds_num = fds_num, .state_len = state_len };
+  union {
+    char buf[CMSG_SPACE (HANDOFF_MAX_FDS * sizeof (int))];
+    struct cmsghdr align;
+  } control;
+  memset (&control, 0, sizeof (control));
+  struct iovec iov = { .iov_base = &H, .iov_len = sizeof (H) };
+  struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+  if (fds_num) {
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE (fds_num * sizeof (int));
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR (&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN (fds_num * sizeof (int));
+    memcpy (CMSG_DATA (cmsg), fds, fds_num * sizeof (int));
+  }
+  if (sendmsg (fd, &msg, MSG_NOSIGNAL) != sizeof (H)) {
+    return -1;
+  }
+  int sent = 0;
+  while (sent < state_len) {
+    int r = send (fd, state + sent, state_len - sent, MSG_NOSIGNAL);
+    if (r <= 0) {
+      return -1;
+    }
+    sent += r;
+  }
+  return 0;
+}
+
+static int handoff_accept_event (int fd, void *data, event_t *ev) {
+  // blocking with a timeout: the new process reads everything at once
+  int cfd = accept4 (fd, NULL, NULL, SOCK_CLOEXEC);
+  if (cfd < 0) {
+    return EVA_CONTINUE;
+  }
+  if (handoff_client_fd >= 0 || cfd >= MAX_EVENTS) {
+    vkprintf (0, "handoff request rejected: another one is in progress\n");
+    close (cfd);
+    return EVA_CONTINUE;
+  }
+  handoff_set_timeout (cfd);
+
+  int fds[HANDOFF_MAX_FDS];
+  int fds_num = handoff_F->get_listeners (fds, HANDOFF_MAX_FDS);
+  char *state = malloc (HANDOFF_MAX_STATE);
+  assert (state);
+  int state_len = handoff_F->get_state ? handoff_F->get_state (state, HANDOFF_MAX_STATE) : 0;
+  if (state_len < 0) {
+    kprintf ("handoff state does not fit into %d bytes, passing listening sockets only\n", HANDOFF_MAX_STATE);
+    state_len = 0;
+  }
+  int res = handoff_send (cfd, fds, fds_num, state, state_len);
+  free (state);
+  if (res < 0) {
+    kprintf ("cannot pass listening sockets to a new process: %m\n");
+    close (cfd);
+    return EVA_CONTINUE;
+  }
+
+  fcntl (cfd, F_SETFL, O_NONBLOCK);
+  handoff_client_fd = cfd;
+  handoff_sockets_passed = fds_num;
+  vkprintf (0, "passed %d listening sockets and %d bytes of state to a new process\n", fds_num, state_len);
+  epoll_sethandler (cfd, 0, handoff_client_event, NULL);
+  epoll_insert (cfd, EVT_READ | EVT_LEVEL);
+  return EVA_CONTINUE;
+}
+
+void handoff_start (struct handoff_functions *F) {
+  if (handoff_listen_fd < 0) {
+    return;
+  }
+  handoff_F = F;
+  epoll_sethandler (handoff_listen_fd, 0, handoff_accept_event, NULL);
+  epoll_insert (handoff_listen_fd, EVT_READ | EVT_LEVEL);
+}
+
+/* }}} */
@@ -0,0 +1,52 @@
+/*
+    This file is part of Mtproto-proxy Library.
+
+    Mtproto-proxy Library is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    Mtproto-proxy Library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with Mtproto-proxy Library.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+/*
+  graceful upgrade: a running process serves a unix socket; a new process started with the same path
+  connects to it, receives the listening sockets (SCM_RIGHTS) and an opaque state snapshot,
+  and confirms when it accepts on them, after which the old process stops accepting
+*/
+
+#define	HANDOFF_MAX_FDS		128
+#define	HANDOFF_MAX_STATE	(1 << 20)
+
+struct handoff_functions {
+  int (*get_listeners) (int *fds, int max_fds);	/* listening sockets to pass, returns their number */
+  int (*get_state) (char *buf, int size);	/* state snapshot, returns its length or -1 if it does not fit */
+  void (*on_complete) (void);	/* the new process accepts on the passed sockets now */
+};
+
+/* new process side, before listening sockets are opened */
+
+/* returns the number of received sockets, -1 if there is no process to take over from; *state is malloc'ed */
+int handoff_receive (const char *path, char **state, int *state_len);
+/* returns a received listening socket bound to this port, -1 if none */
+int handoff_take_listener (int port, int ipv6);
+/* closes received sockets nobody took and confirms the takeover to the old process */
+void handoff_ready (void);
+
+/* old process side */
+
+/* replaces the unix socket at path with own one, must be called after all listening sockets are opened */
+int handoff_listen (const char *path);
+/* serves handoff requests from the main event loop */
+void handoff_start (struct handoff_functions *F);
+/* closes the unix socket, e.g. in forked workers */
+void handoff_close_listener (void);
+
+extern int handoff_sockets_received, handoff_sockets_passed;
@@ -25,6 +25,7 @@
 #define        _FILE_OFFSET_BITS        64
 
 #include <assert.h>
+#include <sched.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -46,6 +47,9 @@ MODULE_STAT_TYPE {
   int total_used_buffers;
   long long allocated_buffer_bytes;
   long long buffer_chunk_alloc_ops;
+  int magazine_buffers;
+  long long magazine_refills;
+  long long magazine_flushes;
 };
 
 MODULE_INIT
@@ -55,6 +59,9 @@ MODULE_STAT_FUNCTION
   SB_SUM_ONE_I (total_used_buffers);
   SB_SUM_ONE_LL (allocated_buffer_bytes);
   SB_SUM_ONE_LL (buffer_chunk_alloc_ops);
+  SB_SUM_ONE_I (magazine_buffers);
+  SB_SUM_ONE_LL (magazine_refills);
+  SB_SUM_ONE_LL (magazine_flushes);
   sb_printf (sb,
     "allocated_buffer_chunks\t%d\n"
     "max_allocated_buffer_chunks\t%d\n"
@@ -86,6 +93,22 @@ __thread struct msg_buffers_chunk *ChunkSave[MAX_BUFFER_SIZE_VALUES];
 int default_buffer_sizes[] = { 48, 512, 2048, 16384, 262144 };
 int default_buffer_sizes_cnt = sizeof (default_buffer_sizes) / 4;
 
+/*
+  per-thread magazines of free buffers, one for each buffer size
+  allocation and free touch only the magazine of the current thread;
+  chunks are locked only to refill an empty magazine or to return half of a full one
+*/
+#define MSG_MAGAZINE_MAX_SIZE 64
+#define MSG_MAGAZINE_BYTES (1 << 19)
+
+struct msg_buffer_magazine {
+  int cnt;
+  struct msg_buffer *B[MSG_MAGAZINE_MAX_SIZE];
+};
+
+static int magazine_size[MAX_BUFFER_SIZE_VALUES];
+static __thread struct msg_buffer_magazine Magazines[MAX_BUFFER_SIZE_VALUES];
+
 int free_std_msg_buffer (struct msg_buffers_chunk *C, struct msg_buffer *X);
 
 void init_buffer_chunk_headers (void) {
@@ -98,6 +121,8 @@ void init_buffer_chunk_headers (void) {
     CH->ch_next = CH->ch_prev = CH;
     CH->free_buffer = 0;
     assert (!i || default_buffer_sizes[i] > default_buffer_sizes[i-1]);
+    int m = MSG_MAGAZINE_BYTES / default_buffer_sizes[i];
+    magazine_size[i] = m < 2 ? 2 : m > MSG_MAGAZINE_MAX_SIZE ? MSG_MAGAZINE_MAX_SIZE : m;
   }
   assert (i);
   buffer_size_values = i;
@@ -118,11 +143,14 @@ static inline void prepare_bs_inv (struct msg_buffers_chunk *C) {
 }
 
 static void lock_chunk_head (struct msg_buffers_chunk *CH) {
-  while (1) {
-    if (__sync_bool_compare_and_swap (&CH->magic, MSG_CHUNK_HEAD_MAGIC, MSG_CHUNK_HEAD_LOCKED_MAGIC)) {
-      break;
+  int spins = 0;
+  while (!__sync_bool_compare_and_swap (&CH->magic, MSG_CHUNK_HEAD_MAGIC, MSG_CHUNK_HEAD_LOCKED_MAGIC)) {
+    // held only for a list walk, so spin and give up the cpu instead of sleeping
+    if (++spins >= 64) {
+      sched_yield ();
+      spins = 0;
     }
-    usleep (1000);
+    barrier ();
   }
 }
 
@@ -341,68 +369,10 @@ static inline int get_buffer_no (struct msg_buffers_chunk *C, struct msg_buffer
   return x;
 }
 
-struct msg_buffer *alloc_msg_buffer_internal (struct msg_buffer *neighbor, struct msg_buffers_chunk *CH, struct msg_buffers_chunk *C_hint, int si) {
-  unsigned magic = CH->magic;
-  assert (magic == MSG_CHUNK_HEAD_MAGIC || magic == MSG_CHUNK_HEAD_LOCKED_MAGIC);
-  struct msg_buffers_chunk *C;
-  if (!C_hint) {
-    C = alloc_new_msg_buffers_chunk (CH);
-    if (!C) {
-      return 0;
-    }
-  } else {
-    int found = 0;
-    if (C_hint && C_hint->free_cnt[1] && try_lock_chunk (C_hint)) {
-      assert (C_hint->ch_head == CH);
-      C = C_hint;
-      if (C_hint->free_cnt[1]) {
-        found = 1;
-      } else {
-        unlock_chunk (C_hint);
-      }
-    }
-    if (!found) {
-      lock_chunk_head (CH);
-      struct msg_buffers_chunk *CF = C_hint ? C_hint : CH->ch_next;
-      C = CF;
-      do {
-        if (C == CH) {
-          C = C->ch_next;
-          continue;
-        }
-        if (!C->free_cnt[1]) {
-          C = C->ch_next;
-          continue;
-        }
-        if (!try_lock_chunk (C)) {
-          C = C->ch_next;
-          continue;
-        }
-        if (!C->free_cnt[1]) {
-          unlock_chunk (C);
-          C = C->ch_next;
-          continue;
-        }
-        found = 1;
-        break;
-      } while (C != CF);
-      unlock_chunk_head (CH);
-      if (!found) {
-        C = alloc_new_msg_buffers_chunk (CH);
-        if (!C) {
-          return 0;
-        }
-      }
-      if (C_hint) {
-        __sync_fetch_and_add (&C_hint->refcnt, -1);
-      }
-    }
-  }
-    
-  assert (C != CH);
+/* takes one free buffer from locked chunk C, next to neighbor if possible */
+static struct msg_buffer *take_chunk_buffer (struct msg_buffers_chunk *C, struct msg_buffer *neighbor) {
   assert (C->free_cnt[1]);
   assert (C->magic == MSG_CHUNK_USED_LOCKED_MAGIC);
-  ChunkSave[si] = C;
 
   int two_power = C->two_power, i = 1;
 
@@ -466,12 +436,8 @@ struct msg_buffer *alloc_msg_buffer_internal (struct msg_buffer *neighbor, struc
     assert (-- C->free_cnt[i] == 0);
   }
 
-  assert (C != CH);
-  unlock_chunk (C);
-  //-- CH->free_buffers;
-
   i -= two_power;
-  vkprintf (3, "alloc_msg_buffer(%d) [chunk %p, size %d]: tot_buffers = %d, free_buffers = %d\n", i, C, C->buffer_size, CH->tot_buffers, CH->free_buffers);
+  vkprintf (3, "alloc_msg_buffer(%d) [chunk %p, size %d]: tot_buffers = %d, free_buffers = %d\n", i, C, C->buffer_size, C->tot_buffers, C->free_cnt[1]);
   assert (i >= 0 && i < C->tot_buffers);
 
   struct msg_buffer *X = (struct msg_buffer *) ((char *) C->first_buffer + i * (C->buffer_size + 16));
@@ -479,14 +445,84 @@ struct msg_buffer *alloc_msg_buffer_internal (struct msg_buffer *neighbor, struc
   X->chunk = C;
   X->refcnt = 1;
   X->magic = MSG_BUFFER_USED_MAGIC;
-
-  //__sync_fetch_and_add (&total_used_buffers, 1);
-  MODULE_STAT->total_used_buffers_size += C->buffer_size;
-  MODULE_STAT->total_used_buffers ++;
-  
   return X;
 }
 
+/* takes up to count buffers from one chunk under a single lock, returns number of taken buffers */
+static int alloc_msg_buffers_internal (struct msg_buffer *neighbor, struct msg_buffers_chunk *CH, struct msg_buffers_chunk *C_hint, int si, struct msg_buffer **out, int count) {
+  unsigned magic = CH->magic;
+  assert (magic == MSG_CHUNK_HEAD_MAGIC || magic == MSG_CHUNK_HEAD_LOCKED_MAGIC);
+  struct msg_buffers_chunk *C;
+  if (!C_hint) {
+    C = alloc_new_msg_buffers_chunk (CH);
+    if (!C) {
+      return 0;
+    }
+  } else {
+    int found = 0;
+    if (C_hint && C_hint->free_cnt[1] && try_lock_chunk (C_hint)) {
+      assert (C_hint->ch_head == CH);
+      C = C_hint;
+      if (C_hint->free_cnt[1]) {
+        found = 1;
+      } else {
+        unlock_chunk (C_hint);
+      }
+    }
+    if (!found) {
+      lock_chunk_head (CH);
+      struct msg_buffers_chunk *CF = C_hint ? C_hint : CH->ch_next;
+      C = CF;
+      do {
+        if (C == CH) {
+          C = C->ch_next;
+          continue;
+        }
+        if (!C->free_cnt[1]) {
+          C = C->ch_next;
+          continue;
+        }
+        if (!try_lock_chunk (C)) {
+          C = C->ch_next;
+          continue;
+        }
+        if (!C->free_cnt[1]) {
+          unlock_chunk (C);
+          C = C->ch_next;
+          continue;
+        }
+        found = 1;
+        break;
+      } while (C != CF);
+      unlock_chunk_head (CH);
+      if (!found) {
+        C = alloc_new_msg_buffers_chunk (CH);
+        if (!C) {
+          return 0;
+        }
+      }
+      if (C_hint) {
+        __sync_fetch_and_add (&C_hint->refcnt, -1);
+      }
+    }
+  }
+    
+  assert (C != CH);
+  assert (C->free_cnt[1]);
+  assert (C->magic == MSG_CHUNK_USED_LOCKED_MAGIC);
+  ChunkSave[si] = C;
+
+  int n = 0;
+  while (n < count && C->free_cnt[1]) {
+    out[n] = take_chunk_buffer (C, n ? out[n - 1] : neighbor);
+    n++;
+  }
+
+  assert (C != CH);
+  unlock_chunk (C);
+  return n;
+}
+
 /* allocates buffer of at least given size, -1 = maximal */
 struct msg_buffer *alloc_msg_buffer (struct msg_buffer *neighbor, int size_hint) {
   if (!buffer_size_values) {
@@ -498,11 +534,40 @@ struct msg_buffer *alloc_msg_buffer (struct msg_buffer *neighbor, int size_hint)
       si--;
     }
   }
-  return alloc_msg_buffer_internal (neighbor, &ChunkHeaders[si], ChunkSave[si], si);
+  struct msg_buffer_magazine *M = &Magazines[si];
+  struct msg_buffer *X;
+  if (M->cnt) {
+    X = M->B[-- M->cnt];
+    assert (X->magic == MSG_BUFFER_FREE_MAGIC && !X->refcnt);
+    X->refcnt = 1;
+    X->magic = MSG_BUFFER_USED_MAGIC;
+    MODULE_STAT->magazine_buffers --;
+  } else {
+    struct msg_buffer *out[MSG_MAGAZINE_MAX_SIZE];
+    int n = alloc_msg_buffers_internal (neighbor, &ChunkHeaders[si], ChunkSave[si], si, out, magazine_size[si] / 2);
+    if (!n) {
+      return 0;
+    }
+    MODULE_STAT->magazine_refills ++;
+    X = out[0];
+    // pushed in reverse order, so that adjacent buffers are popped one after another
+    while (n > 1) {
+      struct msg_buffer *Y = out[-- n];
+      Y->refcnt = 0;
+      Y->magic = MSG_BUFFER_FREE_MAGIC;
+      M->B[M->cnt ++] = Y;
+      MODULE_STAT->magazine_buffers ++;
+    }
+  }
+
+  MODULE_STAT->total_used_buffers_size += X->chunk->buffer_size;
+  MODULE_STAT->total_used_buffers ++;
+  return X;
 }
 
+/* returns buffer from a magazine to the free tree of locked chunk C */
 int free_std_msg_buffer (struct msg_buffers_chunk *C, struct msg_buffer *X) {
-  assert (!X->refcnt && X->magic == MSG_BUFFER_USED_MAGIC && C->magic == MSG_CHUNK_USED_LOCKED_MAGIC && X->chunk == C);
+  assert (!X->refcnt && X->magic == MSG_BUFFER_FREE_MAGIC && C->magic == MSG_CHUNK_USED_LOCKED_MAGIC && X->chunk == C);
   int x = get_buffer_no (C, X);
   int two_power = C->two_power;
   vkprintf (3, "free_msg_buffer(%d)\n", x);
@@ -512,12 +577,8 @@ int free_std_msg_buffer (struct msg_buffers_chunk *C, struct msg_buffer *X) {
     assert (++C->free_cnt[x] > 0);
   } while (x >>= 1);
 
-  X->magic = MSG_BUFFER_FREE_MAGIC;
   X->refcnt = -0x40000000;
   //++ C->ch_head->free_buffers;
-  
-  MODULE_STAT->total_used_buffers --;
-  MODULE_STAT->total_used_buffers_size -= C->buffer_size;
 
   //if (C->free_cnt[1] == C->tot_buffers && C->ch_head->free_buffers * 4 >= C->tot_buffers * 5) {
   //  free_msg_buffers_chunk (C);
@@ -544,6 +605,38 @@ static int free_msg_buffer_job (job_t job, int op, struct job_thread *JT) {
   }
 }
 
+/* returns cnt oldest buffers of the magazine to their chunks, or to free queues of chunks locked by other threads */
+static void flush_magazine (struct msg_buffer_magazine *M, int cnt) {
+  assert (cnt <= M->cnt);
+  struct msg_buffers_chunk *L = 0;
+  int i;
+  for (i = 0; i < cnt; i++) {
+    struct msg_buffer *X = M->B[i];
+    struct msg_buffers_chunk *C = X->chunk;
+    if (C != L) {
+      if (L) {
+        unlock_chunk (L);
+      }
+      L = try_lock_chunk (C) ? C : 0;
+    }
+    if (L) {
+      C->free_buffer (C, X);
+    } else {
+      mpq_push_w (C->free_block_queue, X, 0);
+      if (try_lock_chunk (C)) {
+        L = C;
+      }
+    }
+  }
+  if (L) {
+    unlock_chunk (L);
+  }
+  memmove (M->B, M->B + cnt, (M->cnt - cnt) * sizeof (struct msg_buffer *));
+  M->cnt -= cnt;
+  MODULE_STAT->magazine_buffers -= cnt;
+  MODULE_STAT->magazine_flushes ++;
+}
+
 int free_msg_buffer (struct msg_buffer *X) {
   if (X->magic != MSG_BUFFER_USED_MAGIC) {
     vkprintf (0, "magic = 0x%08x\n", X->magic);
@@ -555,18 +648,19 @@ int free_msg_buffer (struct msg_buffer *X) {
   assert (magic == MSG_CHUNK_USED_MAGIC || magic == MSG_CHUNK_USED_LOCKED_MAGIC);
   
   if (C->free_buffer == free_std_msg_buffer) {
-    if (try_lock_chunk (C)) {
-      C->free_buffer (C, X);
-      unlock_chunk (C);
-      return 1;
-    } else {
-      mpq_push_w (C->free_block_queue, X, 0);
-
-      if (try_lock_chunk (C)) {
-        unlock_chunk (C);
-      }
-      return 1;
+    MODULE_STAT->total_used_buffers --;
+    MODULE_STAT->total_used_buffers_size -= C->buffer_size;
+
+    int si = C->ch_head - ChunkHeaders;
+    assert (si >= 0 && si < buffer_size_values);
+    struct msg_buffer_magazine *M = &Magazines[si];
+    if (M->cnt == magazine_size[si]) {
+      flush_magazine (M, M->cnt / 2);
     }
+    X->magic = MSG_BUFFER_FREE_MAGIC;
+    M->B[M->cnt ++] = X;
+    MODULE_STAT->magazine_buffers ++;
+    return 1;
   } else {
     if (!this_job_thread || this_job_thread->thread_class == C->thread_class) {
       return C->free_buffer (C, X);
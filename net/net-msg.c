@@ -44,6 +44,7 @@
 
 #include "jobs/jobs.h"
 #include "common/common-stats.h"
+#include "common/mp-queue.h"
 #include "common/server-functions.h"
 
 struct raw_message empty_rwm = {
@@ -60,6 +61,12 @@ struct raw_message empty_rwm = {
 MODULE_STAT_TYPE {
   int rwm_total_msgs;
   int rwm_total_msg_parts;
+  long long rwm_crypt_in_place_bytes;
+  long long rwm_crypt_copied_bytes;
+  int rwm_cached_msg_parts;
+  long long rwm_msg_part_slabs;
+  long long rwm_msg_part_pool_gets;
+  long long rwm_msg_part_pool_puts;
 };
 
 MODULE_INIT
@@ -67,11 +74,94 @@ MODULE_INIT
 MODULE_STAT_FUNCTION
   SB_SUM_ONE_I (rwm_total_msgs);
   SB_SUM_ONE_I (rwm_total_msg_parts);
+  SB_SUM_ONE_LL (rwm_crypt_in_place_bytes);
+  SB_SUM_ONE_LL (rwm_crypt_copied_bytes);
+  SB_SUM_ONE_I (rwm_cached_msg_parts);
+  SB_SUM_ONE_LL (rwm_msg_part_slabs);
+  SB_SUM_ONE_LL (rwm_msg_part_pool_gets);
+  SB_SUM_ONE_LL (rwm_msg_part_pool_puts);
 MODULE_STAT_FUNCTION_END
 
+/* {{{ msg_part allocator
+  msg_parts are carved from never freed slabs and cached in per-thread free lists;
+  parts freed by another thread stay in its list, surplus moves between threads
+  through a global pool of batches linked by next
+*/
+#define MSG_PART_BATCH 64
+#define MSG_PART_SLAB 512
+
+static struct mp_queue *msg_part_pool;
+static __thread struct msg_part *msg_part_cache;
+static __thread int msg_part_cache_cnt;
+
+static struct mp_queue *get_msg_part_pool (void) {
+  if (!msg_part_pool) {
+    struct mp_queue *MQ = alloc_mp_queue_w ();
+    if (!__sync_bool_compare_and_swap (&msg_part_pool, NULL, MQ)) {
+      free_mp_queue (MQ);
+    }
+  }
+  return msg_part_pool;
+}
+
+static void refill_msg_part_cache (void) {
+  struct msg_part *mp = mpq_pop_nw (get_msg_part_pool (), 4);
+  if (mp) {
+    MODULE_STAT->rwm_msg_part_pool_gets ++;
+    msg_part_cache = mp;
+    msg_part_cache_cnt = MSG_PART_BATCH;
+  } else {
+    struct msg_part *S = malloc (MSG_PART_SLAB * sizeof (struct msg_part));
+    assert (S);
+    MODULE_STAT->rwm_msg_part_slabs ++;
+    int i;
+    for (i = 0; i < MSG_PART_SLAB; i++) {
+      S[i].magic = 0;
+      S[i].next = i + 1 < MSG_PART_SLAB ? &S[i + 1] : NULL;
+    }
+    msg_part_cache = S;
+    msg_part_cache_cnt = MSG_PART_SLAB;
+  }
+  MODULE_STAT->rwm_cached_msg_parts += msg_part_cache_cnt;
+}
+
+static inline struct msg_part *alloc_msg_part (void) {
+  if (!msg_part_cache) {
+    refill_msg_part_cache ();
+  }
+  struct msg_part *mp = msg_part_cache;
+  assert (!mp->magic);
+  msg_part_cache = mp->next;
+  msg_part_cache_cnt --;
+  MODULE_STAT->rwm_cached_msg_parts --;
+  MODULE_STAT->rwm_total_msg_parts ++;
+  mp->magic = MSG_PART_MAGIC;
+  return mp;
+}
 
-static inline struct msg_part *alloc_msg_part (void) { MODULE_STAT->rwm_total_msg_parts ++; struct msg_part *mp = (struct msg_part *) malloc (sizeof (struct msg_part)); mp->magic = MSG_PART_MAGIC; return mp; }
-static inline void free_msg_part (struct msg_part *mp) { MODULE_STAT->rwm_total_msg_parts --; assert (mp->magic == MSG_PART_MAGIC); free (mp); }
+static inline void free_msg_part (struct msg_part *mp) {
+  MODULE_STAT->rwm_total_msg_parts --;
+  assert (mp->magic == MSG_PART_MAGIC);
+  mp->magic = 0;
+  mp->next = msg_part_cache;
+  msg_part_cache = mp;
+  MODULE_STAT->rwm_cached_msg_parts ++;
+  if (++ msg_part_cache_cnt >= 2 * MSG_PART_BATCH + MSG_PART_SLAB) {
+    // pass a batch to other threads through the pool
+    struct msg_part *batch = msg_part_cache, *last = batch;
+    int i;
+    for (i = 1; i < MSG_PART_BATCH; i++) {
+      last = last->next;
+    }
+    msg_part_cache = last->next;
+    last->next = NULL;
+    msg_part_cache_cnt -= MSG_PART_BATCH;
+    MODULE_STAT->rwm_cached_msg_parts -= MSG_PART_BATCH;
+    MODULE_STAT->rwm_msg_part_pool_puts ++;
+    mpq_push_w (get_msg_part_pool (), batch, 0);
+  }
+}
+/* }}} */
 
 struct msg_part *new_msg_part (struct msg_part *neighbor, struct msg_buffer *X) /* {{{ */{
   struct msg_part *mp = alloc_msg_part ();
@@ -1229,7 +1319,7 @@ struct rwm_encrypt_decrypt_tmp  {
   int left;
   int block_size;
   struct raw_message *raw;
-  EVP_CIPHER_CTX *evp_ctx;
+  struct aes256_ctx *aes_ctx;
   char buf[16] __attribute__((aligned(16)));
 };
 
@@ -1257,12 +1347,12 @@ int rwm_process_encrypt_decrypt (struct rwm_encrypt_decrypt_tmp *x, const void *
       data += to_fill;
       x->bp = 0;     
       if (x->buf_left >= bsize) {
-        evp_crypt (x->evp_ctx, x->buf, res->last->part->data + res->last_offset, bsize);
+        aes256_crypt (x->aes_ctx, x->buf, res->last->part->data + res->last_offset, bsize);
         res->last->data_end += bsize;
         res->last_offset += bsize;
         x->buf_left -= bsize;
       } else {
-        evp_crypt (x->evp_ctx, x->buf, x->buf, bsize);
+        aes256_crypt (x->aes_ctx, x->buf, x->buf, bsize);
         memcpy (res->last->part->data + res->last_offset, x->buf, x->buf_left);
         int t = x->buf_left;
         res->last->data_end += t;
@@ -1312,7 +1402,7 @@ int rwm_process_encrypt_decrypt (struct rwm_encrypt_decrypt_tmp *x, const void *
     assert (x->buf_left + res->last_offset <= res->last->part->chunk->buffer_size);
     if (len <= x->buf_left) {
       assert (!(len & (bsize - 1)));
-      evp_crypt (x->evp_ctx, data, (res->last->part->data + res->last_offset), len);
+      aes256_crypt (x->aes_ctx, data, (res->last->part->data + res->last_offset), len);
       res->last->data_end += len;
       res->last_offset += len;
       res->total_bytes += len;
@@ -1320,7 +1410,7 @@ int rwm_process_encrypt_decrypt (struct rwm_encrypt_decrypt_tmp *x, const void *
       return 0;
     } else {
       int t = x->buf_left & -bsize;
-      evp_crypt (x->evp_ctx, data, res->last->part->data + res->last_offset, t);
+      aes256_crypt (x->aes_ctx, data, res->last->part->data + res->last_offset, t);
       res->last->data_end += t;
       res->last_offset += t;
       res->total_bytes += t;
@@ -1332,7 +1422,7 @@ int rwm_process_encrypt_decrypt (struct rwm_encrypt_decrypt_tmp *x, const void *
 }
 
 
-int rwm_encrypt_decrypt_to (struct raw_message *raw, struct raw_message *res, int bytes, EVP_CIPHER_CTX *evp_ctx, int block_size) {
+int rwm_encrypt_decrypt_to (struct raw_message *raw, struct raw_message *res, int bytes, struct aes256_ctx *aes_ctx, int block_size) {
   assert (bytes >= 0);
   assert (block_size && !(block_size & (block_size - 1)));
   if (bytes > raw->total_bytes) {
@@ -1367,7 +1457,7 @@ int rwm_encrypt_decrypt_to (struct raw_message *raw, struct raw_message *res, in
     t.buf_left = 0;
   }
   t.raw = res;
-  t.evp_ctx = evp_ctx;
+  t.aes_ctx = aes_ctx;
   t.left = bytes;
   t.block_size = block_size;
   int r = rwm_process_and_advance (raw, bytes, (void *)rwm_process_encrypt_decrypt, &t);
@@ -1376,4 +1466,89 @@ int rwm_encrypt_decrypt_to (struct raw_message *raw, struct raw_message *res, in
   }
   return r;
 }
+
+/*
+  bytes of mp starting from offset may be changed in place:
+  nobody else references mp, and its buffer is either exclusive or shared only with res->last,
+  which was cut from the same buffer by previous rwm_encrypt_decrypt_in_place_to() and ends before offset
+*/
+static inline int rwm_part_data_exclusive (struct raw_message *raw, struct raw_message *res, struct msg_part *mp, int offset) {
+  if (mp->refcnt != 1) {
+    return 0;
+  }
+  if (mp->part->refcnt == 1) {
+    return 1;
+  }
+  struct msg_part *lp = res->last;
+  return mp == raw->first && mp->part->refcnt == 2 && lp && lp != mp && lp->part == mp->part && lp->data_end <= offset && res->last_offset == lp->data_end;
+}
+
+/*
+  same as rwm_encrypt_decrypt_to with block_size = 1 (stream modes, e.g. CTR),
+  but exclusively owned buffers are encrypted in place and moved to res without copying;
+  only data in shared buffers is copied
+*/
+int rwm_encrypt_decrypt_in_place_to (struct raw_message *raw, struct raw_message *res, int bytes, struct aes256_ctx *aes_ctx) {
+  assert (raw->magic == RM_INIT_MAGIC && res->magic == RM_INIT_MAGIC);
+  assert (bytes >= 0);
+  if (bytes > raw->total_bytes) {
+    bytes = raw->total_bytes;
+  }
+  int done = 0;
+  while (done < bytes) {
+    int left = bytes - done;
+    struct msg_part *mp = raw->first;
+    int offset = raw->first_offset;
+    int run = 0, len = 0;
+    while (1) {
+      len = (mp == raw->last ? raw->last_offset : mp->data_end) - offset;
+      if (len > left - run) {
+        len = left - run;
+      }
+      // once a part is referenced twice, the rest of the chain is reachable by somebody else
+      if (mp->refcnt != 1 || (len && !rwm_part_data_exclusive (raw, res, mp, offset))) {
+        break;
+      }
+      if (len) {
+        aes256_crypt (aes_ctx, mp->part->data + offset, mp->part->data + offset, len);
+      }
+      run += len;
+      if (run == left) {
+        break;
+      }
+      assert (mp != raw->last);
+      mp = mp->next;
+      offset = mp->offset;
+    }
+
+    if (run) {
+      struct raw_message head;
+      rwm_split_head (&head, raw, run);
+      rwm_union (res, &head);
+      if (raw->first && res->last == raw->first) {
+        // detach res from the part it shares with raw, so that next call still sees raw->first as exclusive
+        struct msg_part *locked = rwm_lock_last_part (res);
+        if (locked) {
+          locked->magic = MSG_PART_MAGIC;
+        }
+      }
+      MODULE_STAT->rwm_crypt_in_place_bytes += run;
+      done += run;
+    } else {
+      // skip empty shared parts, then copy the first non-empty one
+      while (!len) {
+        assert (mp != raw->last);
+        mp = mp->next;
+        len = (mp == raw->last ? raw->last_offset : mp->data_end) - mp->offset;
+        if (len > left) {
+          len = left;
+        }
+      }
+      assert (rwm_encrypt_decrypt_to (raw, res, len, aes_ctx, 1) == len);
+      MODULE_STAT->rwm_crypt_copied_bytes += len;
+      done += len;
+    }
+  }
+  return bytes;
+}
 /* }}} */
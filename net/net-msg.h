@@ -145,7 +145,9 @@ int rwm_process_from_offset (struct raw_message *raw, int bytes, int offset, int
 int rwm_transform_from_offset (struct raw_message *raw, int bytes, int offset, int (*transform_block)(void *extra, void *data, int len), void *extra);
 int rwm_process_and_advance (struct raw_message *raw, int bytes, int (*process_block)(void *extra, const void *data, int len), void *extra);
 int rwm_sha1 (struct raw_message *raw, int bytes, unsigned char output[20]);
-int rwm_encrypt_decrypt_to (struct raw_message *raw, struct raw_message *res, int bytes, EVP_CIPHER_CTX *evp_ctx, int block_size);
+int rwm_encrypt_decrypt_to (struct raw_message *raw, struct raw_message *res, int bytes, struct aes256_ctx *aes_ctx, int block_size);
+/* stream ciphers only: moves bytes from raw to res, transforming exclusively owned buffers in place */
+int rwm_encrypt_decrypt_in_place_to (struct raw_message *raw, struct raw_message *res, int bytes, struct aes256_ctx *aes_ctx);
 
 void *rwm_get_block_ptr (struct raw_message *raw);
 int rwm_get_block_ptr_bytes (struct raw_message *raw);
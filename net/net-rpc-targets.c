@@ -72,6 +72,8 @@ void free_rpc_target_tree_ptr (struct tree_rpc_target *T);
 MODULE_STAT_TYPE {
   long long total_rpc_targets;
   long long total_connections_in_rpc_targets;
+  long long choose_from_index;
+  long long choose_from_tree;
 };
 
 MODULE_INIT
@@ -79,6 +81,8 @@ MODULE_INIT
 MODULE_STAT_FUNCTION
   SB_SUM_ONE_LL (total_rpc_targets);
   SB_SUM_ONE_LL (total_connections_in_rpc_targets);
+  SB_SUM_ONE_LL (choose_from_index);
+  SB_SUM_ONE_LL (choose_from_tree);
 MODULE_STAT_FUNCTION_END
 /* }}} */
 
@@ -145,6 +149,9 @@ void rpc_target_insert_conn (connection_job_t C) {
   __sync_synchronize ();
   free_tree_ptr_connection (old);
 
+  // connections are inserted after handshake, readiness is checked when choosing
+  update_conn_ready_index (&S->ready_index, S->conn_tree, 0);
+
   TCP_RPC_DATA(C)->in_rpc_target = 1;
 }
 
@@ -187,6 +194,8 @@ void rpc_target_delete_conn (connection_job_t C) {
   __sync_synchronize ();
 
   free_tree_ptr_connection (old);
+
+  update_conn_ready_index (&S->ready_index, S->conn_tree, 0);
   
   TCP_RPC_DATA(C)->in_rpc_target = 0;
 }
@@ -257,17 +266,19 @@ struct connection_choose_extra {
   int count;
 };
 
+static int check_connection_ready (connection_job_t C, struct process_id *PID) {
+  struct connection_info *c = CONN_INFO (C);
+  if ((c->flags & (C_ERROR | C_FAILED | C_NET_FAILED)) || c->error || c->type->check_ready (C) != cr_ok) {
+    return 0;
+  }
+  return !PID || matches_pid (&TCP_RPC_DATA(C)->remote_pid, PID) >= 1;
+}
+
 void check_connection_arr (connection_job_t C, void *ex, void *ex2) {
   struct connection_choose_extra *E = ex;
   struct process_id *PID = ex2;
 
-  struct connection_info *c = CONN_INFO (C);
-  int r = c->type->check_ready (C);
-
-  if ((c->flags & (C_ERROR | C_FAILED | C_NET_FAILED)) || c->error || r != cr_ok) { 
-    return;
-  }
-  if (PID && matches_pid (&TCP_RPC_DATA(C)->remote_pid, PID) < 1) {
+  if (!check_connection_ready (C, PID)) {
     return;
   }
       
@@ -282,11 +293,45 @@ void check_connection_arr (connection_job_t C, void *ex, void *ex2) {
   E->count ++;
 }
 
+static int (*rpc_target_extra_load) (connection_job_t C);
+
+void rpc_target_set_connection_load_func (int (*func)(connection_job_t C)) {
+  rpc_target_extra_load = func;
+}
+
+int rpc_target_connection_load (connection_job_t C) {
+  struct connection_info *c = CONN_INFO (C);
+  int load = (c->out.total_bytes + c->out_p.total_bytes) >> 10;
+  if (rpc_target_extra_load) {
+    load += rpc_target_extra_load (C);
+  }
+  return load;
+}
+
+/* power of two choices: less loaded of two random ready connections */
+connection_job_t rpc_target_choose_least_loaded_connection (rpc_target_job_t S, struct process_id *pid) {
+  connection_job_t buf[2];
+  int n = rpc_target_choose_random_connections (S, pid, 2, buf);
+  if (n < 2) {
+    return n ? buf[0] : 0;
+  }
+  int l0 = rpc_target_connection_load (buf[0]);
+  int l1 = rpc_target_connection_load (buf[1]);
+  int i = l0 == l1 ? lrand48_j () & 1 : l1 < l0;
+  job_decref (JOB_REF_PASS (buf[i ^ 1]));
+  return buf[i];
+}
+
 connection_job_t rpc_target_choose_connection (rpc_target_job_t S, struct process_id *pid) {
   if (!S) {
     return 0;
   }
 
+  connection_job_t R = rpc_target_choose_least_loaded_connection (S, pid);
+  if (R) {
+    return R;
+  }
+
   int fast = this_job_thread && this_job_thread->thread_class == JC_ENGINE;
 
   struct tree_connection *T = fast ? RPC_TARGET_INFO (S)->conn_tree : get_tree_ptr_connection (&RPC_TARGET_INFO (S)->conn_tree);
@@ -312,10 +357,38 @@ connection_job_t rpc_target_choose_connection (rpc_target_job_t S, struct proces
   return C;
 }
 
+/* random probes into ready index of the target, O(limit) */
+static int choose_from_ready_index (rpc_target_job_t S, struct process_id *pid, int limit, connection_job_t buf[]) {
+  struct conn_ready_index *I = get_conn_ready_index_ptr (&RPC_TARGET_INFO (S)->ready_index);
+  if (!I) {
+    return 0;
+  }
+  int n = 0, attempts = 2 * limit + 2;
+  while (n < limit && attempts --> 0) {
+    connection_job_t C = I->conns[lrand48_j () % I->cnt];
+    int i;
+    for (i = 0; i < n && buf[i] != C; i++) {
+    }
+    if (i == n && check_connection_ready (C, pid)) {
+      buf[n ++] = job_incref (C);
+    }
+  }
+  conn_ready_index_decref (I);
+  return n;
+}
+
 int rpc_target_choose_random_connections (rpc_target_job_t S, struct process_id *pid, int limit, connection_job_t buf[]) {
   if (!S) {
     return 0;
   }
+
+  int n = choose_from_ready_index (S, pid, limit, buf);
+  if (n > 0) {
+    MODULE_STAT->choose_from_index ++;
+    return n;
+  }
+  // index is empty or all probes failed, walk the whole tree
+  MODULE_STAT->choose_from_tree ++;
   
   struct connection_choose_extra E;
   E.Arr = buf;
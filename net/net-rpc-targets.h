@@ -34,6 +34,7 @@ struct rpc_target_info {
   //connection_job_t first, last;
   //conn_target_job_t target;
   struct tree_connection *conn_tree;
+  struct conn_ready_index *ready_index;  // same offset as in conn_target_info
   struct process_id PID;
 };
 
@@ -45,6 +46,11 @@ rpc_target_job_t rpc_target_lookup_target (conn_target_job_t targ);
 
 connection_job_t rpc_target_choose_connection (rpc_target_job_t S, struct process_id *PID);
 int rpc_target_choose_random_connections (rpc_target_job_t S, struct process_id *PID, int limit, connection_job_t buf[]);
+connection_job_t rpc_target_choose_least_loaded_connection (rpc_target_job_t S, struct process_id *PID);
+
+/* load of a connection is the number of KB queued for sending plus the value returned by func, if set */
+void rpc_target_set_connection_load_func (int (*func)(connection_job_t C));
+int rpc_target_connection_load (connection_job_t C);
 
 void rpc_target_insert_conn (connection_job_t c);
 void rpc_target_insert_target (conn_target_job_t t);
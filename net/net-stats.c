@@ -81,6 +81,9 @@ int aio_prepare_stat (stats_buffer_t *sb);
 int mp_queue_prepare_stat (stats_buffer_t *sb);
 int timers_prepare_stat (stats_buffer_t *sb);
 int rpc_targets_prepare_stat (stats_buffer_t *sb);
+int uring_prepare_stat (stats_buffer_t *sb);
+int ext_server_prepare_stat (stats_buffer_t *sb);
+int tcp_connections_prepare_stat (stats_buffer_t *sb);
 
 //static double safe_div (double x, double y) { return y > 0 ? x/y : 0; }
 
@@ -90,6 +93,13 @@ int recent_idle_percent (void) {
 
 extern long long epoll_calls;
 extern long long epoll_intr;
+extern long long epoll_loop_iterations;
+extern long long epoll_loop_busy_iterations;
+extern long long epoll_busy_polls;
+extern long long epoll_busy_poll_hits;
+extern double epoll_loop_busy_time;
+extern double epoll_busy_poll_time;
+extern int epoll_busy_poll_us;
 extern long long event_timer_insert_ops;
 extern long long event_timer_remove_ops;
 
@@ -123,6 +133,15 @@ int prepare_stats (char *buff, int buff_size) {
       "time_after_epoll\t%.6f\n"
       "epoll_calls\t%lld\n"
       "epoll_intr\t%lld\n"
+      "epoll_loop_iterations\t%lld\n"
+      "epoll_loop_busy_iterations\t%lld\n"
+      "epoll_loop_busy_time\t%.6f\n"
+      "epoll_busy_poll_us\t%d\n"
+      "epoll_busy_polls\t%lld\n"
+      "epoll_busy_poll_hits\t%lld\n"
+      "epoll_busy_poll_time\t%.6f\n"
+      "log_messages_queued\t%lld\n"
+      "log_messages_dropped\t%lld\n"
       "PID\t" PID_PRINT_STR "\n"
       ,
       my_pid,
@@ -136,6 +155,15 @@ int prepare_stats (char *buff, int buff_size) {
       get_utime (CLOCK_MONOTONIC) - last_epoll_wait_at,
       epoll_calls,
       epoll_intr,
+      epoll_loop_iterations,
+      epoll_loop_busy_iterations,
+      epoll_loop_busy_time,
+      epoll_busy_poll_us,
+      epoll_busy_polls,
+      epoll_busy_poll_hits,
+      epoll_busy_poll_time,
+      kprintf_queued_messages (),
+      kprintf_dropped_messages (),
       PID_TO_PRINT (&PID)
       );
 
@@ -150,6 +178,9 @@ int prepare_stats (char *buff, int buff_size) {
   mp_queue_prepare_stat (&sb);
   timers_prepare_stat (&sb);
   rpc_targets_prepare_stat (&sb);
+  uring_prepare_stat (&sb);
+  ext_server_prepare_stat (&sb);
+  tcp_connections_prepare_stat (&sb);
 
   sb_printf (&sb,
     "stats_generate_time\t%.6f\n",
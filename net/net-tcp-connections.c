@@ -35,8 +35,49 @@
 #include "net/net-msg-buffers.h"
 #include "crypto/aesni256.h"
 #include "net/net-crypto-aes.h"
+#include "net/net-tcp-connections.h"
+#include "common/common-stats.h"
 #include "kprintf.h"
+#include "precise-time.h"
 
+/* {{{ STAT */
+#define MODULE tcp_connections
+
+MODULE_STAT_TYPE {
+  long long tls_records_sent, tls_records_bytes, tls_boosted_records_sent;
+};
+
+MODULE_INIT
+
+MODULE_STAT_FUNCTION
+  SB_SUM_ONE_LL (tls_records_sent);
+  SB_SUM_ONE_LL (tls_records_bytes);
+  SB_SUM_ONE_LL (tls_boosted_records_sent);
+MODULE_STAT_FUNCTION_END
+/* }}} */
+
+/*
+  TLS-transport output is cut into small records after the connection was idle,
+  so that the first bytes of a response can be decrypted without waiting for a whole 16KB record;
+  after tls_record_boost_bytes are sent without a pause records grow to tls_record_max_size
+*/
+static int tls_record_min_size = DEFAULT_TLS_RECORD_MIN_SIZE;
+static int tls_record_max_size = DEFAULT_TLS_RECORD_MAX_SIZE;
+static int tls_record_boost_bytes = DEFAULT_TLS_RECORD_BOOST_BYTES;
+
+void tcp_set_tls_record_sizing (int min_size, int max_size, int boost_bytes) {
+  if (min_size > 0) {
+    tls_record_min_size = min_size;
+  }
+  if (max_size > 0) {
+    tls_record_max_size = max_size;
+  }
+  if (boost_bytes >= 0) {
+    tls_record_boost_bytes = boost_bytes;
+  }
+  assert (tls_record_min_size > 0 && tls_record_min_size <= TLS_MAX_RECORD_SIZE);
+  assert (tls_record_max_size > 0 && tls_record_max_size <= TLS_MAX_RECORD_SIZE);
+}
 
 int cpu_tcp_free_connection_buffers (connection_job_t C) /* {{{ */ {
   struct connection_info *c = CONN_INFO (C);
@@ -239,22 +280,53 @@ int cpu_tcp_aes_crypto_ctr128_encrypt_output (connection_job_t C) /* {{{ */ {
   struct aes_crypto *T = c->crypto;
   assert (c->crypto);
 
-  while (c->out.total_bytes) {
+  if (!c->out.total_bytes) {
+    return 0;
+  }
+
+  if (!(c->flags & C_IS_TLS)) {
     int len = c->out.total_bytes;
-    if (c->flags & C_IS_TLS) {
-      assert (c->left_tls_packet_length >= 0);
-      const int MAX_PACKET_LENGTH = 1425;
-      if (MAX_PACKET_LENGTH < len) {
-        len = MAX_PACKET_LENGTH;
-      }
+    assert (rwm_encrypt_decrypt_in_place_to (&c->out, &c->out_p, len, T->write_aeskey) == len);
+    return 0;
+  }
+
+  // CTR keystream does not depend on record boundaries: encrypt everything at once, then cut into records
+  struct raw_message enc;
+  rwm_init (&enc, 0);
+  int total = c->out.total_bytes;
+  assert (rwm_encrypt_decrypt_in_place_to (&c->out, &enc, total, T->write_aeskey) == total);
 
-      unsigned char header[5] = {0x17, 0x03, 0x03, len >> 8, len & 255};
-      rwm_push_data (&c->out_p, header, 5);
-      vkprintf (2, "Send TLS-packet of length %d\n", len);
+  if (precise_now - c->tls_last_write_time > TLS_RECORD_IDLE_RESET_TIME) {
+    c->tls_burst_bytes = 0;
+  }
+  c->tls_last_write_time = precise_now;
+
+  while (enc.total_bytes) {
+    int len = enc.total_bytes;
+    assert (c->left_tls_packet_length >= 0);
+    int max_len = tls_record_min_size;
+    if (c->tls_burst_bytes >= tls_record_boost_bytes && tls_record_max_size > max_len) {
+      max_len = tls_record_max_size;
+      MODULE_STAT->tls_boosted_records_sent ++;
     }
+    if (max_len < len) {
+      len = max_len;
+    }
+    if (c->tls_burst_bytes < tls_record_boost_bytes) {
+      c->tls_burst_bytes += len;
+    }
+
+    unsigned char header[5] = {0x17, 0x03, 0x03, len >> 8, len & 255};
+    rwm_push_data (&c->out_p, header, 5);
+    vkprintf (2, "Send TLS-packet of length %d\n", len);
+    MODULE_STAT->tls_records_sent ++;
+    MODULE_STAT->tls_records_bytes += len;
 
-    assert (rwm_encrypt_decrypt_to (&c->out, &c->out_p, len, T->write_aeskey, 1) == len);
+    struct raw_message record;
+    rwm_split_head (&record, &enc, len);
+    rwm_union (&c->out_p, &record);
   }
+  rwm_free (&enc);
 
   return 0;
 }
@@ -295,7 +367,7 @@ int cpu_tcp_aes_crypto_ctr128_decrypt_input (connection_job_t C) /* {{{ */ {
       c->left_tls_packet_length -= len;
     }
     vkprintf (2, "Read %d bytes out of %d available\n", len, c->in_u.total_bytes);
-    assert (rwm_encrypt_decrypt_to (&c->in_u, &c->in, len, T->read_aeskey, 1) == len);
+    assert (rwm_encrypt_decrypt_in_place_to (&c->in_u, &c->in, len, T->read_aeskey) == len);
   }
 
   return 0;
@@ -26,6 +26,16 @@
 #pragma once
 
 #include "net/net-connections.h"
+
+#define TLS_MAX_RECORD_SIZE 16384
+#define DEFAULT_TLS_RECORD_MIN_SIZE 1425
+#define DEFAULT_TLS_RECORD_MAX_SIZE TLS_MAX_RECORD_SIZE
+#define DEFAULT_TLS_RECORD_BOOST_BYTES (128 << 10)
+/* seconds without output after which TLS records shrink back to the minimal size */
+#define TLS_RECORD_IDLE_RESET_TIME 1.0
+
+void tcp_set_tls_record_sizing (int min_size, int max_size, int boost_bytes);
+
 int cpu_tcp_server_writer (connection_job_t c);
 int cpu_tcp_free_connection_buffers (connection_job_t c);
 int cpu_tcp_server_reader (connection_job_t c);
@@ -39,6 +39,9 @@
 // Flags:
 //   Flag 1 - can not edit this message. Need to make copy.
 
+static __thread int send_defer_depth;
+static __thread connection_job_t send_defer_conn;
+
 void tcp_rpc_conn_send_init (connection_job_t C, struct raw_message *raw, int flags) {
   struct connection_info *c = CONN_INFO (C);
   vkprintf (3, "%s: sending message of size %d to conn fd=%d\n", __func__, raw->total_bytes, c->fd);
@@ -107,9 +110,33 @@ void tcp_rpc_conn_send (JOB_REF_ARG (C), struct raw_message *raw, int flags) {
   }
 
   mpq_push_w (c->out_queue, r, 0);
+
+  if (send_defer_depth) {
+    if (send_defer_conn == C) {
+      job_decref (JOB_REF_PASS (C));
+      return;
+    }
+    if (send_defer_conn) {
+      job_signal (JOB_REF_PASS (send_defer_conn), JS_RUN);
+    }
+    send_defer_conn = PTR_MOVE (C);
+    return;
+  }
   job_signal (JOB_REF_PASS (C), JS_RUN);
 }
 
+/* between defer_start and defer_end consecutive sends to one connection wake it up only once */
+void tcp_rpc_conn_send_defer_start (void) {
+  send_defer_depth++;
+}
+
+void tcp_rpc_conn_send_defer_end (void) {
+  assert (send_defer_depth > 0);
+  if (!--send_defer_depth && send_defer_conn) {
+    job_signal (JOB_REF_PASS (send_defer_conn), JS_RUN);
+  }
+}
+
 void tcp_rpc_conn_send_data (JOB_REF_ARG (C), int len, void *Q) {
   assert (!(len & 3));
   struct raw_message r;
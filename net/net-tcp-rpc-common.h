@@ -87,6 +87,8 @@ struct tcp_rpc_handshake_error_packet {
 // Bit 4 - raw is allocated pointer and it should be freed or reused
 void tcp_rpc_conn_send (JOB_REF_ARG (C), struct raw_message *raw, int flags);
 void tcp_rpc_conn_send_data (JOB_REF_ARG (C), int len, void *Q);
+void tcp_rpc_conn_send_defer_start (void);
+void tcp_rpc_conn_send_defer_end (void);
 void tcp_rpc_conn_send_init (__joblocked connection_job_t C, struct raw_message *raw, int flags);
 void tcp_rpc_conn_send_data_init (__joblocked connection_job_t c, int len, void *Q);
 void tcp_rpc_conn_send_im (JOB_REF_ARG (C), struct raw_message *raw, int flags);
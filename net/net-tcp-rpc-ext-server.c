@@ -37,7 +37,9 @@
 #include <openssl/bn.h>
 #include <openssl/rand.h>
 
+#include "common/common-stats.h"
 #include "common/kprintf.h"
+#include "common/mp-queue.h"
 #include "common/precise-time.h"
 #include "common/resolver.h"
 #include "common/rpc-const.h"
@@ -54,7 +56,7 @@
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <netinet/in.h>
-#include <sys/select.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -147,23 +149,154 @@ int tcp_proxy_pass_write_packet (connection_job_t C, struct raw_message *raw) {
 
 int tcp_rpcs_default_execute (connection_job_t c, int op, struct raw_message *msg);
 
+/* {{{ STAT */
+#define MODULE ext_server
+
+MODULE_STAT_TYPE {
+  long long key_share_pool_hits;
+  long long key_share_pool_misses;
+  long long key_share_generated;
+  long long key_share_refills;
+  long long client_random_replays;
+  long long client_random_evictions;
+  struct stats_histogram handshake_time;
+};
+
+MODULE_INIT
+
+static int key_share_pool_size;
+static long long client_random_cache_capacity;
+static long long domain_probes_succeeded, domain_probes_failed;
+
+void fetch_ext_server_handshake_time (struct stats_histogram *H) {
+  SB_SUM_HISTOGRAM (H, handshake_time);
+}
+
+MODULE_STAT_FUNCTION
+  sb_printf (sb, "key_share_pool_size\t%d\n", key_share_pool_size);
+  SB_SUM_ONE_LL (key_share_pool_hits);
+  SB_SUM_ONE_LL (key_share_pool_misses);
+  SB_SUM_ONE_LL (key_share_generated);
+  SB_SUM_ONE_LL (key_share_refills);
+  sb_printf (sb, "client_random_cache_capacity\t%lld\n", client_random_cache_capacity);
+  SB_SUM_ONE_LL (client_random_replays);
+  SB_SUM_ONE_LL (client_random_evictions);
+  sb_printf (sb, "domain_probes_succeeded\t%lld\n", domain_probes_succeeded);
+  sb_printf (sb, "domain_probes_failed\t%lld\n", domain_probes_failed);
+MODULE_STAT_FUNCTION_END
+/* }}} */
+
 static unsigned char ext_secret[16][16];
 static int ext_secret_cnt = 0;
 
+/* sha256 states after the inner and outer HMAC key blocks of each secret */
+static sha256_context *ext_secret_hmac_inner[16], *ext_secret_hmac_outer[16];
+
 void tcp_rpcs_set_ext_secret (unsigned char secret[16]) {
   assert (ext_secret_cnt < 16);
+  unsigned char pad[64];
+  int i;
+
+  memset (pad, 0x36, 64);
+  for (i = 0; i < 16; i++) {
+    pad[i] ^= secret[i];
+  }
+  ext_secret_hmac_inner[ext_secret_cnt] = EVP_MD_CTX_new ();
+  sha256_starts (ext_secret_hmac_inner[ext_secret_cnt]);
+  sha256_update (ext_secret_hmac_inner[ext_secret_cnt], pad, 64);
+
+  memset (pad, 0x5c, 64);
+  for (i = 0; i < 16; i++) {
+    pad[i] ^= secret[i];
+  }
+  ext_secret_hmac_outer[ext_secret_cnt] = EVP_MD_CTX_new ();
+  sha256_starts (ext_secret_hmac_outer[ext_secret_cnt]);
+  sha256_update (ext_secret_hmac_outer[ext_secret_cnt], pad, 64);
+
   memcpy (ext_secret[ext_secret_cnt ++], secret, 16);
 }
 
+static __thread sha256_context *ext_sha256_ctx;
+static __thread EVP_CIPHER_CTX *ext_tag_cipher_ctx;
+
+static sha256_context *get_ext_sha256_ctx (void) {
+  if (!ext_sha256_ctx) {
+    ext_sha256_ctx = EVP_MD_CTX_new ();
+    assert (ext_sha256_ctx);
+  }
+  return ext_sha256_ctx;
+}
+
+/* same as sha256_hmac (ext_secret[secret_id], 16, ...), but starts from precomputed key blocks */
+static void ext_secret_hmac (int secret_id, const unsigned char *input, int ilen, unsigned char output[32]) {
+  sha256_context *ctx = get_ext_sha256_ctx ();
+  unsigned char inner[32];
+  assert (EVP_MD_CTX_copy_ex (ctx, ext_secret_hmac_inner[secret_id]) == 1);
+  sha256_update (ctx, input, ilen);
+  sha256_finish (ctx, inner);
+  assert (EVP_MD_CTX_copy_ex (ctx, ext_secret_hmac_outer[secret_id]) == 1);
+  sha256_update (ctx, inner, 32);
+  sha256_finish (ctx, output);
+}
+
+/* read key of obfuscated header for given secret: sha256 (header[8..40] + secret) */
+static void ext_secret_read_key (const unsigned char random_header[64], int secret_id, unsigned char key[32]) {
+  if (secret_id < 0) {
+    memcpy (key, random_header + 8, 32);
+    return;
+  }
+  sha256_context *ctx = get_ext_sha256_ctx ();
+  assert (EVP_DigestInit_ex (ctx, EVP_sha256 (), NULL) == 1);
+  sha256_update (ctx, random_header + 8, 32);
+  sha256_update (ctx, ext_secret[secret_id], 16);
+  sha256_finish (ctx, key);
+}
+
+/*
+  decrypts only the tag at offset 56 of obfuscated header:
+  it lies in the 4th CTR block, so one AES block with counter iv + 3 is enough
+*/
+static unsigned ext_header_decrypt_tag (const unsigned char random_header[64], const unsigned char read_key[32]) {
+  if (!ext_tag_cipher_ctx) {
+    ext_tag_cipher_ctx = EVP_CIPHER_CTX_new ();
+    assert (ext_tag_cipher_ctx);
+  }
+  unsigned char counter[16], keystream[16];
+  memcpy (counter, random_header + 40, 16);
+  int i, carry = 3;
+  for (i = 15; i >= 0 && carry; i--) {
+    carry += counter[i];
+    counter[i] = carry;
+    carry >>= 8;
+  }
+  int len = 0;
+  assert (EVP_EncryptInit_ex (ext_tag_cipher_ctx, EVP_aes_256_ecb (), NULL, read_key, NULL) == 1);
+  EVP_CIPHER_CTX_set_padding (ext_tag_cipher_ctx, 0);
+  assert (EVP_EncryptUpdate (ext_tag_cipher_ctx, keystream, &len, counter, 16) == 1 && len == 16);
+  return *(unsigned *)(random_header + 56) ^ *(unsigned *)(keystream + 8);
+}
+
 static int allow_only_tls;
 
+// ServerHello parameters emulated for a domain; kept in shared memory and refreshed by the master, so read and written as a whole
+union domain_server_hello {
+  struct {
+    short server_hello_encrypted_size;
+    char use_random_encrypted_size;
+    char is_reversed_extension_order;
+  };
+  int word;
+};
+
+struct domain_probe;
+
 struct domain_info {
   const char *domain;
+  int port;
   struct in_addr target;
   unsigned char target_ipv6[16];
-  short server_hello_encrypted_size;
-  char use_random_encrypted_size;
-  char is_reversed_extension_order;
+  union domain_server_hello *server_hello;
+  struct domain_probe *probe;  // only in the process probing domains
   struct domain_info *next;
 };
 
@@ -192,12 +325,22 @@ static const struct domain_info *get_domain_info (const char *domain, size_t len
   return NULL;
 }
 
-static int get_domain_server_hello_encrypted_size (const struct domain_info *info) {
-  if (info->use_random_encrypted_size) {
+static union domain_server_hello get_domain_server_hello (const struct domain_info *info) {
+  union domain_server_hello H;
+  H.word = __atomic_load_n (&info->server_hello->word, __ATOMIC_RELAXED);
+  return H;
+}
+
+static void set_domain_server_hello (struct domain_info *info, union domain_server_hello H) {
+  __atomic_store_n (&info->server_hello->word, H.word, __ATOMIC_RELAXED);
+}
+
+static int get_domain_server_hello_encrypted_size (const union domain_server_hello *H) {
+  if (H->use_random_encrypted_size) {
     int r = rand();
-    return info->server_hello_encrypted_size + ((r >> 1) & 1) - (r & 1);
+    return H->server_hello_encrypted_size + ((r >> 1) & 1) - (r & 1);
   } else {
-    return info->server_hello_encrypted_size;
+    return H->server_hello_encrypted_size;
   }
 }
 
@@ -292,6 +435,89 @@ static void generate_public_key (unsigned char key[32]) {
   BN_clear_free (mod);
 }
 
+/* {{{ KEY SHARE POOL */
+
+/*
+  generate_public_key() costs several modular exponentiations, 
+  so key shares for ServerHello are generated in advance by a JC_CPU job:
+  refill starts when pool drops below low watermark and stops at high watermark
+*/
+
+#define KEY_SHARE_POOL_LOW	256
+#define KEY_SHARE_POOL_HIGH	1024
+#define KEY_SHARE_REFILL_BATCH	16
+
+struct key_share {
+  unsigned char key[32];
+};
+
+static struct mp_queue *key_share_pool;
+static int key_share_refill_scheduled;
+
+static int key_share_refill_job (job_t job, int op, struct job_thread *JT) {
+  switch (op) {
+  case JS_RUN: {
+    int i;
+    for (i = 0; i < KEY_SHARE_REFILL_BATCH && key_share_pool_size < KEY_SHARE_POOL_HIGH; i++) {
+      struct key_share *K = malloc (sizeof (*K));
+      assert (K);
+      generate_public_key (K->key);
+      mpq_push_w (key_share_pool, K, 0);
+      __sync_fetch_and_add (&key_share_pool_size, 1);
+      MODULE_STAT->key_share_generated ++;
+    }
+    if (key_share_pool_size < KEY_SHARE_POOL_HIGH) {
+      // watermark is rechecked after each batch
+      return JOB_SENDSIG (JS_RUN);
+    }
+    __sync_lock_release (&key_share_refill_scheduled);
+    return JOB_COMPLETED;
+  }
+  case JS_FINISH:
+    assert (job->j_refcnt == 1);
+    return job_free (JOB_REF_PASS (job));
+  default:
+    assert (0);
+  }
+}
+
+static void key_share_schedule_refill (void) {
+  if (__sync_lock_test_and_set (&key_share_refill_scheduled, 1)) {
+    return;
+  }
+  MODULE_STAT->key_share_refills ++;
+  job_t job = create_async_job (key_share_refill_job, JSC_ALLOW (JC_CPU, JS_RUN) | JSIG_FAST (JS_FINISH), 0, 0, 0, JOB_REF_NULL);
+  schedule_job (JOB_REF_PASS (job));
+}
+
+/* must be invoked after job threads are created */
+void tcp_rpcs_init_key_share_pool (void) {
+  if (key_share_pool) {
+    return;
+  }
+  key_share_pool = alloc_mp_queue_w ();
+  key_share_schedule_refill ();
+}
+
+static void get_public_key_share (unsigned char key[32]) {
+  struct key_share *K = key_share_pool ? mpq_pop_nw (key_share_pool, 4) : NULL;
+  if (K) {
+    memcpy (key, K->key, 32);
+    free (K);
+    MODULE_STAT->key_share_pool_hits ++;
+    if (__sync_sub_and_fetch (&key_share_pool_size, 1) >= KEY_SHARE_POOL_LOW) {
+      return;
+    }
+  } else {
+    generate_public_key (key);
+    MODULE_STAT->key_share_pool_misses ++;
+  }
+  if (key_share_pool) {
+    key_share_schedule_refill ();
+  }
+}
+/* }}} */
+
 static void add_string (unsigned char *str, int *pos, const char *data, int data_len) {
   assert (*pos + data_len <= TLS_REQUEST_LENGTH);
   memcpy (str + (*pos), data, data_len);
@@ -485,258 +711,330 @@ static int check_response (const unsigned char *response, int len, const unsigne
   return 1;
 }
 
-static int update_domain_info (struct domain_info *info) {
-  const char *domain = info->domain;
-  struct hostent *host = kdb_gethostbyname (domain);
-  if (host == NULL || host->h_addr == NULL) {
-    kprintf ("Failed to resolve host %s\n", domain);
-    return 0;
-  }
-  assert (host->h_addrtype == AF_INET || host->h_addrtype == AF_INET6);
+/*
+  domain probing
+
+  ServerHello parameters of every domain are measured with DOMAIN_PROBE_TRIES concurrent handshakes
+  driven by the main event loop, all domains at once; until a probe of a domain succeeds defaults are used,
+  and a failed refresh keeps the previous result
+*/
+
+#define DOMAIN_PROBE_TRIES 20
+#define DOMAIN_PROBE_TIMEOUT 5.0
+#define DOMAIN_PROBE_RETRY_INTERVAL 60.0
+
+struct domain_probe_conn {
+  struct domain_probe *probe;
+  int fd;  // -1 if closed
+  int is_written;
+  int is_encrypted_application_data_length_read;
+  unsigned char *request;
+  unsigned char *response;
+  unsigned char header[5];
+  int response_len;
+  int read_pos;
+};
+
+struct domain_probe {
+  struct domain_info *info;
+  int is_running;
+  int have_result;
+  double start_time;
+  double deadline;
+  double next_probe_time;  // 0 if never
+  int finished_count;
+  int encrypted_application_data_length_min;
+  int encrypted_application_data_length_sum;
+  int encrypted_application_data_length_max;
+  int is_reversed_extension_order_min;
+  int is_reversed_extension_order_max;
+  struct domain_probe_conn conns[DOMAIN_PROBE_TRIES];
+};
 
-  fd_set read_fd;
-  fd_set write_fd;
-  fd_set except_fd;
-  FD_ZERO(&read_fd);
-  FD_ZERO(&write_fd);
-  FD_ZERO(&except_fd);
+static struct domain_probe **domain_probes;
+static int domain_probes_num;
+static double domain_probe_interval = DEFAULT_DOMAIN_PROBE_INTERVAL;
+
+void tcp_rpcs_set_domain_probe_interval (double interval) {
+  domain_probe_interval = interval;
+}
+
+static void domain_probe_conn_close (struct domain_probe_conn *C) {
+  if (C->fd >= 0) {
+    epoll_close (C->fd);
+    close (C->fd);
+    C->fd = -1;
+  }
+  free (C->request);
+  C->request = NULL;
+  free (C->response);
+  C->response = NULL;
+}
 
-#define TRIES 20
-  int sockets[TRIES];
+static void domain_probe_finish (struct domain_probe *P, int success) {
+  struct domain_info *info = P->info;
+  const char *domain = info->domain;
   int i;
-  for (i = 0; i < TRIES; i++) {
-    sockets[i] = socket (host->h_addrtype, SOCK_STREAM, IPPROTO_TCP);
-    if (sockets[i] < 0) {
-      kprintf ("Failed to open socket for %s: %s\n", domain, strerror (errno));
-      return 0;
-    }
-    if (fcntl (sockets[i], F_SETFL, O_NONBLOCK) == -1) {
-      kprintf ("Failed to make socket non-blocking: %s\n", strerror (errno));
-      return 0;
+  for (i = 0; i < DOMAIN_PROBE_TRIES; i++) {
+    domain_probe_conn_close (&P->conns[i]);
+  }
+  P->is_running = 0;
+
+  if (!success) {
+    domain_probes_failed++;
+    kprintf ("Failed to update response data about %s, so %s response settings will be used\n", domain, P->have_result ? "previously checked" : "default");
+    if (domain_probe_interval > 0) {
+      P->next_probe_time = precise_now + (domain_probe_interval < DOMAIN_PROBE_RETRY_INTERVAL ? domain_probe_interval : DOMAIN_PROBE_RETRY_INTERVAL);
+    } else {
+      P->next_probe_time = 0;
     }
+    return;
+  }
 
-    int e_connect;
-    if (host->h_addrtype == AF_INET) {
-      info->target = *((struct in_addr *) host->h_addr);
-      memset (info->target_ipv6, 0, sizeof (info->target_ipv6));
+  if (P->is_reversed_extension_order_min != P->is_reversed_extension_order_max) {
+    kprintf ("Upstream server %s uses non-deterministic extension order\n", domain);
+  }
 
-      struct sockaddr_in addr;
-      memset (&addr, 0, sizeof (addr));
-      addr.sin_family = AF_INET;
-      addr.sin_port = htons (443);
-      memcpy (&addr.sin_addr, host->h_addr, sizeof (struct in_addr));
+  union domain_server_hello H;
+  H.is_reversed_extension_order = (char)P->is_reversed_extension_order_min;
 
-      e_connect = connect (sockets[i], &addr, sizeof (addr));
-    } else {
-      assert (sizeof (struct in6_addr) == sizeof (info->target_ipv6));
-      info->target.s_addr = 0;
-      memcpy (info->target_ipv6, host->h_addr, sizeof (struct in6_addr));
+  if (P->encrypted_application_data_length_min == P->encrypted_application_data_length_max) {
+    H.server_hello_encrypted_size = P->encrypted_application_data_length_min;
+    H.use_random_encrypted_size = 0;
+  } else if (P->encrypted_application_data_length_max - P->encrypted_application_data_length_min <= 3) {
+    H.server_hello_encrypted_size = P->encrypted_application_data_length_max - 1;
+    H.use_random_encrypted_size = 1;
+  } else {
+    kprintf ("Unrecognized encrypted application data length pattern with min = %d, max = %d, mean = %.3lf\n",
+             P->encrypted_application_data_length_min, P->encrypted_application_data_length_max, P->encrypted_application_data_length_sum * 1.0 / DOMAIN_PROBE_TRIES);
+    H.server_hello_encrypted_size = (int)(P->encrypted_application_data_length_sum * 1.0 / DOMAIN_PROBE_TRIES + 0.5);
+    H.use_random_encrypted_size = 1;
+  }
+  set_domain_server_hello (info, H);
+  P->have_result = 1;
+  P->next_probe_time = domain_probe_interval > 0 ? precise_now + domain_probe_interval : 0;
+  domain_probes_succeeded++;
 
-      struct sockaddr_in6 addr;
-      memset (&addr, 0, sizeof (addr));
-      addr.sin6_family = AF_INET6;
-      addr.sin6_port = htons (443);
-      memcpy (&addr.sin6_addr, host->h_addr, sizeof (struct in6_addr));
+  vkprintf (0, "Successfully checked domain %s in %.3lf seconds: is_reversed_extension_order = %d, server_hello_encrypted_size = %d, use_random_encrypted_size = %d\n",
+            domain, precise_now - P->start_time, H.is_reversed_extension_order, H.server_hello_encrypted_size, H.use_random_encrypted_size);
+  if (H.is_reversed_extension_order && H.server_hello_encrypted_size <= 1250) {
+    kprintf ("Multiple encrypted client data packets are unsupported, so handshake with %s will not be fully emulated\n", domain);
+  }
+}
 
-      e_connect = connect (sockets[i], &addr, sizeof (addr));
+static void domain_probe_add_result (struct domain_probe *P, int is_reversed_extension_order, int encrypted_application_data_length) {
+  if (P->finished_count == 0) {
+    P->is_reversed_extension_order_min = is_reversed_extension_order;
+    P->is_reversed_extension_order_max = is_reversed_extension_order;
+    P->encrypted_application_data_length_min = encrypted_application_data_length;
+    P->encrypted_application_data_length_max = encrypted_application_data_length;
+    P->encrypted_application_data_length_sum = 0;
+  } else {
+    if (is_reversed_extension_order < P->is_reversed_extension_order_min) {
+      P->is_reversed_extension_order_min = is_reversed_extension_order;
     }
-
-    if (e_connect == -1 && errno != EINPROGRESS) {
-      kprintf ("Failed to connect to %s: %s\n", domain, strerror (errno));
-      return 0;
+    if (is_reversed_extension_order > P->is_reversed_extension_order_max) {
+      P->is_reversed_extension_order_max = is_reversed_extension_order;
+    }
+    if (encrypted_application_data_length < P->encrypted_application_data_length_min) {
+      P->encrypted_application_data_length_min = encrypted_application_data_length;
+    }
+    if (encrypted_application_data_length > P->encrypted_application_data_length_max) {
+      P->encrypted_application_data_length_max = encrypted_application_data_length;
     }
   }
+  P->encrypted_application_data_length_sum += encrypted_application_data_length;
+  P->finished_count++;
+}
 
-  unsigned char *requests[TRIES];
-  for (i = 0; i < TRIES; i++) {
-    requests[i] = create_request (domain);
-  }
-  unsigned char *responses[TRIES] = {};
-  int response_len[TRIES] = {};
-  int is_encrypted_application_data_length_read[TRIES] = {};
-
-  int finished_count = 0;
-  int is_written[TRIES] = {};
-  int is_finished[TRIES] = {};
-  int read_pos[TRIES] = {};
-  double finish_time = get_utime_monotonic() + 5.0;
-  int encrypted_application_data_length_min = 0;
-  int encrypted_application_data_length_sum = 0;
-  int encrypted_application_data_length_max = 0;
-  int is_reversed_extension_order_min = 0;
-  int is_reversed_extension_order_max = 0;
-  int have_error = 0;
-  while (get_utime_monotonic() < finish_time && finished_count < TRIES && !have_error) {
-    struct timeval timeout_data;
-    timeout_data.tv_sec = (int)(finish_time - precise_now + 1);
-    timeout_data.tv_usec = 0;
-
-    int max_fd = 0;
-    for (i = 0; i < TRIES; i++) {
-      if (is_finished[i]) {
-        continue;
-      }
-      if (is_written[i]) {
-        FD_SET(sockets[i], &read_fd);
-        FD_CLR(sockets[i], &write_fd);
-      } else {
-        FD_CLR(sockets[i], &read_fd);
-        FD_SET(sockets[i], &write_fd);
-      }
-      FD_SET(sockets[i], &except_fd);
-      if (sockets[i] > max_fd) {
-        max_fd = sockets[i];
+// reads until EAGAIN; returns 1 if the whole response is read, 0 if more data is expected and -1 on error
+static int domain_probe_conn_read (struct domain_probe_conn *C) {
+  const char *domain = C->probe->info->domain;
+  while (1) {
+    unsigned char *buffer = C->response ? C->response : C->header;
+    int len = C->response ? C->response_len : (int)sizeof (C->header);
+    ssize_t read_res = read (C->fd, buffer + C->read_pos, len - C->read_pos);
+    if (read_res < 0) {
+      if (errno == EAGAIN || errno == EINTR) {
+        return 0;
       }
+      kprintf ("Failed to read response from %s: %m\n", domain);
+      return -1;
+    }
+    if (read_res == 0) {
+      kprintf ("Failed to read response from %s: connection closed after %d bytes\n", domain, C->read_pos);
+      return -1;
+    }
+    C->read_pos += read_res;
+    if (C->read_pos < len) {
+      continue;
     }
 
-    select (max_fd + 1, &read_fd, &write_fd, &except_fd, &timeout_data);
-
-    for (i = 0; i < TRIES; i++) {
-      if (is_finished[i]) {
-        continue;
+    if (C->response == NULL) {
+      unsigned char *header = C->header;
+      if (memcmp (header, "\x16\x03\x03", 3) != 0) {
+        kprintf ("Non-TLS response, or TLS <= 1.1, or unsuccessful request to %s: receive \\x%02x\\x%02x\\x%02x\\x%02x\\x%02x...\n",
+                 domain, header[0], header[1], header[2], header[3], header[4]);
+        return -1;
       }
-      if (FD_ISSET(sockets[i], &read_fd)) {
-        assert (is_written[i]);
+      C->response_len = 5 + header[3] * 256 + header[4] + 6 + 5;
+      C->response = malloc (C->response_len);
+      assert (C->response != NULL);
+      memcpy (C->response, header, sizeof (C->header));
+      continue;
+    }
 
-        unsigned char header[5];
-        if (responses[i] == NULL) {
-          ssize_t read_res = read (sockets[i], header, sizeof (header));
-          if (read_res != sizeof (header)) {
-            kprintf ("Failed to read response header for checking domain %s: %s\n", domain, read_res == -1 ? strerror (errno) : "Read less bytes than expected");
-            have_error = 1;
-            break;
-          }
-          if (memcmp (header, "\x16\x03\x03", 3) != 0) {
-            kprintf ("Non-TLS response, or TLS <= 1.1, or unsuccessful request to %s: receive \\x%02x\\x%02x\\x%02x\\x%02x\\x%02x...\n",
-                     domain, header[0], header[1], header[2], header[3], header[4]);
-            have_error = 1;
-            break;
-          }
-          response_len[i] = 5 + header[3] * 256 + header[4] + 6 + 5;
-          responses[i] = malloc (response_len[i]);
-          memcpy (responses[i], header, sizeof (header));
-          read_pos[i] = 5;
-        } else {
-          ssize_t read_res = read (sockets[i], responses[i] + read_pos[i], response_len[i] - read_pos[i]);
-          if (read_res == -1) {
-            kprintf ("Failed to read response from %s: %s\n", domain, strerror (errno));
-            have_error = 1;
-            break;
-          }
-          read_pos[i] += read_res;
-
-          if (read_pos[i] == response_len[i]) {
-            if (!is_encrypted_application_data_length_read[i]) {
-              if (memcmp (responses[i] + response_len[i] - 11, "\x14\x03\x03\x00\x01\x01\x17\x03\x03", 9) != 0) {
-                kprintf ("Not found TLS 1.3 support on domain %s\n", domain);
-                have_error = 1;
-                break;
-              }
-
-              is_encrypted_application_data_length_read[i] = 1;
-              int encrypted_application_data_length = responses[i][response_len[i] - 2] * 256 + responses[i][response_len[i] - 1];
-              response_len[i] += encrypted_application_data_length;
-              unsigned char *new_buffer = realloc (responses[i], response_len[i]);
-              assert (new_buffer != NULL);
-              responses[i] = new_buffer;
-              continue;
-            }
-
-            int is_reversed_extension_order = -1;
-            int encrypted_application_data_length = -1;
-            if (check_response (responses[i], response_len[i], requests[i] + 44, &is_reversed_extension_order, &encrypted_application_data_length)) {
-              assert (is_reversed_extension_order != -1);
-              assert (encrypted_application_data_length != -1);
-              if (finished_count == 0) {
-                is_reversed_extension_order_min = is_reversed_extension_order;
-                is_reversed_extension_order_max = is_reversed_extension_order;
-                encrypted_application_data_length_min = encrypted_application_data_length;
-                encrypted_application_data_length_max = encrypted_application_data_length;
-              } else {
-                if (is_reversed_extension_order < is_reversed_extension_order_min) {
-                  is_reversed_extension_order_min = is_reversed_extension_order;
-                }
-                if (is_reversed_extension_order > is_reversed_extension_order_max) {
-                  is_reversed_extension_order_max = is_reversed_extension_order;
-                }
-                if (encrypted_application_data_length < encrypted_application_data_length_min) {
-                  encrypted_application_data_length_min = encrypted_application_data_length;
-                }
-                if (encrypted_application_data_length > encrypted_application_data_length_max) {
-                  encrypted_application_data_length_max = encrypted_application_data_length;
-                }
-              }
-              encrypted_application_data_length_sum += encrypted_application_data_length;
-
-              FD_CLR(sockets[i], &write_fd);
-              FD_CLR(sockets[i], &read_fd);
-              FD_CLR(sockets[i], &except_fd);
-              is_finished[i] = 1;
-              finished_count++;
-            } else {
-              have_error = 1;
-              break;
-            }
-          }
-        }
-      }
-      if (FD_ISSET(sockets[i], &write_fd)) {
-        assert (!is_written[i]);
-        ssize_t write_res = write (sockets[i], requests[i], TLS_REQUEST_LENGTH);
-        if (write_res != TLS_REQUEST_LENGTH) {
-          kprintf ("Failed to write request for checking domain %s: %s", domain, write_res == -1 ? strerror (errno) : "Written less bytes than expected");
-          have_error = 1;
-          break;
-        }
-        is_written[i] = 1;
+    if (!C->is_encrypted_application_data_length_read) {
+      if (memcmp (C->response + C->response_len - 11, "\x14\x03\x03\x00\x01\x01\x17\x03\x03", 9) != 0) {
+        kprintf ("Not found TLS 1.3 support on domain %s\n", domain);
+        return -1;
       }
-      if (FD_ISSET(sockets[i], &except_fd)) {
-        kprintf ("Failed to check domain %s: %s\n", domain, strerror (errno));
-        have_error = 1;
-        break;
+
+      C->is_encrypted_application_data_length_read = 1;
+      int encrypted_application_data_length = C->response[C->response_len - 2] * 256 + C->response[C->response_len - 1];
+      if (encrypted_application_data_length > 0) {
+        C->response_len += encrypted_application_data_length;
+        unsigned char *new_buffer = realloc (C->response, C->response_len);
+        assert (new_buffer != NULL);
+        C->response = new_buffer;
+        continue;
       }
     }
+    return 1;
   }
+}
 
-  for (i = 0; i < TRIES; i++) {
-    close (sockets[i]);
-    free (requests[i]);
-    free (responses[i]);
+static int domain_probe_conn_event (int fd, void *data, event_t *ev) {
+  struct domain_probe_conn *C = data;
+  struct domain_probe *P = C->probe;
+  const char *domain = P->info->domain;
+  assert (C->fd == fd && P->is_running);
+
+  if (!C->is_written) {
+    if (!(ev->ready & EVT_WRITE)) {
+      int err = 0;
+      socklen_t err_len = sizeof (err);
+      getsockopt (fd, SOL_SOCKET, SO_ERROR, &err, &err_len);
+      kprintf ("Failed to connect to %s: %s\n", domain, strerror (err));
+      domain_probe_finish (P, 0);
+      return EVA_CONTINUE;
+    }
+    ssize_t write_res = write (fd, C->request, TLS_REQUEST_LENGTH);
+    if (write_res != TLS_REQUEST_LENGTH) {
+      kprintf ("Failed to write request for checking domain %s: %s\n", domain, write_res == -1 ? strerror (errno) : "Written less bytes than expected");
+      domain_probe_finish (P, 0);
+      return EVA_CONTINUE;
+    }
+    C->is_written = 1;
+    return EVT_READ | EVT_SPEC;
   }
 
-  if (finished_count != TRIES) {
-    if (!have_error) {
-      kprintf ("Failed to check domain %s in 5 seconds\n", domain);
-    }
-    return 0;
+  if (!(ev->ready & EVT_READ)) {
+    return EVA_CONTINUE;
+  }
+  int res = domain_probe_conn_read (C);
+  if (res == 0) {
+    return EVA_CONTINUE;
   }
+  int is_reversed_extension_order = -1;
+  int encrypted_application_data_length = -1;
+  if (res < 0 || !check_response (C->response, C->response_len, C->request + 44, &is_reversed_extension_order, &encrypted_application_data_length)) {
+    domain_probe_finish (P, 0);
+    return EVA_CONTINUE;
+  }
+  assert (is_reversed_extension_order != -1);
+  assert (encrypted_application_data_length != -1);
+  domain_probe_add_result (P, is_reversed_extension_order, encrypted_application_data_length);
+  domain_probe_conn_close (C);
+  if (P->finished_count == DOMAIN_PROBE_TRIES) {
+    domain_probe_finish (P, 1);
+  }
+  return EVA_CONTINUE;
+}
 
-  if (is_reversed_extension_order_min != is_reversed_extension_order_max) {
-    kprintf ("Upstream server %s uses non-deterministic extension order\n", domain);
+static void domain_probe_start (struct domain_probe *P) {
+  struct domain_info *info = P->info;
+  const char *domain = info->domain;
+  assert (!P->is_running);
+  P->is_running = 1;
+  P->finished_count = 0;
+  P->start_time = precise_now;
+  P->deadline = precise_now + DOMAIN_PROBE_TIMEOUT;
+  vkprintf (1, "Checking domain %s\n", domain);
+
+  int i;
+  for (i = 0; i < DOMAIN_PROBE_TRIES; i++) {
+    struct domain_probe_conn *C = &P->conns[i];
+    memset (C, 0, sizeof (*C));
+    C->probe = P;
+    C->fd = -1;
   }
+  for (i = 0; i < DOMAIN_PROBE_TRIES; i++) {
+    struct domain_probe_conn *C = &P->conns[i];
+    int fd = socket (info->target.s_addr ? AF_INET : AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+    if (fd < 0) {
+      kprintf ("Failed to open socket for %s: %m\n", domain);
+      domain_probe_finish (P, 0);
+      return;
+    }
+    if (fd >= MAX_EVENTS) {
+      kprintf ("Failed to open socket for %s: too many open files\n", domain);
+      close (fd);
+      domain_probe_finish (P, 0);
+      return;
+    }
+    C->fd = fd;
+
+    int e_connect;
+    if (info->target.s_addr) {
+      struct sockaddr_in addr;
+      memset (&addr, 0, sizeof (addr));
+      addr.sin_family = AF_INET;
+      addr.sin_port = htons (info->port);
+      addr.sin_addr = info->target;
 
-  info->is_reversed_extension_order = (char)is_reversed_extension_order_min;
+      e_connect = connect (fd, (struct sockaddr *) &addr, sizeof (addr));
+    } else {
+      struct sockaddr_in6 addr;
+      memset (&addr, 0, sizeof (addr));
+      addr.sin6_family = AF_INET6;
+      addr.sin6_port = htons (info->port);
+      memcpy (&addr.sin6_addr, info->target_ipv6, sizeof (struct in6_addr));
 
-  if (encrypted_application_data_length_min == encrypted_application_data_length_max) {
-    info->server_hello_encrypted_size = encrypted_application_data_length_min;
-    info->use_random_encrypted_size = 0;
-  } else if (encrypted_application_data_length_max - encrypted_application_data_length_min <= 3) {
-    info->server_hello_encrypted_size = encrypted_application_data_length_max - 1;
-    info->use_random_encrypted_size = 1;
-  } else {
-    kprintf ("Unrecognized encrypted application data length pattern with min = %d, max = %d, mean = %.3lf\n",
-             encrypted_application_data_length_min, encrypted_application_data_length_max, encrypted_application_data_length_sum * 1.0 / TRIES);
-    info->server_hello_encrypted_size = (int)(encrypted_application_data_length_sum * 1.0 / TRIES + 0.5);
-    info->use_random_encrypted_size = 1;
+      e_connect = connect (fd, (struct sockaddr *) &addr, sizeof (addr));
+    }
+
+    if (e_connect == -1 && errno != EINPROGRESS) {
+      kprintf ("Failed to connect to %s: %m\n", domain);
+      domain_probe_finish (P, 0);
+      return;
+    }
+
+    C->request = create_request (domain);
+    epoll_sethandler (fd, 0, domain_probe_conn_event, C);
+    epoll_insert (fd, EVT_WRITE | EVT_SPEC);
   }
+}
 
-  vkprintf (0, "Successfully checked domain %s in %.3lf seconds: is_reversed_extension_order = %d, server_hello_encrypted_size = %d, use_random_encrypted_size = %d\n",
-            domain, get_utime_monotonic() - (finish_time - 5.0), info->is_reversed_extension_order, info->server_hello_encrypted_size, info->use_random_encrypted_size);
-  if (info->is_reversed_extension_order && info->server_hello_encrypted_size <= 1250) {
-    kprintf ("Multiple encrypted client data packets are unsupported, so handshake with %s will not be fully emulated\n", domain);
+// main thread timer: enforces probe deadlines and starts periodic refreshes
+static double domain_probe_alarm (void *extra) {
+  double wakeup_time = 0;
+  int i;
+  for (i = 0; i < domain_probes_num; i++) {
+    struct domain_probe *P = domain_probes[i];
+    if (P->is_running && P->deadline <= precise_now) {
+      kprintf ("Failed to check domain %s in %.0lf seconds\n", P->info->domain, DOMAIN_PROBE_TIMEOUT);
+      domain_probe_finish (P, 0);
+    }
+    if (!P->is_running && P->next_probe_time > 0 && P->next_probe_time <= precise_now) {
+      domain_probe_start (P);
+    }
+    double t = P->is_running ? P->deadline : P->next_probe_time;
+    if (t > 0 && (wakeup_time == 0 || t < wakeup_time)) {
+      wakeup_time = t;
+    }
   }
-  return 1;
-#undef TRIES
+  return wakeup_time;
 }
 
 #undef TLS_REQUEST_LENGTH
@@ -795,7 +1093,20 @@ void tcp_rpc_add_proxy_domain (const char *domain) {
 
   struct domain_info *info = calloc (1, sizeof (struct domain_info));
   assert (info != NULL);
-  info->domain = strdup (domain);
+  info->port = 443;
+  const char *colon = strchr (domain, ':');
+  if (colon != NULL) {
+    int port = atoi (colon + 1);
+    if (port <= 0 || port > 65535 || strspn (colon + 1, "0123456789") != strlen (colon + 1)) {
+      kprintf ("Invalid port in domain %s\n", domain);
+      exit (2);
+    }
+    info->port = port;
+    info->domain = strndup (domain, colon - domain);
+  } else {
+    info->domain = strdup (domain);
+  }
+  domain = info->domain;
 
   struct domain_info **bucket = get_domain_info_bucket (domain, strlen (domain));
   info->next = *bucket;
@@ -807,101 +1118,264 @@ void tcp_rpc_add_proxy_domain (const char *domain) {
   }
 }
 
+static int resolve_domain_target (struct domain_info *info) {
+  struct hostent *host = kdb_gethostbyname (info->domain);
+  if (host == NULL || host->h_addr == NULL) {
+    kprintf ("Failed to resolve host %s\n", info->domain);
+    return 0;
+  }
+  assert (host->h_addrtype == AF_INET || host->h_addrtype == AF_INET6);
+
+  if (host->h_addrtype == AF_INET) {
+    info->target = *((struct in_addr *) host->h_addr);
+    memset (info->target_ipv6, 0, sizeof (info->target_ipv6));
+  } else {
+    assert (sizeof (struct in6_addr) == sizeof (info->target_ipv6));
+    info->target.s_addr = 0;
+    memcpy (info->target_ipv6, host->h_addr, sizeof (struct in6_addr));
+  }
+  return 1;
+}
+
+/*
+  state of domains passed to a new process on graceful upgrade, one line per domain:
+  <domain> <port> <checked> <response settings word> <address> <seconds until next check, 0 if never>
+*/
+static const char *domain_snapshot;
+
+void tcp_rpc_set_proxy_domains_snapshot (const char *snapshot) {
+  domain_snapshot = snapshot;
+}
+
+static int import_domain_snapshot (struct domain_probe *P) {
+  struct domain_info *info = P->info;
+  const char *s = domain_snapshot;
+  while (s && *s) {
+    char domain[256], addr[INET6_ADDRSTRLEN];
+    int port, checked, word;
+    double next_probe_in;
+    if (sscanf (s, "%255s %d %d %d %45s %lf", domain, &port, &checked, &word, addr, &next_probe_in) == 6 && port == info->port && !strcmp (domain, info->domain)) {
+      if (inet_pton (AF_INET, addr, &info->target) == 1) {
+        memset (info->target_ipv6, 0, sizeof (info->target_ipv6));
+      } else if (inet_pton (AF_INET6, addr, info->target_ipv6) == 1) {
+        info->target.s_addr = 0;
+      } else {
+        return 0;
+      }
+      if (checked) {
+        union domain_server_hello H = { .word = word };
+        set_domain_server_hello (info, H);
+        P->have_result = 1;
+        if (domain_probe_interval > 0 && next_probe_in > 0) {
+          P->next_probe_time = get_utime_monotonic () + (next_probe_in < domain_probe_interval ? next_probe_in : domain_probe_interval);
+        } else {
+          P->next_probe_time = 0;
+        }
+        vkprintf (1, "Taken over checked response settings of domain %s\n", info->domain);
+      }
+      return 1;
+    }
+    s = strchr (s, '\n');
+    if (s) {
+      s++;
+    }
+  }
+  return 0;
+}
+
+int tcp_rpc_export_proxy_domains (char *buf, int size) {
+  double t = get_utime_monotonic ();
+  int i, len = 0;
+  for (i = 0; i < domain_probes_num; i++) {
+    struct domain_probe *P = domain_probes[i];
+    struct domain_info *info = P->info;
+    char addr[INET6_ADDRSTRLEN];
+    if (info->target.s_addr) {
+      inet_ntop (AF_INET, &info->target, addr, sizeof (addr));
+    } else {
+      inet_ntop (AF_INET6, info->target_ipv6, addr, sizeof (addr));
+    }
+    double next_probe_in = P->next_probe_time <= 0 ? 0 : P->next_probe_time > t ? P->next_probe_time - t : 0.001;
+    int l = snprintf (buf + len, size - len, "%s %d %d %d %s %.3lf\n", info->domain, info->port, P->have_result, get_domain_server_hello (info).word, addr, next_probe_in);
+    if (l >= size - len) {
+      return -1;
+    }
+    len += l;
+  }
+  return len;
+}
+
 void tcp_rpc_init_proxy_domains() {
-  int i;
+  int i, n = 0;
+  struct domain_info *info;
+  for (i = 0; i < DOMAIN_HASH_MOD; i++) {
+    for (info = domains[i]; info != NULL; info = info->next) {
+      n++;
+    }
+  }
+  if (!n) {
+    return;
+  }
+
+  size_t size = n * sizeof (union domain_server_hello);
+  union domain_server_hello *server_hellos = mmap (0, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (server_hellos == MAP_FAILED) {
+    kprintf ("cannot allocate %lld bytes for domain response settings: %m\n", (long long) size);
+    exit (1);
+  }
+
+  domain_probes = calloc (n, sizeof (struct domain_probe *));
+  assert (domain_probes != NULL);
   for (i = 0; i < DOMAIN_HASH_MOD; i++) {
-    struct domain_info *info = domains[i];
-    while (info != NULL) {
-      if (!update_domain_info (info)) {
+    for (info = domains[i]; info != NULL; info = info->next) {
+      // default response settings until the domain is checked
+      info->server_hello = server_hellos++;
+      union domain_server_hello H;
+      H.is_reversed_extension_order = 0;
+      H.use_random_encrypted_size = 1;
+      H.server_hello_encrypted_size = 2500 + rand() % 1120;
+      set_domain_server_hello (info, H);
+
+      struct domain_probe *P = calloc (1, sizeof (struct domain_probe));
+      assert (P != NULL);
+      P->info = info;
+      P->next_probe_time = 1;
+      if (!import_domain_snapshot (P) && !resolve_domain_target (info)) {
         kprintf ("Failed to update response data about %s, so default response settings wiil be used\n", info->domain);
-        // keep target addresses as is
-        info->is_reversed_extension_order = 0;
-        info->use_random_encrypted_size = 1;
-        info->server_hello_encrypted_size = 2500 + rand() % 1120;
+        free (P);
+        continue;
       }
-
-      info = info->next;
+      info->probe = P;
+      domain_probes[domain_probes_num++] = P;
     }
   }
 }
 
-struct client_random {
+void tcp_rpc_start_proxy_domain_probes (void) {
+  if (!domain_probes_num) {
+    return;
+  }
+  job_t timer = job_timer_alloc (JC_MAIN, domain_probe_alarm, NULL);
+  job_timer_insert (timer, precise_now);
+}
+
+/*
+  client random replay cache
+
+  fixed-size set-associative table in shared memory, mapped before workers are forked,
+  so a ClientHello replayed to any worker is detected; every bucket is guarded by a spinlock
+  held only for a lookup and insertion of one entry
+*/
+
+#define CLIENT_RANDOM_BUCKET_SIZE 6
+
+struct client_random_entry {
   unsigned char random[16];
-  struct client_random *next_by_time;
-  struct client_random *next_by_hash;
-  int time;
+  int time;  // 0 for a never used entry
 };
 
-#define RANDOM_HASH_BITS 14
-static struct client_random *client_randoms[1 << RANDOM_HASH_BITS];
+struct client_random_bucket {
+  int lock;
+  struct client_random_entry entries[CLIENT_RANDOM_BUCKET_SIZE];
+} __attribute__ ((aligned (128)));
 
-static struct client_random *first_client_random;
-static struct client_random *last_client_random;
+struct client_random_cache {
+  int complete_since;  // all client randoms received since this time are still cached
+  int buckets_mask;
+  struct client_random_bucket buckets[0] __attribute__ ((aligned (128)));
+};
 
-static struct client_random **get_client_random_bucket (unsigned char random[16]) {
-  int i = RANDOM_HASH_BITS;
-  int pos = 0;
-  int id = 0;
-  while (i > 0) {
-    int bits = i < 8 ? i : 8;
-    id = (id << bits) | (random[pos++] & ((1 << bits) - 1));
-    i -= bits;
-  }
-  assert (0 <= id && id < (1 << RANDOM_HASH_BITS));
-  return client_randoms + id;
-}
+static struct client_random_cache *client_random_cache;
+static long long client_random_cache_size = DEFAULT_CLIENT_RANDOM_CACHE_SIZE;
+static int client_random_cache_time = DEFAULT_CLIENT_RANDOM_CACHE_TIME;
 
-static int have_client_random (unsigned char random[16]) {
-  struct client_random *cur = *get_client_random_bucket (random);
-  while (cur != NULL) {
-    if (memcmp (random, cur->random, 16) == 0) {
-      return 1;
-    }
-    cur = cur->next_by_hash;
+void tcp_rpcs_set_client_random_cache (long long size, int cache_time) {
+  assert (!client_random_cache);
+  if (size > 0) {
+    client_random_cache_size = size;
+  }
+  if (cache_time > 0) {
+    client_random_cache_time = cache_time;
   }
-  return 0;
 }
 
-static void add_client_random (unsigned char random[16]) {
-  struct client_random *entry = malloc (sizeof (struct client_random));
-  memcpy (entry->random, random, 16);
-  entry->time = now;
-  entry->next_by_time = NULL;
-  if (last_client_random == NULL) {
-    assert (first_client_random == NULL);
-    first_client_random = last_client_random = entry;
-  } else {
-    last_client_random->next_by_time = entry;
-    last_client_random = entry;
+void tcp_rpcs_init_client_random_cache (void) {
+  if (client_random_cache) {
+    return;
   }
-
-  struct client_random **bucket = get_client_random_bucket (random);
-  entry->next_by_hash = *bucket;
-  *bucket = entry;
+  long long buckets = 1;
+  while (buckets * 2 * CLIENT_RANDOM_BUCKET_SIZE <= client_random_cache_size && buckets < (1 << 30)) {
+    buckets *= 2;
+  }
+  size_t size = sizeof (struct client_random_cache) + buckets * sizeof (struct client_random_bucket);
+  void *ptr = mmap (0, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (ptr == MAP_FAILED) {
+    kprintf ("cannot allocate %lld bytes for client random cache: %m\n", (long long) size);
+    exit (1);
+  }
+  client_random_cache = ptr;
+  client_random_cache->buckets_mask = buckets - 1;
+  client_random_cache->complete_since = time (0);
+  client_random_cache_capacity = buckets * CLIENT_RANDOM_BUCKET_SIZE;
+  vkprintf (1, "client random cache: %lld entries, %d seconds\n", client_random_cache_capacity, client_random_cache_time);
 }
 
-#define MAX_CLIENT_RANDOM_CACHE_TIME 2 * 86400
+static int client_random_cache_complete_since (void) {
+  int since = now - client_random_cache_time + 1;
+  int t = client_random_cache->complete_since;
+  return t > since ? t : since;
+}
 
-static void delete_old_client_randoms() {
-  while (first_client_random != last_client_random) {
-    assert (first_client_random != NULL);
-    if (first_client_random->time > now - MAX_CLIENT_RANDOM_CACHE_TIME) {
-      return;
+static void client_random_cache_evicted (int time) {
+  int *since = &client_random_cache->complete_since;
+  int old = *since;
+  while (old <= time) {
+    int cur = __sync_val_compare_and_swap (since, old, time + 1);
+    if (cur == old) {
+      break;
     }
+    old = cur;
+  }
+}
 
-    struct client_random *entry = first_client_random;
-    assert (entry->next_by_hash == NULL);
-
-    first_client_random = first_client_random->next_by_time;
+/* returns 1 if the client random was seen before, otherwise remembers it */
+static int check_add_client_random (unsigned char random[16]) {
+  assert (client_random_cache);
+  struct client_random_bucket *B = &client_random_cache->buckets[*(unsigned *)random & client_random_cache->buckets_mask];
+  int expired = now - client_random_cache_time;
+  int i, victim = 0, res = 0;
 
-    struct client_random **cur = get_client_random_bucket (entry->random);
-    while (*cur != entry) {
-      cur = &(*cur)->next_by_hash;
+  while (__sync_lock_test_and_set (&B->lock, 1)) {
+    while (B->lock) {
+      __asm__ __volatile__ ("" ::: "memory");
+    }
+  }
+  for (i = 0; i < CLIENT_RANDOM_BUCKET_SIZE; i++) {
+    struct client_random_entry *E = &B->entries[i];
+    if (E->time > expired && !memcmp (E->random, random, 16)) {
+      res = 1;
+      break;
     }
-    *cur = NULL;
+    if (E->time < B->entries[victim].time) {
+      victim = i;
+    }
+  }
+  if (!res) {
+    struct client_random_entry *E = &B->entries[victim];
+    if (E->time > expired) {
+      // bucket is full of live entries, replays of the evicted one can't be detected anymore
+      client_random_cache_evicted (E->time);
+      MODULE_STAT->client_random_evictions ++;
+    }
+    memcpy (E->random, random, 16);
+    E->time = now;
+  }
+  __sync_lock_release (&B->lock);
 
-    free (entry);
+  if (res) {
+    MODULE_STAT->client_random_replays ++;
   }
+  return res;
 }
 
 static int is_allowed_timestamp (int timestamp) {
@@ -912,12 +1386,12 @@ static int is_allowed_timestamp (int timestamp) {
     return 0;
   }
 
-  // first_client_random->time is an exact time when corresponding request was received
-  // if the timestamp is bigger than (first_client_random->time + 3), then the current request could be accepted
-  // only after the request with first_client_random, so the client random still must be cached
-  // if the request wasn't accepted, then the client_random still will be cached for MAX_CLIENT_RANDOM_CACHE_TIME seconds,
-  // so we can miss duplicate request only after a lot of time has passed
-  if (first_client_random != NULL && timestamp > first_client_random->time + 3) {
+  // client randoms of all requests received since complete_since are cached
+  // if the timestamp is bigger than (complete_since + 3), then the current request could be accepted
+  // only after complete_since, so the client random still must be cached
+  // if the request wasn't accepted, then the client_random still will be cached for client_random_cache_time seconds,
+  // so we can miss duplicate request only after a lot of time has passed or after it was evicted from the full cache
+  if (timestamp > client_random_cache_complete_since () + 3) {
     vkprintf (1, "Allow new request with timestamp %d\n", timestamp);
     return 1;
   }
@@ -926,7 +1400,7 @@ static int is_allowed_timestamp (int timestamp) {
   // the allowed error must be big enough to allow requests after time synchronization
   const int MAX_ALLOWED_TIMESTAMP_ERROR = 10 * 60;
   if (timestamp > now - MAX_ALLOWED_TIMESTAMP_ERROR) {
-    // this can happen only first (MAX_ALLOWED_TIMESTAMP_ERROR + 3) sceonds after first_client_random->time
+    // this can happen only first (MAX_ALLOWED_TIMESTAMP_ERROR + 3) sceonds after complete_since
     vkprintf (1, "Allow recent request with timestamp %d without full check for client random duplication\n", timestamp);
     return 1;
   }
@@ -947,7 +1421,7 @@ static int proxy_connection (connection_job_t C, const struct domain_info *info)
     return 0;
   }
 
-  int port = c->our_port == 80 ? 80 : 443;
+  int port = c->our_port == 80 ? 80 : info->port;
 
   int cfd = -1;
   if (info->target.s_addr) {
@@ -992,11 +1466,25 @@ int tcp_rpcs_ext_alarm (connection_job_t C) {
 }
 
 int tcp_rpcs_ext_init_accepted (connection_job_t C) {
+  // handshake start, overwritten by the first forwarded query
+  CONN_INFO(C)->query_start_time = precise_now;
   job_timer_insert (C, precise_now + 10);
   return tcp_rpcs_init_accepted_nohs (C);
 }
 
+static int tcp_rpcs_compact_parse_execute_packets (connection_job_t C);
+
 int tcp_rpcs_compact_parse_execute (connection_job_t C) {
+  // proxy_connection() may switch the connection type, so remember the functions beforehand
+  struct tcp_rpc_server_functions *F = TCP_RPCS_FUNC(C);
+  int res = tcp_rpcs_compact_parse_execute_packets (C);
+  if (F->flush_execute) {
+    F->flush_execute (C);
+  }
+  return res;
+}
+
+static int tcp_rpcs_compact_parse_execute_packets (connection_job_t C) {
 #define RETURN_TLS_ERROR(info) \
   return proxy_connection (C, info);  
 
@@ -1142,17 +1630,15 @@ int tcp_rpcs_compact_parse_execute (connection_job_t C) {
         memcpy (client_random, client_hello + 11, 32);
         memset (client_hello + 11, '\0', 32);
 
-        if (have_client_random (client_random)) {
+        if (check_add_client_random (client_random)) {
           vkprintf (1, "Receive again request with the same client random\n");
           RETURN_TLS_ERROR(info);
         }
-        add_client_random (client_random);
-        delete_old_client_randoms();
 
         unsigned char expected_random[32];
         int secret_id;
         for (secret_id = 0; secret_id < ext_secret_cnt; secret_id++) {
-          sha256_hmac (ext_secret[secret_id], 16, client_hello, len, expected_random);
+          ext_secret_hmac (secret_id, client_hello, len, expected_random);
           if (memcmp (expected_random, client_random, 28) == 0) {
             break;
           }
@@ -1187,7 +1673,8 @@ int tcp_rpcs_compact_parse_execute (connection_job_t C) {
         c->flags |= C_IS_TLS;
         c->left_tls_packet_length = -1;
 
-        int encrypted_size = get_domain_server_hello_encrypted_size (info);
+        union domain_server_hello server_hello = get_domain_server_hello (info);
+        int encrypted_size = get_domain_server_hello_encrypted_size (&server_hello);
         int response_size = 127 + 6 + 5 + encrypted_size;
         unsigned char *buffer = malloc (32 + response_size);
         assert (buffer != NULL);
@@ -1202,7 +1689,7 @@ int tcp_rpcs_compact_parse_execute (connection_job_t C) {
 
         pos = 81;
         int tls_server_extensions[3] = {0x33, 0x2b, -1};
-        if (info->is_reversed_extension_order) {
+        if (server_hello.is_reversed_extension_order) {
           int t = tls_server_extensions[0];
           tls_server_extensions[0] = tls_server_extensions[1];
           tls_server_extensions[1] = t;
@@ -1212,7 +1699,7 @@ int tcp_rpcs_compact_parse_execute (connection_job_t C) {
           if (tls_server_extensions[i] == 0x33) {
             assert (pos + 40 <= response_size);
             memcpy (response_buffer + pos, "\x00\x33\x00\x24\x00\x1d\x00\x20", 8);
-            generate_public_key (response_buffer + pos + 8);
+            get_public_key_share (response_buffer + pos + 8);
             pos += 40;
           } else if (tls_server_extensions[i] == 0x2b) {
             assert (pos + 5 <= response_size);
@@ -1231,7 +1718,7 @@ int tcp_rpcs_compact_parse_execute (connection_job_t C) {
         RAND_bytes (response_buffer + pos, encrypted_size);
 
         unsigned char server_random[32];
-        sha256_hmac (ext_secret[secret_id], 16, buffer, 32 + response_size, server_random);
+        ext_secret_hmac (secret_id, buffer, 32 + response_size, server_random);
         memcpy (response_buffer + 11, server_random, 32);
 
         struct raw_message *m = calloc (sizeof (struct raw_message), 1);
@@ -1272,21 +1759,17 @@ int tcp_rpcs_compact_parse_execute (connection_job_t C) {
       unsigned char k[48];
       assert (rwm_fetch_lookup (&c->in, random_header, 64) == 64);
         
-      unsigned char random_header_sav[64];
-      memcpy (random_header_sav, random_header, 64);
-      
       struct aes_key_data key_data;
       
       int ok = 0;
       int secret_id;
       for (secret_id = 0; secret_id < 1 || secret_id < ext_secret_cnt; secret_id++) {
-        if (ext_secret_cnt > 0) {
-          memcpy (k, random_header + 8, 32);
-          memcpy (k + 32, ext_secret[secret_id], 16);
-          sha256 (k, 48, key_data.read_key);
-        } else {
-          memcpy (key_data.read_key, random_header + 8, 32);
+        ext_secret_read_key (random_header, ext_secret_cnt > 0 ? secret_id : -1, key_data.read_key);
+        unsigned tag = ext_header_decrypt_tag (random_header, key_data.read_key);
+        if (tag != 0xdddddddd && tag != 0xeeeeeeee && tag != 0xefefefef) {
+          continue;
         }
+        // full key setup only for the matching secret
         memcpy (key_data.read_iv, random_header + 40, 16);
 
         int i;
@@ -1299,6 +1782,7 @@ int tcp_rpcs_compact_parse_execute (connection_job_t C) {
 
         if (ext_secret_cnt > 0) {
           memcpy (k, key_data.write_key, 32);
+          memcpy (k + 32, ext_secret[secret_id], 16);
           sha256 (k, 48, key_data.write_key);
         }
 
@@ -1306,41 +1790,40 @@ int tcp_rpcs_compact_parse_execute (connection_job_t C) {
         assert (c->crypto);
         struct aes_crypto *T = c->crypto;
 
-        evp_crypt (T->read_aeskey, random_header, random_header, 64);
-        unsigned tag = *(unsigned *)(random_header + 56);
+        aes256_crypt (T->read_aeskey, random_header, random_header, 64);
+        assert (*(unsigned *)(random_header + 56) == tag);
 
-        if (tag == 0xdddddddd || tag == 0xeeeeeeee || tag == 0xefefefef) {
-          if (tag != 0xdddddddd && allow_only_tls) {
-            vkprintf (1, "Expected random padding mode\n");
-            RETURN_TLS_ERROR(default_domain_info);
-          }
-          assert (rwm_skip_data (&c->in, 64) == 64);
-          rwm_union (&c->in_u, &c->in);
-          rwm_init (&c->in, 0);
-          // T->read_pos = 64;
-          D->in_packet_num = 0;
-          switch (tag) {
-            case 0xeeeeeeee:
-              D->flags |= RPC_F_MEDIUM | RPC_F_EXTMODE2;
-              break;
-            case 0xdddddddd:
-              D->flags |= RPC_F_MEDIUM | RPC_F_EXTMODE2 | RPC_F_PAD;
-              break;
-            case 0xefefefef:
-              D->flags |= RPC_F_COMPACT | RPC_F_EXTMODE2;
-              break;
-          }
-          assert (c->type->crypto_decrypt_input (C) >= 0);
-
-          int target = *(short *)(random_header + 60);
-          D->extra_int4 = target;
-          vkprintf (1, "tcp opportunistic encryption mode detected, tag = %08x, target=%d\n", tag, target);
-          ok = 1;
-          break;
-        } else {
-          aes_crypto_free (C);
-          memcpy (random_header, random_header_sav, 64);
+        if (tag != 0xdddddddd && allow_only_tls) {
+          vkprintf (1, "Expected random padding mode\n");
+          RETURN_TLS_ERROR(default_domain_info);
         }
+        assert (rwm_skip_data (&c->in, 64) == 64);
+        rwm_union (&c->in_u, &c->in);
+        rwm_init (&c->in, 0);
+        // T->read_pos = 64;
+        D->in_packet_num = 0;
+        switch (tag) {
+          case 0xeeeeeeee:
+            D->flags |= RPC_F_MEDIUM | RPC_F_EXTMODE2;
+            break;
+          case 0xdddddddd:
+            D->flags |= RPC_F_MEDIUM | RPC_F_EXTMODE2 | RPC_F_PAD;
+            break;
+          case 0xefefefef:
+            D->flags |= RPC_F_COMPACT | RPC_F_EXTMODE2;
+            break;
+        }
+        assert (c->type->crypto_decrypt_input (C) >= 0);
+        if (c->query_start_time > 0) {
+          stats_histogram_add (&MODULE_STAT->handshake_time, precise_now - c->query_start_time, HANDSHAKE_TIME_UNIT);
+          c->query_start_time = 0;
+        }
+
+        int target = *(short *)(random_header + 60);
+        D->extra_int4 = target;
+        vkprintf (1, "tcp opportunistic encryption mode detected, tag = %08x, target=%d\n", tag, target);
+        ok = 1;
+        break;
       }
 
       if (ok) {
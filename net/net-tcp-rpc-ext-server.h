@@ -25,12 +25,44 @@
 #include "net/net-tcp-rpc-server.h"
 #include "net/net-connections.h"
 
+struct stats_histogram;
+
 extern conn_type_t ct_tcp_rpc_ext_server;
 
 int tcp_rpcs_compact_parse_execute (connection_job_t c);
 
 void tcp_rpcs_set_ext_secret(unsigned char secret[16]);
 
+// domain may be followed by :port of its server, 443 by default
 void tcp_rpc_add_proxy_domain (const char *domain);
 
+// resolves domains and sets default response settings in shared memory, must be called before workers are forked
 void tcp_rpc_init_proxy_domains();
+
+// addresses and response settings of domains taken over from the previous process, must be set before tcp_rpc_init_proxy_domains ()
+void tcp_rpc_set_proxy_domains_snapshot (const char *snapshot);
+// returns length of the snapshot, -1 if it does not fit
+int tcp_rpc_export_proxy_domains (char *buf, int size);
+
+#define DEFAULT_DOMAIN_PROBE_INTERVAL 600.0
+
+// 0 checks domains only once after start
+void tcp_rpcs_set_domain_probe_interval (double interval);
+
+// checks all domains in background from the main event loop and then every probe interval
+void tcp_rpc_start_proxy_domain_probes (void);
+
+void tcp_rpcs_init_key_share_pool (void);
+
+#define DEFAULT_CLIENT_RANDOM_CACHE_SIZE (1 << 20)
+#define DEFAULT_CLIENT_RANDOM_CACHE_TIME (2 * 86400)
+
+// size is rounded down to a power-of-two number of buckets; zero keeps the default
+void tcp_rpcs_set_client_random_cache (long long size, int cache_time);
+
+// maps the shared replay cache, must be called before workers are forked
+void tcp_rpcs_init_client_random_cache (void);
+
+// time from accept to completed obfuscated handshake, histogram unit is 100us
+#define HANDSHAKE_TIME_UNIT 0.0001
+void fetch_ext_server_handshake_time (struct stats_histogram *H);
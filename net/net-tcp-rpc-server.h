@@ -45,6 +45,7 @@ struct tcp_rpc_server_functions {
   int mode_flags;  /* 1 = ignore PID mismatch */
   void *memcache_fallback_type, *memcache_fallback_extra;
   void *http_fallback_type, *http_fallback_extra;
+  void (*flush_execute)(connection_job_t c);	/* invoked after each parse_execute() pass, may be NULL */
 };
 
 #define TCP_RPC_IGNORE_PID	RPC_MF_IGNORE_PID
@@ -35,6 +35,7 @@ MODULE_STAT_TYPE {
   long long event_timer_insert_ops; 
   long long event_timer_remove_ops; 
   long long event_timer_alarms;
+  long long event_timer_cascades;
   int total_timers;
 };
 
@@ -44,119 +45,207 @@ MODULE_STAT_FUNCTION
   SB_SUM_ONE_LL (event_timer_insert_ops);
   SB_SUM_ONE_LL (event_timer_remove_ops);
   SB_SUM_ONE_LL (event_timer_alarms);
+  SB_SUM_ONE_LL (event_timer_cascades);
   SB_SUM_ONE_I (total_timers);
 MODULE_STAT_FUNCTION_END
 /* }}} */
 
-static __thread event_timer_t **et_heap;
-__thread int et_heap_size;
+/*
+  hierarchical timing wheel, one per thread
 
+  time is counted in ticks of 1/TIMER_TICKS_PER_SECOND; a timer due within TIMER_WHEEL_SLOTS ticks
+  is kept in the level 0 slot of its tick, a later one in the slot of the first level covering it,
+  and is moved a level down (cascaded) when the wheel reaches the range of that slot;
+  insertion and removal are O(1), a timer expires not earlier than its wakeup_time and
+  less than one tick later, timers of the same tick expire in arbitrary order
+*/
 
-static inline int basic_et_adjust (event_timer_t *et, int i) {
-  int j;
-  while (i > 1) {
-    j = (i >> 1);
-    if (et_heap[j]->wakeup_time <= et->wakeup_time) {
-      break;
+#define TIMER_TICKS_PER_SECOND 1000
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+// covers 2^30 ticks, about 12 days; later timers wait in the last slot and are cascaded again
+#define TIMER_WHEEL_LEVELS 5
+
+struct timer_wheel {
+  long long next_tick;  // all earlier ticks are processed
+  unsigned long long occupied[TIMER_WHEEL_LEVELS];  // bitmaps of non-empty slots
+  event_timer_t *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+};
+
+static __thread struct timer_wheel *timer_wheel;
+static __thread int event_timers_num;
+
+static struct timer_wheel *get_timer_wheel (void) {
+  if (!timer_wheel) {
+    timer_wheel = calloc (sizeof (struct timer_wheel), 1);
+    assert (timer_wheel);
+    timer_wheel->next_tick = (long long) (get_utime_monotonic () * TIMER_TICKS_PER_SECOND);
+  }
+  return timer_wheel;
+}
+
+// first tick not earlier than wakeup_time
+static inline long long event_timer_tick (event_timer_t *et) {
+  double t = et->wakeup_time * TIMER_TICKS_PER_SECOND;
+  long long tick = (long long) t;
+  return tick < t ? tick + 1 : tick;
+}
+
+static void timer_wheel_link (struct timer_wheel *W, event_timer_t *et) {
+  long long tick = event_timer_tick (et);
+  long long delta = tick - W->next_tick;
+  if (delta < 0) {
+    tick = W->next_tick;
+    delta = 0;
+  }
+  int level = 0;
+  while (level < TIMER_WHEEL_LEVELS - 1 && delta >= (1LL << (TIMER_WHEEL_BITS * (level + 1)))) {
+    level ++;
+  }
+  if (delta >= (1LL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))) {
+    tick = W->next_tick + (1LL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+  }
+  int slot = (tick >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+  event_timer_t **head = &W->slots[level][slot];
+  et->prev = NULL;
+  et->next = *head;
+  if (*head) {
+    (*head)->prev = et;
+  }
+  *head = et;
+  W->occupied[level] |= 1ULL << slot;
+  et->h_idx = level * TIMER_WHEEL_SLOTS + slot + 1;
+}
+
+static void timer_wheel_unlink (struct timer_wheel *W, event_timer_t *et) {
+  int level = (et->h_idx - 1) / TIMER_WHEEL_SLOTS;
+  int slot = (et->h_idx - 1) & TIMER_WHEEL_MASK;
+  assert (level >= 0 && level < TIMER_WHEEL_LEVELS);
+  if (et->prev) {
+    et->prev->next = et->next;
+  } else {
+    assert (W->slots[level][slot] == et);
+    W->slots[level][slot] = et->next;
+    if (!et->next) {
+      W->occupied[level] &= ~(1ULL << slot);
     }
-    et_heap[i] = et_heap[j];
-    et_heap[i]->h_idx = i;
-    i = j;
   }
-  j = 2*i;
-  while (j <= et_heap_size) {
-    if (j < et_heap_size && et_heap[j]->wakeup_time > et_heap[j+1]->wakeup_time) {
-      j++;
+  if (et->next) {
+    et->next->prev = et->prev;
+  }
+  et->next = et->prev = NULL;
+  et->h_idx = 0;
+}
+
+// moves timers of the slots starting at W->next_tick to lower levels
+static void timer_wheel_cascade (struct timer_wheel *W) {
+  long long tick = W->next_tick;
+  int level;
+  for (level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+    int slot = (tick >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+    event_timer_t *et = W->slots[level][slot];
+    W->slots[level][slot] = NULL;
+    W->occupied[level] &= ~(1ULL << slot);
+    while (et) {
+      event_timer_t *next = et->next;
+      timer_wheel_link (W, et);
+      MODULE_STAT->event_timer_cascades ++;
+      et = next;
     }
-    if (et->wakeup_time <= et_heap[j]->wakeup_time) {
+    if (slot) {
       break;
     }
-    et_heap[i] = et_heap[j];
-    et_heap[i]->h_idx = i;
-    i = j;
-    j <<= 1;
   }
-  et_heap[i] = et;
-  et->h_idx = i;
-  return i;
 }
 
-int insert_event_timer (event_timer_t *et) {
-  if (!et_heap) {
-    et_heap = calloc (sizeof (void *), MAX_EVENT_TIMERS);
+// exact for timers due within TIMER_WHEEL_SLOTS ticks, otherwise the tick of the next cascade
+static long long timer_wheel_first_tick (struct timer_wheel *W) {
+  long long first_tick = -1;
+  int level;
+  for (level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+    unsigned long long occupied = W->occupied[level];
+    if (!occupied) {
+      continue;
+    }
+    // on upper levels the slot of the current unit is already cascaded, unless next_tick starts this unit
+    long long unit = W->next_tick >> (TIMER_WHEEL_BITS * level);
+    if (W->next_tick & ((1LL << (TIMER_WHEEL_BITS * level)) - 1)) {
+      unit ++;
+    }
+    int start = unit & TIMER_WHEEL_MASK;
+    unsigned long long rotated = start ? (occupied >> start) | (occupied << (TIMER_WHEEL_SLOTS - start)) : occupied;
+    long long tick = (unit + __builtin_ctzll (rotated)) << (TIMER_WHEEL_BITS * level);
+    if (first_tick < 0 || tick < first_tick) {
+      first_tick = tick;
+    }
   }
+  return first_tick;
+}
+
+int insert_event_timer (event_timer_t *et) {
+  struct timer_wheel *W = get_timer_wheel ();
   MODULE_STAT->event_timer_insert_ops ++;
-  int i;
   if (et->h_idx) {
-    i = et->h_idx;
-    assert (i > 0 && i <= et_heap_size && et_heap[i] == et);
+    timer_wheel_unlink (W, et);
   } else {
     MODULE_STAT->total_timers ++;
-    assert (et_heap_size < MAX_EVENT_TIMERS);
-    i = ++et_heap_size;
+    event_timers_num ++;
   }
-  return basic_et_adjust (et, i);
+  timer_wheel_link (W, et);
+  return et->h_idx;
 }
 
 int remove_event_timer (event_timer_t *et) {
-  if (!et_heap) {
-    et_heap = calloc (sizeof (void *), MAX_EVENT_TIMERS);
-  }
-  int i = et->h_idx;
-  if (!i) {
+  if (!et->h_idx) {
     return 0;
   }
   MODULE_STAT->total_timers --;
   MODULE_STAT->event_timer_remove_ops ++;
-  assert (i > 0 && i <= et_heap_size && et_heap[i] == et);
-  et->h_idx = 0;
-
-  et = et_heap[et_heap_size--];
-  if (i > et_heap_size) {
-    return 1;
-  }
-  basic_et_adjust (et, i);
+  event_timers_num --;
+  timer_wheel_unlink (get_timer_wheel (), et);
   return 1;
 }
-  
-int thread_run_timers (void) {  
-  if (!et_heap) {
-    et_heap = calloc (sizeof (void *), MAX_EVENT_TIMERS);
-  }
-  double wait_time;
-  event_timer_t *et;
-  if (!et_heap_size) {
-    return 100000;
-  }
-  wait_time = et_heap[1]->wakeup_time - precise_now;
-  if (wait_time > 0) {
-    //do not remove this useful debug!
-    vkprintf (3, "%d event timers, next in %.3f seconds\n", et_heap_size, wait_time);
-    return (int) (wait_time*1000) + 1;
+
+int thread_run_timers (void) {
+  struct timer_wheel *W = get_timer_wheel ();
+  long long now_tick = (long long) (precise_now * TIMER_TICKS_PER_SECOND);
+  while (W->next_tick <= now_tick && event_timers_num > 0) {
+    int slot = W->next_tick & TIMER_WHEEL_MASK;
+    if (!slot) {
+      timer_wheel_cascade (W);
+    }
+    event_timer_t *et;
+    while ((et = W->slots[0][slot]) != NULL) {
+      remove_event_timer (et);
+      et->wakeup (et);
+      MODULE_STAT->event_timer_alarms ++;
+    }
+    // skip empty slots, and whole rotations if level 0 is empty
+    unsigned long long later = slot < TIMER_WHEEL_MASK ? W->occupied[0] >> (slot + 1) : 0;
+    long long next_tick = later ? W->next_tick + 1 + __builtin_ctzll (later) : (W->next_tick | TIMER_WHEEL_MASK) + 1;
+    if (!W->occupied[0] && event_timers_num > 0) {
+      long long first_tick = timer_wheel_first_tick (W);
+      if (first_tick > next_tick) {
+        next_tick = first_tick;
+      }
+    }
+    W->next_tick = next_tick <= now_tick ? next_tick : now_tick + 1;
   }
-  while (et_heap_size > 0 && et_heap[1]->wakeup_time <= precise_now) {
-    et = et_heap[1];
-    assert (et->h_idx == 1);
-    remove_event_timer (et);
-    et->wakeup (et); 
-    MODULE_STAT->event_timer_alarms ++;
+  if (W->next_tick <= now_tick) {
+    W->next_tick = now_tick + 1;
   }
-  
-  if (!et_heap_size) {
+
+  if (!event_timers_num) {
     return 100000;
   }
-  wait_time = et_heap[1]->wakeup_time - precise_now;
-  if (wait_time > 0) {
-    //do not remove this useful debug!
-    vkprintf (3, "%d event timers, next in %.3f seconds\n", et_heap_size, wait_time);
-    return (int) (wait_time*1000) + 1;
-  }
-
-  assert (0);
-  return 0;
+  double wait_time = timers_get_first () - precise_now;
+  //do not remove this useful debug!
+  vkprintf (3, "%d event timers, next in %.3f seconds\n", event_timers_num, wait_time);
+  return wait_time > 0 ? (int) (wait_time*1000) + 1 : 1;
 }
 
 double timers_get_first (void) {
-  if (!et_heap_size) { return 0; }
-  return et_heap[1]->wakeup_time;
+  if (!event_timers_num) { return 0; }
+  return (double) timer_wheel_first_tick (timer_wheel) / TIMER_TICKS_PER_SECOND;
 }
@@ -19,17 +19,19 @@
 */
 #pragma once
 
-#define	MAX_EVENT_TIMERS	(1 << 19)
-
 typedef struct event_timer event_timer_t;
 
 struct event_timer {
-  int h_idx;
+  int h_idx;  // non-zero while queued: timer wheel slot + 1
   int flags;
   int (*wakeup)(event_timer_t *et);
   double wakeup_time;
   double real_wakeup_time;
+  event_timer_t *next, *prev;  // timer wheel slot list
 };
 
+int insert_event_timer (event_timer_t *et);
+int remove_event_timer (event_timer_t *et);
+
 int thread_run_timers (void);
 double timers_get_first (void);
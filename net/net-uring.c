@@ -0,0 +1,451 @@
+/*
+    This file is part of Mtproto-proxy Library.
+
+    Mtproto-proxy Library is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    Mtproto-proxy Library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with Mtproto-proxy Library.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+
+#include "net/net-uring.h"
+#include "net/net-msg-buffers.h"
+#include "common/common-stats.h"
+#include "common/kprintf.h"
+
+/*
+  io_uring is driven by raw syscalls, liburing is not required;
+  no SQPOLL thread: every request is submitted by io_uring_enter() in the thread that prepared it
+*/
+
+#define	URING_ENTRIES	1024
+#define	URING_CQ_ENTRIES	16384
+#define	URING_RECV_BUFFERS	512	/* power of 2 */
+#define	URING_RECV_BUFFER_SIZE	16384
+#define	URING_RECV_COPY_MAX	512	/* smaller receives are copied, the ring buffer is reused at once */
+#define	URING_CQE_BATCH	256
+
+/* {{{ STAT */
+#define MODULE uring
+
+MODULE_STAT_TYPE {
+  long long recv_submitted;
+  long long recv_completions;
+  long long recv_bytes;
+  long long recv_copied;
+  long long recv_nobufs;
+  long long send_submitted;
+  long long send_completions;
+  long long send_bytes;
+  long long cancels;
+  long long completion_wakeups;
+  long long submit_errors;
+};
+
+MODULE_INIT
+
+MODULE_STAT_FUNCTION
+  sb_printf (sb, "uring_enabled\t%d\n", net_uring_enabled);
+  SB_SUM_ONE_LL (recv_submitted);
+  SB_SUM_ONE_LL (recv_completions);
+  SB_SUM_ONE_LL (recv_bytes);
+  SB_SUM_ONE_LL (recv_copied);
+  SB_SUM_ONE_LL (recv_nobufs);
+  SB_SUM_ONE_LL (send_submitted);
+  SB_SUM_ONE_LL (send_completions);
+  SB_SUM_ONE_LL (send_bytes);
+  SB_SUM_ONE_LL (cancels);
+  SB_SUM_ONE_LL (completion_wakeups);
+  SB_SUM_ONE_LL (submit_errors);
+MODULE_STAT_FUNCTION_END
+/* }}} */
+
+int net_uring_requested;
+int net_uring_enabled;
+
+static int ring_fd = -1;
+static int recv_multishot = 1;
+static pthread_mutex_t submit_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct {
+  unsigned *head, *tail, *array;
+  unsigned mask, entries;
+  struct io_uring_sqe *sqes;
+} SQ;
+
+static struct {
+  unsigned *head, *tail;
+  unsigned mask;
+  struct io_uring_cqe *cqes;
+} CQ;
+
+static struct io_uring_buf_ring *recv_ring;
+static struct msg_buffer *recv_buffers[URING_RECV_BUFFERS];
+static unsigned short recv_ring_tail;
+
+static inline int sys_io_uring_setup (unsigned entries, struct io_uring_params *p) {
+  return syscall (__NR_io_uring_setup, entries, p);
+}
+
+static inline int sys_io_uring_enter (int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+  return syscall (__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static inline int sys_io_uring_register (int fd, unsigned opcode, void *arg, unsigned nr_args) {
+  return syscall (__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* {{{ provided receive buffers */
+
+/* only JC_URING thread (or main thread during init) touches the tail */
+static void recv_ring_add (struct msg_buffer *X, int bid) {
+  struct io_uring_buf *B = &recv_ring->bufs[recv_ring_tail & (URING_RECV_BUFFERS - 1)];
+  B->addr = (uintptr_t) X->data;
+  B->len = X->chunk->buffer_size;
+  B->bid = bid;
+  recv_buffers[bid] = X;
+  recv_ring_tail ++;
+  __atomic_store_n (&recv_ring->tail, recv_ring_tail, __ATOMIC_RELEASE);
+}
+
+static int recv_ring_init (void) {
+  size_t size = URING_RECV_BUFFERS * sizeof (struct io_uring_buf);
+  recv_ring = mmap (0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (recv_ring == MAP_FAILED) {
+    recv_ring = 0;
+    return -1;
+  }
+
+  struct io_uring_buf_reg reg;
+  memset (&reg, 0, sizeof (reg));
+  reg.ring_addr = (uintptr_t) recv_ring;
+  reg.ring_entries = URING_RECV_BUFFERS;
+  reg.bgid = 0;
+  if (sys_io_uring_register (ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+    vkprintf (0, "io_uring: cannot register provided buffer ring: %m\n");
+    munmap (recv_ring, size);
+    recv_ring = 0;
+    return -1;
+  }
+
+  int i;
+  struct msg_buffer *X = 0;
+  for (i = 0; i < URING_RECV_BUFFERS; i++) {
+    X = alloc_msg_buffer (X, URING_RECV_BUFFER_SIZE);
+    if (!X) {
+      vkprintf (0, "**FATAL**: cannot allocate io_uring receive buffer\n");
+      exit (2);
+    }
+    recv_ring_add (X, i);
+  }
+  return 0;
+}
+
+/* takes the buffer with given id out of the ring, wraps received bytes into a raw message and gives the ring a buffer back */
+static struct raw_message *recv_ring_take (int bid, int len) {
+  assert (bid >= 0 && bid < URING_RECV_BUFFERS);
+  struct msg_buffer *X = recv_buffers[bid];
+  assert (X && len > 0 && len <= X->chunk->buffer_size);
+
+  struct raw_message *in = malloc (sizeof (*in));
+  if (len <= URING_RECV_COPY_MAX) {
+    rwm_create (in, X->data, len);
+    recv_ring_add (X, bid);
+    MODULE_STAT->recv_copied ++;
+    return in;
+  }
+
+  rwm_init (in, 0);
+  struct msg_part *mp = new_msg_part (0, X);
+  mp->offset = 0;
+  mp->data_end = len;
+  in->first = in->last = mp;
+  in->total_bytes = len;
+  in->first_offset = 0;
+  in->last_offset = len;
+
+  struct msg_buffer *Y = alloc_msg_buffer (X, URING_RECV_BUFFER_SIZE);
+  if (!Y) {
+    vkprintf (0, "**FATAL**: cannot allocate io_uring receive buffer\n");
+    assert (0);
+  }
+  recv_ring_add (Y, bid);
+  return in;
+}
+/* }}} */
+
+/* {{{ submission */
+
+/* submit_lock must be held */
+static struct io_uring_sqe *get_sqe (void) {
+  unsigned tail = *SQ.tail;
+  if (tail - __atomic_load_n (SQ.head, __ATOMIC_ACQUIRE) >= SQ.entries) {
+    return 0;
+  }
+  struct io_uring_sqe *sqe = &SQ.sqes[tail & SQ.mask];
+  memset (sqe, 0, sizeof (*sqe));
+  return sqe;
+}
+
+/* submit_lock must be held */
+static int submit_sqe (void) {
+  unsigned tail = *SQ.tail;
+  SQ.array[tail & SQ.mask] = tail & SQ.mask;
+  __atomic_store_n (SQ.tail, tail + 1, __ATOMIC_RELEASE);
+
+  while (1) {
+    int r = sys_io_uring_enter (ring_fd, 1, 0, 0);
+    if (r >= 0) {
+      return 0;
+    }
+    if (errno != EINTR) {
+      // sqe stays in the ring and is consumed by the next io_uring_enter()
+      MODULE_STAT->submit_errors ++;
+      vkprintf (1, "io_uring_enter() failed: %m\n");
+      return 0;
+    }
+  }
+}
+
+static void prep_recv (struct io_uring_sqe *sqe, int fd) {
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = fd;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = 0;
+  if (recv_multishot) {
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+  } else {
+    sqe->len = URING_RECV_BUFFER_SIZE;
+  }
+}
+
+int net_uring_submit_recv (job_t S, int fd, int *flags, int stop_mask) /* {{{ */ {
+  assert (!((uintptr_t) S & URING_OP_MASK));
+  pthread_mutex_lock (&submit_lock);
+  struct io_uring_sqe *sqe;
+  if ((*(volatile int *) flags & stop_mask) || !(sqe = get_sqe ())) {
+    pthread_mutex_unlock (&submit_lock);
+    return -1;
+  }
+  prep_recv (sqe, fd);
+  sqe->user_data = (uintptr_t) job_incref (S) | URING_OP_RECV;
+  submit_sqe ();
+  pthread_mutex_unlock (&submit_lock);
+  MODULE_STAT->recv_submitted ++;
+  return 0;
+}
+/* }}} */
+
+int net_uring_submit_sendmsg (job_t S, int fd, int *flags, int stop_mask, struct msghdr *msg) /* {{{ */ {
+  assert (!((uintptr_t) S & URING_OP_MASK));
+  pthread_mutex_lock (&submit_lock);
+  struct io_uring_sqe *sqe;
+  if ((*(volatile int *) flags & stop_mask) || !(sqe = get_sqe ())) {
+    pthread_mutex_unlock (&submit_lock);
+    return -1;
+  }
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = fd;
+  sqe->addr = (uintptr_t) msg;
+  sqe->len = 1;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = (uintptr_t) job_incref (S) | URING_OP_SEND;
+  submit_sqe ();
+  pthread_mutex_unlock (&submit_lock);
+  MODULE_STAT->send_submitted ++;
+  return 0;
+}
+/* }}} */
+
+/* completion of the cancelled request still arrives (with -ECANCELED unless it raced) and releases the reference */
+void net_uring_cancel (job_t S, int op) /* {{{ */ {
+  pthread_mutex_lock (&submit_lock);
+  struct io_uring_sqe *sqe = get_sqe ();
+  if (sqe) {
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (uintptr_t) S | op;
+    sqe->user_data = 0;
+    submit_sqe ();
+  }
+  pthread_mutex_unlock (&submit_lock);
+  MODULE_STAT->cancels ++;
+}
+/* }}} */
+/* }}} */
+
+/* {{{ completion */
+
+static void process_recv_completion (job_t S, int res, unsigned cflags) {
+  int more = (cflags & IORING_CQE_F_MORE) != 0;
+  struct raw_message *in = 0;
+  MODULE_STAT->recv_completions ++;
+
+  if (res > 0) {
+    assert (cflags & IORING_CQE_F_BUFFER);
+    in = recv_ring_take (cflags >> IORING_CQE_BUFFER_SHIFT, res);
+    MODULE_STAT->recv_bytes += res;
+  } else if (res == -ENOBUFS) {
+    // ring was drained before we refilled it; connection rearms the request
+    MODULE_STAT->recv_nobufs ++;
+  } else if (res == -EINVAL && recv_multishot) {
+    vkprintf (0, "io_uring: multishot recv is not supported, falling back to single-shot requests\n");
+    recv_multishot = 0;
+    res = -EAGAIN;
+  }
+
+  net_server_socket_uring_received (S, in, res, more);
+  if (!more) {
+    job_decref (JOB_REF_PASS (S));
+  }
+}
+
+static void process_send_completion (job_t S, int res) {
+  MODULE_STAT->send_completions ++;
+  if (res > 0) {
+    MODULE_STAT->send_bytes += res;
+  }
+  net_server_socket_uring_sent (S, res);
+  job_decref (JOB_REF_PASS (S));
+}
+
+static int process_completions (void) {
+  int cnt = 0;
+  unsigned head = *CQ.head;
+  unsigned tail = __atomic_load_n (CQ.tail, __ATOMIC_ACQUIRE);
+
+  while (head != tail && cnt < URING_CQE_BATCH) {
+    struct io_uring_cqe *cqe = &CQ.cqes[head & CQ.mask];
+    uint64_t user_data = cqe->user_data;
+    int res = cqe->res;
+    unsigned cflags = cqe->flags;
+    head ++;
+    // release the slot before callbacks: they may submit and complete new requests
+    __atomic_store_n (CQ.head, head, __ATOMIC_RELEASE);
+    cnt ++;
+
+    if (!user_data) {
+      continue;
+    }
+    job_t S = (job_t) (uintptr_t) (user_data & ~(uint64_t) URING_OP_MASK);
+    switch (user_data & URING_OP_MASK) {
+    case URING_OP_RECV:
+      process_recv_completion (S, res, cflags);
+      break;
+    case URING_OP_SEND:
+      process_send_completion (S, res);
+      break;
+    default:
+      assert (0);
+    }
+  }
+  return cnt;
+}
+
+int do_uring_completion_job (job_t job, int op, struct job_thread *JT) /* {{{ */ {
+  if (op != JS_RUN) {
+    return JOB_ERROR;
+  }
+  if (!process_completions ()) {
+    int r = sys_io_uring_enter (ring_fd, 0, 1, IORING_ENTER_GETEVENTS);
+    if (r < 0 && errno != EINTR) {
+      vkprintf (0, "io_uring_enter(GETEVENTS) failed: %m\n");
+      usleep (1000);
+    }
+    MODULE_STAT->completion_wakeups ++;
+  }
+  // this thread belongs to the ring for good
+  return JOB_SENDSIG (JS_RUN);
+}
+/* }}} */
+/* }}} */
+
+static int net_uring_setup (void) /* {{{ */ {
+  struct io_uring_params p;
+  memset (&p, 0, sizeof (p));
+  p.flags = IORING_SETUP_CQSIZE;
+  p.cq_entries = URING_CQ_ENTRIES;
+
+  ring_fd = sys_io_uring_setup (URING_ENTRIES, &p);
+  if (ring_fd < 0) {
+    vkprintf (0, "io_uring_setup() failed: %m\n");
+    return -1;
+  }
+  if (!(p.features & IORING_FEAT_NODROP) || !(p.features & IORING_FEAT_FAST_POLL)) {
+    vkprintf (0, "io_uring: kernel lacks required features (0x%08x)\n", p.features);
+    close (ring_fd);
+    ring_fd = -1;
+    return -1;
+  }
+
+  size_t sq_size = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+  size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+  if ((p.features & IORING_FEAT_SINGLE_MMAP) && cq_size > sq_size) {
+    sq_size = cq_size;
+  }
+
+  char *sq_ptr = mmap (0, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+  assert (sq_ptr != MAP_FAILED);
+  char *cq_ptr = sq_ptr;
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+    cq_ptr = mmap (0, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+    assert (cq_ptr != MAP_FAILED);
+  }
+  SQ.sqes = mmap (0, p.sq_entries * sizeof (struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+  assert (SQ.sqes != MAP_FAILED);
+
+  SQ.head = (unsigned *) (sq_ptr + p.sq_off.head);
+  SQ.tail = (unsigned *) (sq_ptr + p.sq_off.tail);
+  SQ.array = (unsigned *) (sq_ptr + p.sq_off.array);
+  SQ.mask = *(unsigned *) (sq_ptr + p.sq_off.ring_mask);
+  SQ.entries = *(unsigned *) (sq_ptr + p.sq_off.ring_entries);
+
+  CQ.head = (unsigned *) (cq_ptr + p.cq_off.head);
+  CQ.tail = (unsigned *) (cq_ptr + p.cq_off.tail);
+  CQ.mask = *(unsigned *) (cq_ptr + p.cq_off.ring_mask);
+  CQ.cqes = (struct io_uring_cqe *) (cq_ptr + p.cq_off.cqes);
+
+  vkprintf (1, "io_uring: %u sq entries, %u cq entries, features 0x%08x\n", p.sq_entries, p.cq_entries, p.features);
+  return 0;
+}
+/* }}} */
+
+int net_uring_init (void) /* {{{ */ {
+  if (!net_uring_requested || net_uring_enabled) {
+    return net_uring_enabled;
+  }
+  if (net_uring_setup () < 0 || recv_ring_init () < 0) {
+    if (ring_fd >= 0) {
+      close (ring_fd);
+      ring_fd = -1;
+    }
+    vkprintf (0, "io_uring is not available, using epoll for tcp sockets\n");
+    return 0;
+  }
+
+  assert (create_new_job_class (JC_URING, 1, 1) >= 0);
+  job_t job = create_async_job (do_uring_completion_job, JSC_ALLOW (JC_URING, JS_RUN), -2, 0, 0, JOB_REF_NULL);
+  schedule_job (JOB_REF_PASS (job));
+
+  net_uring_enabled = 1;
+  vkprintf (0, "using io_uring for tcp sockets\n");
+  return 1;
+}
+/* }}} */
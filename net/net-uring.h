@@ -0,0 +1,59 @@
+/*
+    This file is part of Mtproto-proxy Library.
+
+    Mtproto-proxy Library is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    Mtproto-proxy Library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with Mtproto-proxy Library.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <sys/socket.h>
+
+#include "jobs/jobs.h"
+#include "net/net-msg.h"
+
+/*
+  optional io_uring backend for tcp sockets
+
+  receives are multishot recv requests that pick buffers from a provided buffer ring,
+  sends are sendmsg requests over the iovecs of the socket out raw message;
+  completions are harvested by a dedicated JC_URING thread and passed back to socket connection jobs
+*/
+
+#define	URING_OP_RECV	1
+#define	URING_OP_SEND	2
+#define	URING_OP_MASK	3
+
+#define	URING_SEND_IOVECS	64
+
+struct uring_send {
+  struct msghdr msg;
+  struct iovec iov[URING_SEND_IOVECS];
+  int inflight;	/* bytes passed to the kernel, 0 if no sendmsg is pending */
+  int res;	/* result of the last completed sendmsg */
+};
+
+extern int net_uring_requested;
+extern int net_uring_enabled;
+
+/* call once from the main thread after job classes are created; falls back to epoll on failure */
+int net_uring_init (void);
+
+/* submit a request unless (*flags & stop_mask); the request holds a reference to S until its last completion, returns -1 if not submitted */
+int net_uring_submit_recv (job_t S, int fd, int *flags, int stop_mask);
+int net_uring_submit_sendmsg (job_t S, int fd, int *flags, int stop_mask, struct msghdr *msg);
+void net_uring_cancel (job_t S, int op);
+
+/* completion callbacks, implemented by net-connections.c; invoked in JC_URING thread
+   in is NULL unless res > 0; more is set while a multishot receive stays armed */
+void net_server_socket_uring_received (job_t S, struct raw_message *in, int res, int more);
+void net_server_socket_uring_sent (job_t S, int res);